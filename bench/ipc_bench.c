@@ -0,0 +1,389 @@
+// Latency/throughput benchmark for every IPC_Mechanism.
+//
+// For each mechanism and message size the harness forks a peer. The parent
+// measures round-trip latency (ping-pong) and then one-way throughput
+// (stream N messages, wait for one acknowledgement). The parent always uses
+// the library; for sockets the child connects with plain socket calls since
+// the library only implements the listening side.
+
+#define _GNU_SOURCE
+#include "ipc.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <mqueue.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MIN_SIZE 8
+#define MAX_SIZE (8u << 20)
+#define RTT_BYTES (64ull << 20)
+#define TPUT_BYTES (256ull << 20)
+#define WARMUP 16
+
+typedef struct {
+    IPC_Mechanism mech;
+    const char *label;
+    int stream;    // Byte stream: a message may arrive in pieces
+    int mailbox;   // Single-slot mailbox: newer messages overwrite older ones
+} BenchMech;
+
+static const BenchMech mechs[] = {
+    { IPC_SHM_MUTEX,    "shm_mutex",    0, 1 },
+    { IPC_SHM_RING,     "shm_ring",     0, 0 },
+    { IPC_SHM_QUEUE,    "shm_queue",    0, 0 },
+    { IPC_MQ_POSIX,     "mq_posix",     0, 0 },
+    { IPC_MQ_SYSV,      "mq_sysv",      0, 0 },
+    { IPC_PIPE_UNNAMED, "pipe_unnamed", 1, 0 },
+    { IPC_PIPE_NAMED,   "pipe_named",   1, 0 },
+    { IPC_SOCKET_UNIX,  "socket_unix",  1, 0 },
+    { IPC_SOCKET_TCP,   "socket_tcp",   1, 0 },
+};
+
+// A pair of one-way channels between the parent and the child. Sockets are
+// bidirectional, so fwd and back are the same handle there.
+typedef struct {
+    const BenchMech *m;
+    IPC_Handle fwd;
+    IPC_Handle back;
+    int peer_fd;   // Child's end of a socket connection
+    char names[2][96];
+    char sock_path[64];
+    int port;
+} Chan;
+
+static int opt_cpu[2] = { -1, -1 };
+static size_t opt_max_size = MAX_SIZE;
+static size_t opt_max_iters = 0;
+static const char *opt_only = NULL;
+static char sysv_key_path[64];
+static int next_port;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void pin(int cpu) {
+    if (cpu < 0) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) perror("sched_setaffinity");
+}
+
+static size_t iters_for(uint64_t budget, size_t size, size_t lo, size_t hi) {
+    size_t n = budget / size;
+    if (n < lo) n = lo;
+    if (n > hi) n = hi;
+    if (opt_max_iters && n > opt_max_iters) n = opt_max_iters;
+    return n;
+}
+
+static int chan_open(Chan *c, const BenchMech *m, size_t size) {
+    memset(c, 0, sizeof(*c));
+    c->m = m;
+    c->peer_fd = -1;
+
+    IPC_Config cfg = { .mech = m->mech, .size = (uint32_t)size };
+    switch (m->mech) {
+        case IPC_SHM_RING:
+            // Room for a few messages in flight
+            cfg.size = size * 4 < (1u << 20) ? (1u << 20) : size * 4;
+            // fall through
+        case IPC_SHM_MUTEX:
+        case IPC_SHM_QUEUE:
+        case IPC_MQ_POSIX:
+            snprintf(c->names[0], sizeof(c->names[0]), "/ipc_bench_%d_f", getpid());
+            snprintf(c->names[1], sizeof(c->names[1]), "/ipc_bench_%d_b", getpid());
+            break;
+        case IPC_MQ_SYSV:
+            // ftok() needs an existing path per queue
+            snprintf(c->names[0], sizeof(c->names[0]), "%s", sysv_key_path);
+            break;
+        case IPC_PIPE_UNNAMED:
+            snprintf(c->names[0], sizeof(c->names[0]), "unnamed");
+            snprintf(c->names[1], sizeof(c->names[1]), "unnamed");
+            break;
+        case IPC_PIPE_NAMED:
+            snprintf(c->names[0], sizeof(c->names[0]), "/tmp/ipc_bench_%d_f", getpid());
+            snprintf(c->names[1], sizeof(c->names[1]), "/tmp/ipc_bench_%d_b", getpid());
+            break;
+        case IPC_SOCKET_UNIX:
+            snprintf(c->sock_path, sizeof(c->sock_path), "/tmp/ipc_bench_%d.sock", getpid());
+            break;
+        case IPC_SOCKET_TCP:
+            // A fresh port per run sidesteps TIME_WAIT on the previous one
+            c->port = 20000 + (getpid() + next_port++) % 20000;
+            break;
+        default:
+            return -1;
+    }
+
+    if (m->mech == IPC_SOCKET_UNIX || m->mech == IPC_SOCKET_TCP) {
+        // Nagle would hold back every small message waiting for an ACK
+        static const IPC_SocketOptions tcp_opts = { .nodelay = 1 };
+        cfg.name = m->mech == IPC_SOCKET_UNIX ? c->sock_path : "tcp";
+        cfg.port = c->port;
+        cfg.sock_opts = &tcp_opts;
+        c->fwd = c->back = ipc_init(&cfg);
+        return c->fwd ? 0 : -1;
+    }
+
+    if (m->mech == IPC_MQ_SYSV) {
+        snprintf(c->names[1], sizeof(c->names[1]), "%s.b", sysv_key_path);
+        FILE *f = fopen(c->names[1], "w");
+        if (f) fclose(f);
+    }
+
+    cfg.name = c->names[0];
+    c->fwd = ipc_init(&cfg);
+    if (!c->fwd) return -1;
+    cfg.name = c->names[1];
+    c->back = ipc_init(&cfg);
+    if (!c->back) {
+        ipc_close(c->fwd);
+        return -1;
+    }
+    return 0;
+}
+
+static void chan_close(Chan *c) {
+    if (c->back && c->back != c->fwd) ipc_close(c->back);
+    if (c->fwd) ipc_close(c->fwd);
+    if (c->m->mech == IPC_MQ_SYSV) unlink(c->names[1]);
+}
+
+// Called in the child for sockets: become the client of the parent's listener
+static int chan_connect(Chan *c) {
+    int fd;
+    if (c->m->mech == IPC_SOCKET_UNIX) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        strncpy(addr.sun_path, c->sock_path, sizeof(addr.sun_path) - 1);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) return -1;
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(c->port) };
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) return -1;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    c->peer_fd = fd;
+    return 0;
+}
+
+static int raw_send(Chan *c, IPC_Handle h, const char *p, size_t len) {
+    if (c->peer_fd != -1) return send(c->peer_fd, p, len, 0);
+    return ipc_send(h, p, len);
+}
+
+static int raw_recv(Chan *c, IPC_Handle h, char *p, size_t len) {
+    if (c->peer_fd != -1) return recv(c->peer_fd, p, len, 0);
+    return ipc_recv(h, p, len);
+}
+
+// Send one whole message, retrying on a full channel and short writes
+static int msg_send(Chan *c, IPC_Handle h, const char *buf, size_t len) {
+    size_t off = 0;
+    while (off < len) {
+        int n = raw_send(c, h, buf + off, len - off);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                sched_yield();
+                continue;
+            }
+            return -1;
+        }
+        off += c->m->stream ? (size_t)n : len;
+    }
+    return 0;
+}
+
+// Receive one whole message. On the mailbox, poll until the expected
+// sequence number shows up.
+static int msg_recv(Chan *c, IPC_Handle h, char *buf, size_t len, uint64_t seq) {
+    size_t off = 0;
+    while (off < len) {
+        int n = raw_recv(c, h, buf + off, len - off);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EINTR) {
+                sched_yield();
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0 && c->m->stream) return -1;
+        if (c->m->mailbox) {
+            uint64_t got;
+            memcpy(&got, buf, sizeof(got));
+            if (got != seq) continue;
+        }
+        off += c->m->stream ? (size_t)n : len;
+    }
+    return 0;
+}
+
+static void child_run(Chan *c, size_t size, size_t rtt_iters, size_t tput_iters) {
+    pin(opt_cpu[1]);
+    if ((c->m->mech == IPC_SOCKET_UNIX || c->m->mech == IPC_SOCKET_TCP) && chan_connect(c) == -1) {
+        perror("connect");
+        _exit(1);
+    }
+    char *buf = malloc(size);
+    if (!buf) _exit(1);
+
+    // Sequence numbers start at 1 so a fresh, zeroed mailbox never matches
+    uint64_t seq = 1;
+    for (size_t i = 0; i < WARMUP + rtt_iters; i++, seq++) {
+        if (msg_recv(c, c->fwd, buf, size, seq) == -1) _exit(1);
+        if (msg_send(c, c->back, buf, size) == -1) _exit(1);
+    }
+    if (!c->m->mailbox) {
+        for (size_t i = 0; i < tput_iters; i++, seq++) {
+            if (msg_recv(c, c->fwd, buf, size, seq) == -1) _exit(1);
+        }
+        memcpy(buf, &seq, sizeof(seq));
+        if (msg_send(c, c->back, buf, size) == -1) _exit(1);
+    }
+    free(buf);
+    _exit(0);
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double pct(const uint64_t *v, size_t n, double p) {
+    size_t i = (size_t)(p * (n - 1));
+    return v[i] / 1000.0;
+}
+
+static void bench_one(const BenchMech *m, size_t size) {
+    size_t rtt_iters = iters_for(RTT_BYTES, size, 20, 20000);
+    size_t tput_iters = iters_for(TPUT_BYTES, size, 20, 200000);
+
+    Chan c;
+    if (chan_open(&c, m, size) == -1) {
+        printf("%-14s %9zu  %s\n", m->label, size, "unsupported at this size");
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        chan_close(&c);
+        return;
+    }
+    if (pid == 0) child_run(&c, size, rtt_iters, tput_iters);
+
+    char *buf = calloc(1, size);
+    uint64_t *rtt = malloc(rtt_iters * sizeof(uint64_t));
+    int ok = buf && rtt;
+    uint64_t seq = 1;
+
+    for (size_t i = 0; ok && i < WARMUP + rtt_iters; i++, seq++) {
+        memcpy(buf, &seq, sizeof(seq));
+        uint64_t t0 = now_ns();
+        if (msg_send(&c, c.fwd, buf, size) == -1 || msg_recv(&c, c.back, buf, size, seq) == -1) {
+            ok = 0;
+            break;
+        }
+        if (i >= WARMUP) rtt[i - WARMUP] = now_ns() - t0;
+    }
+
+    double msgs_s = 0, gb_s = 0;
+    if (ok && !m->mailbox) {
+        uint64_t t0 = now_ns();
+        for (size_t i = 0; i < tput_iters; i++, seq++) {
+            memcpy(buf, &seq, sizeof(seq));
+            if (msg_send(&c, c.fwd, buf, size) == -1) {
+                ok = 0;
+                break;
+            }
+        }
+        if (ok && msg_recv(&c, c.back, buf, size, seq) == -1) ok = 0;
+        double secs = (now_ns() - t0) / 1e9;
+        msgs_s = tput_iters / secs;
+        gb_s = msgs_s * size / 1e9;
+    }
+
+    int status = 0;
+    if (!ok) kill(pid, SIGKILL);
+    waitpid(pid, &status, 0);
+    if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%-14s %9zu  failed: %s\n", m->label, size, strerror(errno));
+    } else {
+        qsort(rtt, rtt_iters, sizeof(uint64_t), cmp_u64);
+        if (m->mailbox) {
+            printf("%-14s %9zu %12s %10s", m->label, size, "-", "-");
+        } else {
+            printf("%-14s %9zu %12.0f %10.3f", m->label, size, msgs_s, gb_s);
+        }
+        printf(" %10.2f %10.2f %10.2f\n", pct(rtt, rtt_iters, 0.50),
+               pct(rtt, rtt_iters, 0.99), pct(rtt, rtt_iters, 0.999));
+    }
+    fflush(stdout);
+    free(rtt);
+    free(buf);
+    chan_close(&c);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [-m mechanism] [-s max_size] [-n max_iters] [-c cpu,cpu]\n"
+            "  -m  only run one mechanism (e.g. shm_ring, socket_tcp)\n"
+            "  -s  largest message size in bytes (default %u)\n"
+            "  -n  cap the iterations per measurement\n"
+            "  -c  pin the parent and child to these CPUs\n",
+            prog, MAX_SIZE);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "m:s:n:c:h")) != -1) {
+        switch (opt) {
+            case 'm': opt_only = optarg; break;
+            case 's': opt_max_size = strtoul(optarg, NULL, 0); break;
+            case 'n': opt_max_iters = strtoul(optarg, NULL, 0); break;
+            case 'c':
+                if (sscanf(optarg, "%d,%d", &opt_cpu[0], &opt_cpu[1]) != 2) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    snprintf(sysv_key_path, sizeof(sysv_key_path), "/tmp/ipc_bench_%d.key", getpid());
+    FILE *f = fopen(sysv_key_path, "w");
+    if (f) fclose(f);
+    pin(opt_cpu[0]);
+
+    printf("%-14s %9s %12s %10s %10s %10s %10s\n", "mechanism", "size", "msgs/s", "GB/s",
+           "p50(us)", "p99(us)", "p99.9(us)");
+    for (size_t i = 0; i < sizeof(mechs) / sizeof(mechs[0]); i++) {
+        if (opt_only && strcmp(opt_only, mechs[i].label) != 0) continue;
+        for (size_t size = MIN_SIZE; size <= opt_max_size; size *= 4) {
+            bench_one(&mechs[i], size);
+        }
+    }
+    unlink(sysv_key_path);
+    return 0;
+}
@@ -11,16 +11,89 @@ typedef enum {
     IPC_PIPE_UNNAMED,
     IPC_PIPE_NAMED,
     IPC_SOCKET_UNIX,
-    IPC_SOCKET_TCP
+    IPC_SOCKET_TCP,
+    IPC_SHM_RING,      // Lock-free SPSC ring; size is the ring capacity in bytes
+    IPC_SHM_QUEUE,     // Lock-free bounded MPMC queue; size is the max message size
+    IPC_SHM_BROADCAST, // Seqlock latest-value slot, one writer and many readers;
+                       // size is the max value size
+    IPC_MECH_USER = 64, // First id available to ipc_register_transport()
+    IPC_MECH_MAX = 128
 } IPC_Mechanism;
 
+// Socket tuning. Zero fields keep the kernel defaults.
+typedef struct {
+    int nodelay;          // TCP_NODELAY: send small messages without Nagle delay
+    int quickack;         // TCP_QUICKACK, re-armed after every receive
+    int sndbuf;           // SO_SNDBUF in bytes
+    int rcvbuf;           // SO_RCVBUF in bytes
+    int busy_poll_us;     // SO_BUSY_POLL: spin on the device queue when receiving
+    size_t zerocopy_min;  // TCP sends of at least this many bytes use MSG_ZEROCOPY
+    size_t fd_pass_min;   // Unix sockets: messages of at least this many bytes
+                          // travel as a sealed memfd; implies IPC_FRAMED
+} IPC_SocketOptions;
+
+// Shared-memory segment placement. Zero fields keep the defaults: 4 KB pages
+// faulted in on first touch, swappable, with the caller's NUMA policy.
+// Every process attaching to a segment must pass the same huge_pages and
+// huge_dir, since they decide where the segment lives.
+typedef struct {
+    int huge_pages;          // Back the segment with a file on hugetlbfs
+    const char *huge_dir;    // hugetlbfs mount (NULL = /dev/hugepages)
+    int populate;            // Prefault every page at init
+    int lock;                // mlock the mapping so it is never paged out
+    unsigned long numa_nodes;  // Bitmask of NUMA nodes to bind pages to
+} IPC_ShmOptions;
+
 typedef struct {
     IPC_Mechanism mech;
     const char *name;  // For named resources
     uint32_t size;     // For shm/mq size
     int port;          // For TCP sockets
+    uint32_t spin_count; // Busy-poll iterations before a shm receive sleeps (0 = default)
+    uint32_t flags;    // IPC_* flags below
+    const IPC_SocketOptions *sock_opts;  // For sockets; NULL for defaults
+    uint32_t pipe_size;  // Pipes: capacity in bytes via F_SETPIPE_SZ (0 = default)
+    const IPC_ShmOptions *shm_opts;  // For shared memory; NULL for defaults
+    const char *stats_name;  // Export stats to this shm segment; implies IPC_STATS
+    // Message queues and IPC_SHM_QUEUE. depth is the number of messages a
+    // queue holds (0 = 10 for POSIX, 64 for shm, which rounds up to a power
+    // of two). SysV counts bytes, so it holds depth * size bytes (0 = the
+    // system default). POSIX and SysV need privileges beyond the limits in
+    // /proc/sys/fs/mqueue and /proc/sys/kernel/msgmnb.
+    // priorities is the number of levels ipc_send_prio accepts, up to
+    // IPC_PRIORITIES_MAX (0 = 1).
+    uint32_t depth;
+    uint32_t priorities;
 } IPC_Config;
 
+// Socket server that accepts any number of peers. Talk to them with
+// ipc_send_to/ipc_recv_from; plain ipc_send/ipc_recv fail with EDESTADDRREQ.
+#define IPC_MULTI_CLIENT 0x1u
+// TCP: bind with SO_REUSEPORT so several handles can accept on one port
+#define IPC_REUSEPORT    0x2u
+// Pipes and stream sockets: length-prefix every message so each receive
+// returns exactly one whole message. Both ends must set it. Reads pull large
+// chunks into a per-handle buffer and later receives are served from it.
+#define IPC_FRAMED       0x4u
+// Pipes, Linux only: sends map the caller's pages into the pipe with
+// vmsplice instead of copying them. The buffer must not be modified or freed
+// until the reader has consumed the data. Page-aligned buffers whose length
+// is a multiple of the page size are gifted (SPLICE_F_GIFT), so a reader
+// splicing them onward can move the pages. Not valid with IPC_FRAMED.
+#define IPC_PIPE_GIFT    0x8u
+// Shared memory: only create the segment, failing with EEXIST if it exists
+#define IPC_CREATE       0x10u
+// Shared memory: only attach to a live segment, failing with ENOENT if there
+// is none. Without either flag the first process creates and the rest attach.
+#define IPC_ATTACH       0x20u
+// Keep per-handle counters and latency histograms, read with ipc_get_stats
+#define IPC_STATS        0x40u
+// Calls that would have to wait fail with EAGAIN instead. A send that has
+// started writing a message to a stream still waits up to 100 ms to finish
+// it (see ipc_send_timed). Without this flag every transport waits, named
+// pipes included.
+#define IPC_NONBLOCK     0x80u
+
 typedef void* IPC_Handle;
 
 IPC_Handle ipc_init(const IPC_Config *config);
@@ -28,6 +101,383 @@ int ipc_send(IPC_Handle handle, const void *data, size_t len);
 int ipc_recv(IPC_Handle handle, void *buf, size_t len);
 void ipc_close(IPC_Handle handle);
 
+// ipc_send/ipc_recv that wait at most timeout_ms milliseconds, whatever
+// IPC_NONBLOCK says: -1 waits forever and 0 not at all. When time runs out
+// errno is EAGAIN for a zero timeout and ETIMEDOUT otherwise. Ring and
+// queue sends never wait, so a full one fails with EAGAIN at once, and a
+// broadcast receive returns straight away. A stream send that has written
+// part of a message waits for the rest only until the deadline, or 100 ms
+// under a zero timeout. If it still cannot finish it fails with ETIMEDOUT
+// and the peer is left mid-message: the connection is unusable, and every
+// later send on the handle (or on that IPC_MULTI_CLIENT connection) fails
+// with EPIPE.
+int ipc_send_timed(IPC_Handle handle, const void *data, size_t len, int timeout_ms);
+int ipc_recv_timed(IPC_Handle handle, void *buf, size_t len, int timeout_ms);
+
+// Zero-copy TCP sends (IPC_SocketOptions.zerocopy_min) return once the
+// kernel has released the pages, so the buffer can be reused straight away.
+// If the kernel reports that it had to copy anyway, as it does on loopback,
+// the handle goes back to ordinary sends. The wait for the release counts
+// as finishing the message (see ipc_send_timed): if it runs out the send
+// fails with ETIMEDOUT, the handle is unusable, and the kernel may still
+// read the buffer until the connection is closed.
+
+// Multi-client servers (IPC_MULTI_CLIENT). ipc_recv_from waits for data on
+// any connection, accepting new peers as they arrive, and stores the
+// sender's id in *conn. It returns 0 once when a peer disconnects, after
+// which that id is no longer valid. With IPC_FRAMED, a frame larger than
+// len fails with EMSGSIZE: the sender's id is stored in *conn and that
+// connection is closed, its id invalid as after a disconnect.
+int ipc_send_to(IPC_Handle handle, uint32_t conn, const void *data, size_t len);
+int ipc_recv_from(IPC_Handle handle, uint32_t *conn, void *buf, size_t len);
+
+// One message of a batch. For receives, len is the buffer size on input and
+// the message length on output.
+typedef struct {
+    void *data;
+    size_t len;
+} IPC_Msg;
+
+// Move up to count messages in one call. Both return the number of messages
+// transferred, or -1 if none could be. A batch receive waits for the first
+// message like ipc_recv and then only takes messages that are already
+// available. Pipes carry batches as length-prefixed frames, so a batch sent
+// on a pipe must be read with ipc_recv_batch.
+int ipc_send_batch(IPC_Handle handle, const IPC_Msg *msgs, size_t count);
+int ipc_recv_batch(IPC_Handle handle, IPC_Msg *msgs, size_t count);
+
+// Priority lanes (IPC_Config.priorities). ipc_send_prio queues a message at
+// prio, from 0, the lowest and what ipc_send uses, to priorities - 1. Every
+// receive takes the oldest message of the highest priority waiting, and
+// ipc_recv_prio also stores that priority in *prio. Sends fail with EINVAL
+// if prio is out of range. All processes sharing a SysV queue must use the
+// same priorities; a shm queue takes them from its creator.
+#define IPC_PRIORITIES_MAX 32
+
+int ipc_send_prio(IPC_Handle handle, const void *data, size_t len, unsigned prio);
+int ipc_recv_prio(IPC_Handle handle, void *buf, size_t len, unsigned *prio);
+
+// Operations implemented by a transport. init, send, recv and close are
+// required. The others may be left NULL: batches then fall back to one
+// send/recv per message and zero-copy calls fail with ENOTSUP. The library
+// validates arguments before calling into a transport.
+typedef struct {
+    IPC_Handle (*init)(const IPC_Config *config);
+    int (*send)(IPC_Handle handle, const void *data, size_t len);
+    int (*recv)(IPC_Handle handle, void *buf, size_t len);
+    void (*close)(IPC_Handle handle);
+    int (*send_batch)(IPC_Handle handle, const IPC_Msg *msgs, size_t count);
+    int (*recv_batch)(IPC_Handle handle, IPC_Msg *msgs, size_t count);
+    int (*send_reserve)(IPC_Handle handle, size_t len, void **ptr);
+    int (*send_commit)(IPC_Handle handle, void *ptr);
+    int (*recv_acquire)(IPC_Handle handle, void **ptr, size_t *len);
+    int (*recv_release)(IPC_Handle handle, void *ptr);
+    // Readiness. get_fd returns a descriptor that polls readable when a
+    // receive can make progress. poll_arm and poll_disarm bracket a wait in
+    // ipc_poll for transports that only signal that fd on request; each
+    // returns 1 if a message is waiting, 0 if not, or -1 on error.
+    // poll_disarm is only called after poll_arm returned 0.
+    int (*get_fd)(IPC_Handle handle);
+    int (*poll_arm)(IPC_Handle handle);
+    int (*poll_disarm)(IPC_Handle handle);
+    // Connection-addressed messaging for multi-client servers
+    int (*send_to)(IPC_Handle handle, uint32_t conn, const void *data, size_t len);
+    int (*recv_from)(IPC_Handle handle, uint32_t *conn, void *buf, size_t len);
+    // Raw stream descriptor for asynchronous I/O in the given direction.
+    // *nonblock tells whether it has O_NONBLOCK set.
+    int (*io_fd)(IPC_Handle handle, int write, int *nonblock);
+    // Move up to len received bytes into fd without a userspace copy
+    int (*recv_splice)(IPC_Handle handle, int fd, size_t len);
+    // send/recv with a timeout. NULL means the plain call never waits.
+    int (*send_timed)(IPC_Handle handle, const void *data, size_t len, int timeout_ms);
+    int (*recv_timed)(IPC_Handle handle, void *buf, size_t len, int timeout_ms);
+    // Priority lanes. NULL means a single priority: prio 0 goes through
+    // send and recv_prio reports 0.
+    int (*send_prio)(IPC_Handle handle, const void *data, size_t len, unsigned prio);
+    int (*recv_prio)(IPC_Handle handle, void *buf, size_t len, unsigned *prio);
+} IPC_TransportOps;
+
+// Make a transport available under mech, which must lie in
+// [IPC_MECH_USER, IPC_MECH_MAX). Register before calling ipc_init with it.
+// Fails with EEXIST if the id is taken.
+int ipc_register_transport(IPC_Mechanism mech, const IPC_TransportOps *ops);
+
+// Receives on IPC_SHM_RING and IPC_SHM_QUEUE block until a message arrives:
+// they spin for spin_count iterations, then sleep until a sender wakes them.
+// IPC_SHM_BROADCAST instead returns the latest value at once (EAGAIN before
+// the first send), retrying only while a write is in progress. Only one
+// process may send. ipc_poll reports a broadcast handle ready when a value
+// newer than the one it last received has been published.
+
+// Zero-copy access for shared-memory channels (IPC_SHM_RING, IPC_SHM_QUEUE).
+// reserve hands out len bytes inside the segment that become a message on
+// commit; acquire hands out the next message in place until release. Each
+// handle may hold one send and one receive loan at a time.
+// IPC_SHM_BROADCAST supports reserve/commit only: the writer edits the
+// published value in place and readers retry until it commits.
+// Framed Unix sockets with fd_pass_min set support the same calls: reserve
+// maps a fresh memfd that commit seals and passes to the peer, and acquire
+// maps a received memfd, or lends the frame from the receive buffer.
+int ipc_send_reserve(IPC_Handle handle, size_t len, void **ptr);
+int ipc_send_commit(IPC_Handle handle, void *ptr);
+int ipc_recv_acquire(IPC_Handle handle, void **ptr, size_t *len);
+int ipc_recv_release(IPC_Handle handle, void *ptr);
+
+// Move up to len received bytes straight into a file or socket fd with
+// splice(2) and return the count moved. Unframed pipes only; other handles
+// fail with ENOTSUP.
+int ipc_recv_splice(IPC_Handle handle, int fd, size_t len);
+
+// Descriptor that polls readable when the handle has a message to receive.
+// Fails with ENOTSUP for IPC_SHM_MUTEX and IPC_MQ_SYSV. For shared-memory
+// channels it is a doorbell that senders only ring while a receiver waits in
+// ipc_poll, so wait on those handles with ipc_poll rather than your own loop.
+int ipc_get_fd(IPC_Handle handle);
+
+// Wait until at least one of the n handles has a message or timeout_ms
+// expires (-1 waits forever). Sets ready[i] to 1 for each handle that is
+// ready and 0 otherwise. Returns the number of ready handles, 0 on timeout.
+int ipc_poll(IPC_Handle *handles, size_t n, int timeout_ms, int *ready);
+
+// Asynchronous sends and receives on pipes and single-client sockets, backed
+// by io_uring on Linux (ENOTSUP elsewhere, and for framed handles).
+// Operations are queued and go to the kernel together on the next
+// ipc_async_submit or ipc_async_complete. Each one finishes with a
+// completion carrying the caller's user_data and the result of the
+// matching write/read: a byte count or -errno. Buffers must stay valid
+// until their completion has been reaped. Up to twice `entries` operations
+// may be in flight; queuing more fails with EAGAIN until completions are
+// reaped. Operations on non-blocking fds (named pipes, IPC_NONBLOCK handles)
+// use two completion slots, so kernels before 5.6 hold only `entries` of them.
+typedef struct IPC_Async IPC_Async;
+
+typedef struct {
+    uint64_t user_data;
+    int result;
+} IPC_Completion;
+
+IPC_Async *ipc_async_create(unsigned entries);
+void ipc_async_destroy(IPC_Async *aq);
+// Pin buffers with the kernel once. Operations whose data lies inside one of
+// them skip the per-operation page mapping.
+int ipc_async_register_buffers(IPC_Async *aq, const IPC_Msg *bufs, unsigned count);
+int ipc_send_async(IPC_Async *aq, IPC_Handle handle, const void *data, size_t len,
+                   uint64_t user_data);
+int ipc_recv_async(IPC_Async *aq, IPC_Handle handle, void *buf, size_t len,
+                   uint64_t user_data);
+// Returns the number of operations handed to the kernel
+int ipc_async_submit(IPC_Async *aq);
+// Submit what is queued, wait until at least min_wait completions are
+// available, then reap up to max of them. Returns the number reaped.
+int ipc_async_complete(IPC_Async *aq, IPC_Completion *out, unsigned max, unsigned min_wait);
+
+// Pipelined request/reply over handles that keep message boundaries (shm
+// ring/queue, POSIX queues, IPC_FRAMED pipes and sockets). Requests go out on
+// tx and replies come back on rx, which may be the same handle. Each call
+// carries an id that the server echoes, so many calls can be in flight and
+// replies may arrive in any order. On an IPC_MULTI_CLIENT server, requests
+// are read from every peer and each reply goes back to its sender.
+// An IPC_Rpc is not thread-safe; use one per thread.
+typedef struct IPC_Rpc IPC_Rpc;
+// status is 0 or an errno: the server's failure, or ECANCELED when the
+// IPC_Rpc is destroyed first. reply is only valid during the callback.
+typedef void (*IPC_RpcCallback)(void *ctx, int status, const void *reply, size_t len);
+// Writes the reply for req into reply (at most reply_cap bytes) and returns
+// its length, or returns -1 with errno set to fail the call.
+typedef int (*IPC_RpcHandler)(void *ctx, const void *req, size_t len,
+                              void *reply, size_t reply_cap);
+
+// max_msg bounds request and reply payloads; max_inflight bounds calls
+// awaiting a reply
+IPC_Rpc *ipc_rpc_create(IPC_Handle tx, IPC_Handle rx, size_t max_msg, unsigned max_inflight);
+void ipc_rpc_destroy(IPC_Rpc *rpc);
+// Send a request without waiting. Fails with EAGAIN when the channel is full
+// or too many calls are in flight; ipc_rpc_wait makes room.
+int ipc_call_async(IPC_Rpc *rpc, const void *req, size_t len, IPC_RpcCallback cb, void *ctx);
+unsigned ipc_rpc_inflight(IPC_Rpc *rpc);
+// Wait up to timeout_ms (-1 forever) for replies, then run the callback of
+// every reply that is ready. Returns the number of callbacks run.
+int ipc_rpc_wait(IPC_Rpc *rpc, int timeout_ms);
+// Server side: wait up to timeout_ms for requests, then answer every request
+// that is ready with handler. Returns the number answered; call it in a loop.
+// A reply that finds no room for a second is dropped and ipc_rpc_serve
+// returns -1 with ETIMEDOUT, as it does with errno set when a reply cannot
+// be sent at all; that client call never completes. Replies to a
+// multi-client peer that has gone are dropped quietly.
+int ipc_rpc_serve(IPC_Rpc *rpc, IPC_RpcHandler handler, void *ctx, int timeout_ms);
+
+// Slab allocator in a named shared-memory segment of config->size bytes,
+// shared by every process that opens the same name (IPC_CREATE, IPC_ATTACH
+// and shm_opts apply as for shared-memory channels; mech is ignored).
+// Blocks come in power-of-two sizes from 64 bytes to 256 KiB and are named by
+// an IPC_PoolRef, an offset that resolves to the block in every process, so
+// a producer can allocate a payload and pass only the reference through a
+// channel. Any process may free a block. Memory a slab hands to one size
+// class stays with that class.
+typedef struct IPC_Pool IPC_Pool;
+typedef uint64_t IPC_PoolRef;  // 0 is never a valid block
+
+IPC_Pool *ipc_pool_open(const IPC_Config *config);
+void ipc_pool_close(IPC_Pool *pool);
+// Returns 0 with ENOMEM when no block of the size is left, or EMSGSIZE
+// above 256 KiB
+IPC_PoolRef ipc_pool_alloc(IPC_Pool *pool, size_t len);
+int ipc_pool_free(IPC_Pool *pool, IPC_PoolRef ref);
+void *ipc_pool_ptr(IPC_Pool *pool, IPC_PoolRef ref);
+// Usable size of the block, 0 if ref does not name one
+size_t ipc_pool_block_size(IPC_Pool *pool, IPC_PoolRef ref);
+
+// Locks that live in memory the caller shares between processes: a pool
+// block, a region of a shared-memory segment, or any MAP_SHARED mapping.
+// Initialize one exactly once before use, in the process that lays out the
+// memory; there is nothing to destroy. Contended callers spin briefly and
+// then sleep on a futex, so an uncontended lock or unlock is a single atomic
+// operation on the caller's memory.
+//
+// Acquiring returns 0, or IPC_LOCK_OWNER_DIED when the previous holder's
+// process exited while holding the lock (or, for a ticket lock, while next
+// in line): the caller holds the lock and should repair the data it
+// protects. Sleepers check whether the holder still exists every 50 ms, and
+// every process must be in the same PID namespace. timeout_ms is as for
+// ipc_recv_timed; on failure -1 is returned with errno EAGAIN (0 ms),
+// ETIMEDOUT or EINVAL, and the lock is not held.
+#define IPC_LOCK_OWNER_DIED 1
+
+// Exclusive lock: one 32-bit word holding the owner's PID
+typedef struct {
+    uint32_t opaque;
+} IPC_Lock;
+
+void ipc_lock_init(IPC_Lock *lock);
+int ipc_lock_acquire(IPC_Lock *lock, int timeout_ms);
+void ipc_lock_release(IPC_Lock *lock);
+
+// Reader-writer lock for data read by many processes and written rarely.
+// Each reader marks a slot on a cache line of its own, so readers never
+// write a line another reader touches. A writer keeps new readers out from
+// the moment it asks for the lock and waits for those inside to leave, so a
+// stream of readers cannot starve it. Up to IPC_RWLOCK_SLOTS readers hold
+// the lock at once; more wait for a slot. Readers that die are removed by
+// the next writer.
+//
+// Data a dead writer left behind is only repaired under the exclusive lock.
+// When ipc_rwlock_rdlock returns IPC_LOCK_OWNER_DIED, the reader has taken
+// the dead writer's place: it holds the lock exclusively and must release
+// it with ipc_rwlock_wrunlock. A caller that times out after taking over
+// leaves the news for the next one to get the lock, reader or writer.
+#define IPC_RWLOCK_SLOTS 64
+#define IPC_RWLOCK_SIZE ((IPC_RWLOCK_SLOTS + 1) * 64)
+
+typedef struct {
+    _Alignas(64) unsigned char opaque[IPC_RWLOCK_SIZE];
+} IPC_RWLock;
+
+void ipc_rwlock_init(IPC_RWLock *lock);
+int ipc_rwlock_rdlock(IPC_RWLock *lock, int timeout_ms);
+void ipc_rwlock_rdunlock(IPC_RWLock *lock);
+int ipc_rwlock_wrlock(IPC_RWLock *lock, int timeout_ms);
+void ipc_rwlock_wrunlock(IPC_RWLock *lock);
+
+// Fair lock for heavy contention: callers take a ticket and are served in
+// arrival order. Each one sleeps on a futex bit of its own, so a release
+// wakes only the next in line instead of every waiter. Up to
+// IPC_TICKET_SLOTS callers queue with their place recorded; further
+// arrivals wait for the queue to move before joining it. A caller that
+// times out leaves the queue without holding up the others.
+#define IPC_TICKET_SLOTS 64
+#define IPC_TICKET_SIZE (2 * 64 + IPC_TICKET_SLOTS * 8)
+
+typedef struct {
+    _Alignas(64) unsigned char opaque[IPC_TICKET_SIZE];
+} IPC_TicketLock;
+
+void ipc_ticket_init(IPC_TicketLock *lock);
+int ipc_ticket_acquire(IPC_TicketLock *lock, int timeout_ms);
+void ipc_ticket_release(IPC_TicketLock *lock);
+
+// Per-handle statistics (IPC_STATS). Latencies are the wall time of each
+// send or receive call in nanoseconds, kept in a log-linear histogram: values
+// below 8 get a bucket each, and every power of two above is split into 8
+// buckets, so a bucket is never wider than 1/8 of its lower bound.
+// Syscalls and blocked time (futex and poll waits, accept, contended
+// pthread_mutex_lock) are charged to the handle whose call made them.
+// Send and receive counters are updated without atomic read-modify-writes,
+// so a handle used by several threads in the same direction may undercount.
+#define IPC_STATS_BUCKETS 496
+
+typedef struct {
+    uint64_t msgs;
+    uint64_t bytes;
+    uint64_t would_block;  // Calls that failed with EAGAIN
+    uint64_t errors;       // Calls that failed otherwise
+    uint64_t latency[IPC_STATS_BUCKETS];
+} IPC_StatsDir;
+
+typedef struct {
+    IPC_StatsDir send;  // ipc_send, _to, _batch and _commit
+    IPC_StatsDir recv;  // ipc_recv, _from, _batch, _acquire and _splice
+    uint64_t syscalls;
+    uint64_t blocked_ns;
+} IPC_Stats;
+
+// Fails with ENOTSUP unless the handle was opened with IPC_STATS
+int ipc_get_stats(IPC_Handle handle, IPC_Stats *out);
+// Read the stats a handle exports under config->stats_name, from any
+// process, without involving the one that owns the handle. The export lives
+// as long as that handle; give each handle its own name.
+int ipc_stats_read(const char *stats_name, IPC_Stats *out);
+// Upper bound of the bucket holding the pct-th percentile (0-100) of a
+// latency histogram, or 0 if it is empty
+uint64_t ipc_stats_percentile(const uint64_t *latency, double pct);
+
+// Binary event trace. While tracing is on, every send and receive call on
+// any handle appends an IPC_TraceEvent to a lock-free ring owned by the
+// calling thread, and a background thread copies the rings into the mmap'd
+// file at path every few milliseconds. The file is consistent after every
+// copy, so a crash loses at most the last interval. ring_events (rounded up
+// to a power of two, 0 for 65536) bounds how far a thread may run ahead of
+// the copier; events past that are dropped and counted. While off, a call
+// pays one load and branch. Trace one file per process; the ipc_trace tool
+// (make tools) matches one process's sends with another's receives to
+// recover the latency of every message. It pairs the n-th message sent on a
+// channel with the n-th received, so start tracing in both processes before
+// they exchange messages, and keep to one sender and one receiver per
+// channel.
+int ipc_trace_start(const char *path, unsigned ring_events);
+void ipc_trace_stop(void);
+
+#define IPC_TRACE_MAGIC 0x54435049u  // "IPCT"
+#define IPC_TRACE_VERSION 2u
+#define IPC_TRACE_SEND 1
+#define IPC_TRACE_RECV 2
+
+typedef struct {
+    uint64_t start;     // Timestamp counter when the call was entered
+    uint64_t ticks;     // Timestamp counter when the call returned
+    uint64_t channel;   // Same for every handle on one name and mechanism
+    uint64_t seq;       // Messages the handle moved while traced, before this call
+    uint32_t len;       // Bytes moved
+    int32_t result;     // Return value, or -errno
+    uint16_t op;        // IPC_TRACE_SEND or IPC_TRACE_RECV
+    uint16_t count;     // Messages moved
+    uint32_t reserved;  // Zero
+} IPC_TraceEvent;
+
+// A trace file is this header followed by `events` records. The timestamp
+// counter is the TSC on x86 (the virtual counter on arm64), shared by all
+// processes on a machine; ticks0/ns0 at start and ticks1/ns1 at the last
+// copy convert it to CLOCK_MONOTONIC nanoseconds.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t event_size;
+    uint32_t pid;
+    uint64_t events;
+    uint64_t dropped;
+    uint64_t ticks0, ns0;
+    uint64_t ticks1, ns1;
+} IPC_TraceHeader;
+
 typedef struct {} IPC_Mutex;
 IPC_Mutex* ipc_mutex_create(void);
 void ipc_mutex_lock(IPC_Mutex *mux);
@@ -0,0 +1,367 @@
+#include "ipc_internal.h"
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+
+// io_uring driven through the raw system calls. The submission ring is
+// filled locally and published to the kernel in one store per submit, so a
+// burst of operations costs a single io_uring_enter.
+
+// Completions of the poll requests linked in front of operations on
+// non-blocking fds; never handed to the caller
+#define ASYNC_INTERNAL UINT64_MAX
+
+struct IPC_Async {
+    int fd;
+    // Submission ring
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local;   // Tail including entries not yet published
+    unsigned sq_queued;  // Published but not yet passed to io_uring_enter
+    // Completion ring
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned cq_entries;
+    unsigned cq_owed;    // Completions still to come, internal ones included
+    // Mappings
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    // Registered buffers
+    struct iovec *bufs;
+    unsigned nbufs;
+};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+IPC_Async *ipc_async_create(unsigned entries) {
+    if (entries == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    IPC_Async *aq = calloc(1, sizeof(IPC_Async));
+    if (!aq) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Each operation on a non-blocking fd posts two completions, so give the
+    // completion ring room for twice `entries` of them; kernels before 5.6
+    // reject the flags and keep the default of twice `entries` completions
+    struct io_uring_params p = {0};
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+    p.cq_entries = entries > UINT32_MAX / 4 ? UINT32_MAX : entries * 4;
+    aq->fd = sys_io_uring_setup(entries, &p);
+    if (aq->fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        aq->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (aq->fd == -1) {
+        free(aq);
+        return NULL;
+    }
+
+    aq->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    aq->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (aq->cq_ring_size > aq->sq_ring_size) aq->sq_ring_size = aq->cq_ring_size;
+        aq->cq_ring_size = aq->sq_ring_size;
+    }
+    aq->sq_ring = mmap(NULL, aq->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, aq->fd, IORING_OFF_SQ_RING);
+    if (aq->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        aq->cq_ring = aq->sq_ring;
+    } else {
+        aq->cq_ring = mmap(NULL, aq->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, aq->fd, IORING_OFF_CQ_RING);
+        if (aq->cq_ring == MAP_FAILED) goto fail;
+    }
+    aq->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    aq->sqes = mmap(NULL, aq->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, aq->fd, IORING_OFF_SQES);
+    if (aq->sqes == MAP_FAILED) goto fail;
+
+    unsigned char *sq = aq->sq_ring;
+    unsigned char *cq = aq->cq_ring;
+    aq->sq_head = (unsigned *)(sq + p.sq_off.head);
+    aq->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    aq->sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    aq->sq_array = (unsigned *)(sq + p.sq_off.array);
+    aq->sq_local = *aq->sq_tail;
+    aq->cq_head = (unsigned *)(cq + p.cq_off.head);
+    aq->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    aq->cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    aq->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    aq->cq_entries = p.cq_entries;
+    return aq;
+
+fail:
+    ipc_async_destroy(aq);
+    return NULL;
+}
+
+void ipc_async_destroy(IPC_Async *aq) {
+    if (!aq) return;
+    if (aq->sqes && aq->sqes != MAP_FAILED) munmap(aq->sqes, aq->sqes_size);
+    if (aq->cq_ring && aq->cq_ring != MAP_FAILED && aq->cq_ring != aq->sq_ring) {
+        munmap(aq->cq_ring, aq->cq_ring_size);
+    }
+    if (aq->sq_ring && aq->sq_ring != MAP_FAILED) munmap(aq->sq_ring, aq->sq_ring_size);
+    // Closing the ring also drops the registered buffers
+    close(aq->fd);
+    free(aq->bufs);
+    free(aq);
+}
+
+int ipc_async_register_buffers(IPC_Async *aq, const IPC_Msg *bufs, unsigned count) {
+    if (!aq || !bufs || count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (aq->nbufs) {
+        errno = EBUSY;
+        return -1;
+    }
+    struct iovec *iov = malloc(count * sizeof(struct iovec));
+    if (!iov) {
+        errno = ENOMEM;
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        iov[i].iov_base = bufs[i].data;
+        iov[i].iov_len = bufs[i].len;
+    }
+    if (sys_io_uring_register(aq->fd, IORING_REGISTER_BUFFERS, iov, count) == -1) {
+        free(iov);
+        return -1;
+    }
+    aq->bufs = iov;
+    aq->nbufs = count;
+    return 0;
+}
+
+// Index of the registered buffer holding [p, p + len), or -1
+static int async_buf_index(IPC_Async *aq, const void *p, size_t len) {
+    const unsigned char *c = p;
+    for (unsigned i = 0; i < aq->nbufs; i++) {
+        const unsigned char *base = aq->bufs[i].iov_base;
+        if (c >= base && c + len <= base + aq->bufs[i].iov_len) return (int)i;
+    }
+    return -1;
+}
+
+// Make the locally filled entries visible to the kernel
+static void async_publish(IPC_Async *aq) {
+    unsigned tail = *aq->sq_tail;
+    if (tail == aq->sq_local) return;
+    aq->sq_queued += aq->sq_local - tail;
+    __atomic_store_n(aq->sq_tail, aq->sq_local, __ATOMIC_RELEASE);
+}
+
+static int async_enter(IPC_Async *aq, unsigned min_complete) {
+    async_publish(aq);
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    for (;;) {
+        int ret = sys_io_uring_enter(aq->fd, aq->sq_queued, min_complete, flags);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        aq->sq_queued -= (unsigned)ret;
+        return ret;
+    }
+}
+
+// Claim `n` consecutive submission entries, flushing the ring if full
+static struct io_uring_sqe *async_get_sqes(IPC_Async *aq, unsigned n) {
+    unsigned entries = aq->sq_mask + 1;
+    if (aq->sq_local + n - __atomic_load_n(aq->sq_head, __ATOMIC_ACQUIRE) > entries) {
+        if (async_enter(aq, 0) == -1) return NULL;
+        if (aq->sq_local + n - __atomic_load_n(aq->sq_head, __ATOMIC_ACQUIRE) > entries) {
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+    return &aq->sqes[aq->sq_local & aq->sq_mask];
+}
+
+static void async_push(IPC_Async *aq, struct io_uring_sqe *sqe) {
+    unsigned idx = (unsigned)(sqe - aq->sqes);
+    aq->sq_array[aq->sq_local & aq->sq_mask] = idx;
+    aq->sq_local++;
+}
+
+static int async_queue(IPC_Async *aq, IPC_Handle handle, int write, void *buf,
+                       size_t len, uint64_t user_data) {
+    if (!aq || !handle || !buf || len == 0 || user_data == ASYNC_INTERNAL) {
+        errno = EINVAL;
+        return -1;
+    }
+    int nonblock;
+    int fd = ipc_core_io_fd(handle, write, &nonblock);
+    if (fd == -1) return -1;
+
+    // On an O_NONBLOCK fd the kernel would complete at once with -EAGAIN;
+    // a linked poll makes the operation wait for readiness instead
+    unsigned n = nonblock ? 2 : 1;
+    // Every entry posts exactly one completion; refuse what the completion
+    // ring could not hold rather than let the kernel overflow it
+    if (aq->cq_owed + n > aq->cq_entries) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (!async_get_sqes(aq, n)) return -1;
+    aq->cq_owed += n;
+    if (nonblock) {
+        struct io_uring_sqe *poll_sqe = &aq->sqes[aq->sq_local & aq->sq_mask];
+        memset(poll_sqe, 0, sizeof(*poll_sqe));
+        poll_sqe->opcode = IORING_OP_POLL_ADD;
+        poll_sqe->fd = fd;
+        poll_sqe->poll32_events = write ? POLLOUT : POLLIN;
+        poll_sqe->flags = IOSQE_IO_LINK;
+        poll_sqe->user_data = ASYNC_INTERNAL;
+        async_push(aq, poll_sqe);
+    }
+
+    struct io_uring_sqe *sqe = &aq->sqes[aq->sq_local & aq->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    int idx = async_buf_index(aq, buf, len);
+    if (idx >= 0) {
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+        sqe->buf_index = (uint16_t)idx;
+    } else {
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    }
+    sqe->fd = fd;
+    sqe->off = (uint64_t)-1;  // Current position; streams have no offset
+    sqe->addr = (uint64_t)(uintptr_t)buf;
+    sqe->len = len > UINT32_MAX ? UINT32_MAX : (uint32_t)len;
+    sqe->user_data = user_data;
+    async_push(aq, sqe);
+    return 0;
+}
+
+int ipc_send_async(IPC_Async *aq, IPC_Handle handle, const void *data, size_t len,
+                   uint64_t user_data) {
+    return async_queue(aq, handle, 1, (void *)data, len, user_data);
+}
+
+int ipc_recv_async(IPC_Async *aq, IPC_Handle handle, void *buf, size_t len,
+                   uint64_t user_data) {
+    return async_queue(aq, handle, 0, buf, len, user_data);
+}
+
+int ipc_async_submit(IPC_Async *aq) {
+    if (!aq) {
+        errno = EINVAL;
+        return -1;
+    }
+    return async_enter(aq, 0);
+}
+
+static unsigned async_reap(IPC_Async *aq, IPC_Completion *out, unsigned max) {
+    unsigned head = *aq->cq_head;
+    unsigned tail = __atomic_load_n(aq->cq_tail, __ATOMIC_ACQUIRE);
+    unsigned got = 0;
+    while (head != tail && got < max) {
+        struct io_uring_cqe *cqe = &aq->cqes[head & aq->cq_mask];
+        head++;
+        aq->cq_owed--;
+        if (cqe->user_data == ASYNC_INTERNAL) continue;
+        out[got].user_data = cqe->user_data;
+        out[got].result = cqe->res;
+        got++;
+    }
+    __atomic_store_n(aq->cq_head, head, __ATOMIC_RELEASE);
+    return got;
+}
+
+int ipc_async_complete(IPC_Async *aq, IPC_Completion *out, unsigned max, unsigned min_wait) {
+    if (!aq || !out || max == 0 || min_wait > max) {
+        errno = EINVAL;
+        return -1;
+    }
+    unsigned got = async_reap(aq, out, max);
+    if (got >= min_wait) {
+        // Still hand over anything queued so it makes progress
+        if (aq->sq_local != *aq->sq_tail || aq->sq_queued) {
+            if (async_enter(aq, 0) == -1) return got ? (int)got : -1;
+        }
+        return (int)got;
+    }
+    // Internal poll completions also count towards the kernel's min_complete,
+    // so keep waiting until enough real ones have been reaped
+    while (got < min_wait) {
+        if (async_enter(aq, min_wait - got) == -1) return got ? (int)got : -1;
+        got += async_reap(aq, out + got, max - got);
+    }
+    return (int)got;
+}
+#else
+IPC_Async *ipc_async_create(unsigned entries) {
+    (void)entries;
+    errno = ENOTSUP;
+    return NULL;
+}
+
+void ipc_async_destroy(IPC_Async *aq) {
+    (void)aq;
+}
+
+int ipc_async_register_buffers(IPC_Async *aq, const IPC_Msg *bufs, unsigned count) {
+    (void)aq; (void)bufs; (void)count;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int ipc_send_async(IPC_Async *aq, IPC_Handle handle, const void *data, size_t len,
+                   uint64_t user_data) {
+    (void)aq; (void)handle; (void)data; (void)len; (void)user_data;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int ipc_recv_async(IPC_Async *aq, IPC_Handle handle, void *buf, size_t len,
+                   uint64_t user_data) {
+    (void)aq; (void)handle; (void)buf; (void)len; (void)user_data;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int ipc_async_submit(IPC_Async *aq) {
+    (void)aq;
+    errno = ENOTSUP;
+    return -1;
+}
+
+int ipc_async_complete(IPC_Async *aq, IPC_Completion *out, unsigned max, unsigned min_wait) {
+    (void)aq; (void)out; (void)max; (void)min_wait;
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE  // F_GET_SEALS
+#include "ipc_internal.h"
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Two iovecs per frame keeps a chunk within the Linux IOV_MAX of 1024
+#define FRAME_BATCH 512
+
+void frame_buffer_init(FrameBuffer *fb) {
+    fb->buf = NULL;
+    fb->cap = 0;
+    fb->start = 0;
+    fb->end = 0;
+    fb->pass_fds = 0;
+    fb->fd_head = 0;
+    fb->fd_count = 0;
+}
+
+void frame_buffer_free(FrameBuffer *fb) {
+    int pass_fds = fb->pass_fds;
+    free(fb->buf);
+    while (fb->fd_count) {
+        close(fb->fds[fb->fd_head]);
+        fb->fd_head = (fb->fd_head + 1) % FRAME_MAX_FDS;
+        fb->fd_count--;
+    }
+    frame_buffer_init(fb);
+    fb->pass_fds = pass_fds;
+}
+
+int stage_buffer_init(StageBuffer *sb, size_t cap) {
+    sb->buf = NULL;
+    sb->cap = 0;
+    return cap ? stage_buffer_grow(sb, cap) : 0;
+}
+
+void stage_buffer_free(StageBuffer *sb) {
+    free(sb->buf);
+    sb->buf = NULL;
+    sb->cap = 0;
+}
+
+// Grow geometrically so a slowly increasing message size settles quickly
+int stage_buffer_grow(StageBuffer *sb, size_t need) {
+    size_t cap = sb->cap ? sb->cap : 64;
+    while (cap < need) cap *= 2;
+    void *buf = realloc(sb->buf, cap);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    sb->buf = buf;
+    sb->cap = cap;
+    return 0;
+}
+
+// A socket is written with sendmsg so a closed peer gives EPIPE rather than
+// SIGPIPE, and without sleeping in the kernel when a deadline is set
+static ssize_t frame_writev(int fd, int sock, struct iovec *iov, int iovcnt, uint64_t deadline) {
+    ipc_stat_syscall();
+    if (!sock) return writev(fd, iov, iovcnt);
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = iovcnt };
+    return sendmsg(fd, &msg, MSG_NOSIGNAL | (deadline == IPC_NO_DEADLINE ? 0 : MSG_DONTWAIT));
+}
+
+// Finish a writev that the kernel only partly accepted. Once a frame has
+// been started it must be completed or the stream loses its framing, so
+// this waits for room even on a non-blocking fd, up to the finish deadline.
+static int frame_write_rest(int fd, int sock, struct iovec *iov, int iovcnt, size_t done,
+                            uint64_t finish) {
+    while (iovcnt > 0) {
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt == 0) break;
+        iov->iov_base = (unsigned char *)iov->iov_base + done;
+        iov->iov_len -= done;
+
+        ssize_t n = frame_writev(fd, sock, iov, iovcnt, finish);
+        if (n == -1) {
+            if (errno != EINTR && ipc_wait_fd_again(fd, POLLOUT, finish) == -1) return -1;
+            n = 0;
+        }
+        done = n;
+    }
+    return 0;
+}
+
+int frame_send(int fd, int sock, const IPC_Msg *msgs, size_t count, uint64_t deadline,
+               int *broken) {
+    uint32_t hdrs[FRAME_BATCH];
+    struct iovec iov[FRAME_BATCH * 2];
+    size_t sent = 0;
+
+    while (sent < count) {
+        size_t n = count - sent;
+        if (n > FRAME_BATCH) n = FRAME_BATCH;
+        size_t total = 0;
+        for (size_t i = 0; i < n; i++) {
+            const IPC_Msg *m = &msgs[sent + i];
+            if (m->len >= FRAME_FD_MARK) {
+                errno = EMSGSIZE;
+                return sent ? (int)sent : -1;
+            }
+            hdrs[i] = (uint32_t)m->len;
+            iov[2 * i].iov_base = &hdrs[i];
+            iov[2 * i].iov_len = FRAME_HDR;
+            iov[2 * i + 1].iov_base = m->data;
+            iov[2 * i + 1].iov_len = m->len;
+            total += FRAME_HDR + m->len;
+        }
+
+        ssize_t w = frame_writev(fd, sock, iov, n * 2, deadline);
+        if (w == -1) {
+            if (errno == EINTR) continue;
+            // Under a deadline, what went out before the pipe filled is enough
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && sent && deadline != IPC_NO_DEADLINE) {
+                return (int)sent;
+            }
+            if (ipc_wait_fd_again(fd, POLLOUT, deadline) == -1) return sent ? (int)sent : -1;
+            continue;
+        }
+        if ((size_t)w < total &&
+            frame_write_rest(fd, sock, iov, n * 2, w, ipc_finish_deadline(deadline)) == -1) {
+            *broken = 1;
+            return -1;
+        }
+        sent += n;
+    }
+    return (int)sent;
+}
+
+// Make room for at least `need` bytes past the buffered data
+static int frame_reserve(FrameBuffer *fb, size_t need) {
+    if (fb->start > 0) {
+        memmove(fb->buf, fb->buf + fb->start, fb->end - fb->start);
+        fb->end -= fb->start;
+        fb->start = 0;
+    }
+    if (fb->cap - fb->end >= need && fb->cap > 0) return 0;
+
+    size_t cap = fb->cap ? fb->cap : FRAME_BUF_MIN;
+    while (cap < fb->end + need) cap *= 2;
+    unsigned char *buf = realloc(fb->buf, cap);
+    if (!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+    fb->buf = buf;
+    fb->cap = cap;
+    return 0;
+}
+
+typedef struct {
+    size_t hdr;    // Header bytes, FRAME_HDR or FRAME_FD_HDR
+    uint64_t len;  // Payload length
+    int is_fd;     // Payload is in the next passed descriptor
+} FrameInfo;
+
+// Decode the frame at fb->start. Returns 1 if all of it is buffered, or 0
+// with *need set to the number of bytes still missing.
+static int frame_parse(const FrameBuffer *fb, FrameInfo *fi, size_t *need) {
+    size_t avail = fb->end - fb->start;
+    uint32_t mark;
+    if (avail < FRAME_HDR) {
+        *need = FRAME_HDR - avail;
+        return 0;
+    }
+    memcpy(&mark, fb->buf + fb->start, FRAME_HDR);
+    if (mark == FRAME_FD_MARK) {
+        if (avail < FRAME_FD_HDR) {
+            *need = FRAME_FD_HDR - avail;
+            return 0;
+        }
+        fi->hdr = FRAME_FD_HDR;
+        memcpy(&fi->len, fb->buf + fb->start + FRAME_HDR, sizeof(uint64_t));
+        fi->is_fd = 1;
+        return 1;
+    }
+    fi->hdr = FRAME_HDR;
+    fi->len = mark;
+    fi->is_fd = 0;
+    if (avail < FRAME_HDR + fi->len) {
+        *need = FRAME_HDR + fi->len - avail;
+        return 0;
+    }
+    return 1;
+}
+
+int frame_ready(const FrameBuffer *fb) {
+    FrameInfo fi;
+    size_t need;
+    return frame_parse(fb, &fi, &need);
+}
+
+// Queue descriptors that arrived with a read. SCM_RIGHTS data is delivered
+// no later than the byte it was sent with, so frames find theirs in order.
+static void frame_take_fds(FrameBuffer *fb, struct msghdr *msg) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+        size_t n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (size_t i = 0; i < n; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (fb->fd_count == FRAME_MAX_FDS) {
+                close(fd);
+                continue;
+            }
+            fb->fds[(fb->fd_head + fb->fd_count) % FRAME_MAX_FDS] = fd;
+            fb->fd_count++;
+        }
+    }
+}
+
+// Take the descriptor carrying a payload of len bytes. It must be a memfd
+// sealed against writes and shrinking, and hold at least len bytes, or the
+// peer could change the payload after sending it or make reads of a mapping
+// fault.
+static int frame_pop_fd(FrameBuffer *fb, uint64_t len) {
+    if (fb->fd_count == 0) {
+        errno = EPROTO;
+        return -1;
+    }
+    int fd = fb->fds[fb->fd_head];
+    fb->fd_head = (fb->fd_head + 1) % FRAME_MAX_FDS;
+    fb->fd_count--;
+
+    struct stat st;
+    int ok = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (uint64_t)st.st_size >= len;
+#ifdef __linux__
+    int seals = ok ? fcntl(fd, F_GET_SEALS) : -1;
+    ok = seals != -1 && (seals & (F_SEAL_WRITE | F_SEAL_SHRINK)) == (F_SEAL_WRITE | F_SEAL_SHRINK);
+#else
+    ok = 0;
+#endif
+    if (!ok) {
+        close(fd);
+        errno = EPROTO;
+        return -1;
+    }
+    return fd;
+}
+
+// Read at least the `need` missing bytes' worth of room. Returns the byte
+// count, 0 on EOF or -1.
+static ssize_t frame_fill(int fd, FrameBuffer *fb, size_t need) {
+    if (frame_reserve(fb, need) == -1) return -1;
+    for (;;) {
+        ssize_t n;
+        ipc_stat_syscall();
+        if (fb->pass_fds) {
+            union {
+                struct cmsghdr align;
+                char buf[CMSG_SPACE(FRAME_MAX_FDS * sizeof(int))];
+            } control;
+            struct iovec iov = { fb->buf + fb->end, fb->cap - fb->end };
+            struct msghdr msg = {
+                .msg_iov = &iov, .msg_iovlen = 1,
+                .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+            };
+            n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+            if (n > 0) frame_take_fds(fb, &msg);
+        } else {
+            n = read(fd, fb->buf + fb->end, fb->cap - fb->end);
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n > 0) fb->end += n;
+        return n;
+    }
+}
+
+// Copy a memfd payload out and drop the descriptor
+static int frame_read_fd(FrameBuffer *fb, void *dst, uint64_t len) {
+    int fd = frame_pop_fd(fb, len);
+    if (fd == -1) return -1;
+    uint64_t off = 0;
+    while (off < len) {
+        ipc_stat_syscall();
+        ssize_t n = pread(fd, (unsigned char *)dst + off, len - off, off);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) {
+            close(fd);
+            if (n == 0) errno = EPROTO;
+            return -1;
+        }
+        off += n;
+    }
+    close(fd);
+    return 0;
+}
+
+int frame_recv(int fd, FrameBuffer *fb, IPC_Msg *msgs, size_t count) {
+    size_t got = 0;
+    for (;;) {
+        FrameInfo fi;
+        size_t need = FRAME_HDR;
+        while (got < count && frame_parse(fb, &fi, &need)) {
+            if (fi.len > msgs[got].len) {
+                if (got) return (int)got;
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (fi.is_fd) {
+                fb->start += fi.hdr;
+                if (frame_read_fd(fb, msgs[got].data, fi.len) == -1) {
+                    return got ? (int)got : -1;
+                }
+            } else {
+                memcpy(msgs[got].data, fb->buf + fb->start + fi.hdr, fi.len);
+                fb->start += fi.hdr + fi.len;
+            }
+            msgs[got].len = fi.len;
+            got++;
+        }
+        if (got) return (int)got;
+
+        // No complete frame: read at least the rest of the current one
+        ssize_t n = frame_fill(fd, fb, need);
+        if (n <= 0) return (int)n;
+    }
+}
+
+int frame_peek(int fd, FrameBuffer *fb, void **payload, size_t *len,
+               int *memfd, size_t *frame_size) {
+    FrameInfo fi;
+    size_t need;
+    while (!frame_parse(fb, &fi, &need)) {
+        ssize_t n = frame_fill(fd, fb, need);
+        if (n <= 0) return (int)n;
+    }
+    *len = fi.len;
+    if (fi.is_fd) {
+        fb->start += fi.hdr;
+        *memfd = frame_pop_fd(fb, fi.len);
+        if (*memfd == -1) return -1;
+        *payload = NULL;
+        *frame_size = 0;
+    } else {
+        *memfd = -1;
+        *payload = fb->buf + fb->start + fi.hdr;
+        *frame_size = fi.hdr + fi.len;
+    }
+    return 1;
+}
+
+void frame_consume(FrameBuffer *fb, size_t frame_size) {
+    fb->start += frame_size;
+}
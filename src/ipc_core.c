@@ -1,4 +1,4 @@
-#include "ipc.h"
+#include "ipc_internal.h"
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
@@ -8,54 +8,89 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdio.h>  // For tempnam
-
-// Forward declarations
-IPC_Handle init_shm(const IPC_Config *config);
-int ipc_send_shm(IPC_Handle handle, const void *data, size_t len);
-int ipc_recv_shm(IPC_Handle handle, void *buf, size_t len);
-void close_shm(IPC_Handle handle);
-
-#ifdef __linux__
-IPC_Handle init_mq_posix(const IPC_Config *config);
-int ipc_send_mq_posix(IPC_Handle handle, const void *data, size_t len);
-int ipc_recv_mq_posix(IPC_Handle handle, void *buf, size_t len);
-void close_mq_posix(IPC_Handle handle);
-
-IPC_Handle init_mq_sysv(const IPC_Config *config);
-int ipc_send_mq_sysv(IPC_Handle handle, const void *data, size_t len);
-int ipc_recv_mq_sysv(IPC_Handle handle, void *buf, size_t len);
-void close_mq_sysv(IPC_Handle handle);
-#endif
-
-IPC_Handle init_pipe_named(const IPC_Config *config);
-int ipc_send_pipe_named(IPC_Handle handle, const void *data, size_t len);
-int ipc_recv_pipe_named(IPC_Handle handle, void *buf, size_t len);
-void close_pipe_named(IPC_Handle handle);
-
-IPC_Handle init_pipe_unnamed(const IPC_Config *config);
-int ipc_send_pipe_unnamed(IPC_Handle handle, const void *data, size_t len);
-int ipc_recv_pipe_unnamed(IPC_Handle handle, void *buf, size_t len);
-void close_pipe_unnamed(IPC_Handle handle);
-
-IPC_Handle init_socket_unix(const IPC_Config *config);
-int ipc_send_socket_unix(IPC_Handle handle, const void *data, size_t len);
-int ipc_recv_socket_unix(IPC_Handle handle, void *buf, size_t len);
-void close_socket_unix(IPC_Handle handle);
-
-IPC_Handle init_socket_tcp(const IPC_Config *config);
-int ipc_send_socket_tcp(IPC_Handle handle, const void *data, size_t len);
-int ipc_recv_socket_tcp(IPC_Handle handle, void *buf, size_t len);
-void close_socket_tcp(IPC_Handle handle);
-
-// Internal handle structure
+#include <poll.h>
+#include <time.h>
+
+// Transport registry, indexed by mechanism
+static const IPC_TransportOps *transports[IPC_MECH_MAX] = {
+    [IPC_SHM_MUTEX] = &ipc_shm_mutex_ops,
+    [IPC_MQ_POSIX] = &ipc_mq_posix_ops,
+    [IPC_MQ_SYSV] = &ipc_mq_sysv_ops,
+    [IPC_PIPE_UNNAMED] = &ipc_pipe_unnamed_ops,
+    [IPC_PIPE_NAMED] = &ipc_pipe_named_ops,
+    [IPC_SOCKET_UNIX] = &ipc_socket_unix_ops,
+    [IPC_SOCKET_TCP] = &ipc_socket_tcp_ops,
+    [IPC_SHM_RING] = &ipc_shm_ring_ops,
+    [IPC_SHM_QUEUE] = &ipc_shm_queue_ops,
+    [IPC_SHM_BROADCAST] = &ipc_shm_broadcast_ops,
+};
+
+// Internal handle structure. The ops table is resolved once at init so every
+// call afterwards is a single indirect call.
 typedef struct {
-    IPC_Mechanism mech;
+    const IPC_TransportOps *ops;
     IPC_Handle mech_handle;
+    IPC_Mechanism mech;
+    // IPC_STATS only; calls on handles without stats take a single branch
+    StatsBlock *stats;
+    ShmSegment stats_seg;
+    size_t loan_len;  // Size of the outstanding send reservation
+    // Tracing: channel id and messages sent and received so far
+    uint64_t trace_id;
+    uint64_t trace_seq[2];
 } IPC_CoreHandle;
 
+// Stats and tracing see a call through core_begin/core_end; everything else
+// takes the plain path
+static inline int core_observed(const IPC_CoreHandle *core_h) {
+    return core_h->stats || trace_enabled();
+}
+
+typedef struct {
+    uint64_t ns;     // For stats
+    uint64_t ticks;  // For the trace
+} CoreStart;
+
+static inline CoreStart core_begin(IPC_CoreHandle *core_h) {
+    CoreStart t0 = { 0, 0 };
+    if (core_h->stats) t0.ns = stats_begin(core_h->stats);
+    if (trace_enabled()) t0.ticks = trace_ticks();
+    return t0;
+}
+
+// op is IPC_TRACE_SEND or IPC_TRACE_RECV
+static inline void core_end(IPC_CoreHandle *core_h, int op, int ret, uint64_t msgs,
+                            uint64_t bytes, CoreStart t0) {
+    if (core_h->stats) {
+        stats_end(op == IPC_TRACE_SEND ? &core_h->stats->send : &core_h->stats->recv,
+                  ret, msgs, bytes, t0.ns);
+    }
+    // Tracing may have been switched on during the call
+    if (trace_enabled() && t0.ticks) {
+        trace_record(core_h->trace_id, op, &core_h->trace_seq[op == IPC_TRACE_RECV], ret,
+                     msgs, bytes, t0.ticks);
+    }
+}
+
+int ipc_register_transport(IPC_Mechanism mech, const IPC_TransportOps *ops) {
+    if (mech < IPC_MECH_USER || mech >= IPC_MECH_MAX || !ops ||
+        !ops->init || !ops->send || !ops->recv || !ops->close) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (transports[mech]) {
+        errno = EEXIST;
+        return -1;
+    }
+    transports[mech] = ops;
+    return 0;
+}
+
 // Initialize IPC based on config
 IPC_Handle ipc_init(const IPC_Config *config) {
-    if (!config || !config->name || config->size == 0) {
+    if (!config || !config->name || config->size == 0 ||
+        (unsigned)config->mech >= IPC_MECH_MAX || !transports[config->mech] ||
+        config->priorities > IPC_PRIORITIES_MAX) {
         errno = EINVAL;
         return NULL;
     }
@@ -66,45 +101,24 @@ IPC_Handle ipc_init(const IPC_Config *config) {
         return NULL;
     }
     core_h->mech = config->mech;
-
-    switch (core_h->mech) {
-        case IPC_SHM_MUTEX:
-            core_h->mech_handle = init_shm(config);
-            break;
-#ifdef __linux__
-        case IPC_MQ_POSIX:
-            core_h->mech_handle = init_mq_posix(config);
-            break;
-        case IPC_MQ_SYSV:
-            core_h->mech_handle = init_mq_sysv(config);
-            break;
-#else
-        case IPC_MQ_POSIX:
-        case IPC_MQ_SYSV:
-            errno = ENOTSUP;
-            free(core_h);
-            return NULL;
-#endif
-        case IPC_PIPE_NAMED:
-            core_h->mech_handle = init_pipe_named(config);
-            break;
-        case IPC_PIPE_UNNAMED:
-            core_h->mech_handle = init_pipe_unnamed(config);
-            break;
-        case IPC_SOCKET_UNIX:
-            core_h->mech_handle = init_socket_unix(config);
-            break;
-        case IPC_SOCKET_TCP:
-            core_h->mech_handle = init_socket_tcp(config);
-            break;
-        default:
+    core_h->ops = transports[config->mech];
+    core_h->stats = NULL;
+    core_h->loan_len = 0;
+    core_h->trace_id = trace_channel(config);
+    core_h->trace_seq[0] = core_h->trace_seq[1] = 0;
+    if ((config->flags & IPC_STATS) || config->stats_name) {
+        core_h->stats = stats_open(config, &core_h->stats_seg);
+        if (!core_h->stats) {
             free(core_h);
-            errno = EINVAL;
             return NULL;
+        }
     }
-
+    core_h->mech_handle = core_h->ops->init(config);
     if (!core_h->mech_handle) {
+        int err = errno;
+        if (core_h->stats) stats_close(core_h->stats, &core_h->stats_seg);
         free(core_h);
+        errno = err;
         return NULL;
     }
     return core_h;
@@ -118,27 +132,11 @@ int ipc_send(IPC_Handle handle, const void *data, size_t len) {
     }
 
     IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
-    switch (core_h->mech) {
-        case IPC_SHM_MUTEX:
-            return ipc_send_shm(core_h->mech_handle, data, len);
-#ifdef __linux__
-        case IPC_MQ_POSIX:
-            return ipc_send_mq_posix(core_h->mech_handle, data, len);
-        case IPC_MQ_SYSV:
-            return ipc_send_mq_sysv(core_h->mech_handle, data, len);
-#endif
-        case IPC_PIPE_NAMED:
-            return ipc_send_pipe_named(core_h->mech_handle, data, len);
-        case IPC_PIPE_UNNAMED:
-            return ipc_send_pipe_unnamed(core_h->mech_handle, data, len);
-        case IPC_SOCKET_UNIX:
-            return ipc_send_socket_unix(core_h->mech_handle, data, len);
-        case IPC_SOCKET_TCP:
-            return ipc_send_socket_tcp(core_h->mech_handle, data, len);
-        default:
-            errno = EINVAL;
-            return -1;
-    }
+    if (!core_observed(core_h)) return core_h->ops->send(core_h->mech_handle, data, len);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_h->ops->send(core_h->mech_handle, data, len);
+    core_end(core_h, IPC_TRACE_SEND, ret, 1, len, t0);
+    return ret;
 }
 
 // Receive data
@@ -149,27 +147,93 @@ int ipc_recv(IPC_Handle handle, void *buf, size_t len) {
     }
 
     IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
-    switch (core_h->mech) {
-        case IPC_SHM_MUTEX:
-            return ipc_recv_shm(core_h->mech_handle, buf, len);
-#ifdef __linux__
-        case IPC_MQ_POSIX:
-            return ipc_recv_mq_posix(core_h->mech_handle, buf, len);
-        case IPC_MQ_SYSV:
-            return ipc_recv_mq_sysv(core_h->mech_handle, buf, len);
-#endif
-        case IPC_PIPE_NAMED:
-            return ipc_recv_pipe_named(core_h->mech_handle, buf, len);
-        case IPC_PIPE_UNNAMED:
-            return ipc_recv_pipe_unnamed(core_h->mech_handle, buf, len);
-        case IPC_SOCKET_UNIX:
-            return ipc_recv_socket_unix(core_h->mech_handle, buf, len);
-        case IPC_SOCKET_TCP:
-            return ipc_recv_socket_tcp(core_h->mech_handle, buf, len);
-        default:
-            errno = EINVAL;
-            return -1;
+    if (!core_observed(core_h)) return core_h->ops->recv(core_h->mech_handle, buf, len);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_h->ops->recv(core_h->mech_handle, buf, len);
+    core_end(core_h, IPC_TRACE_RECV, ret, ret > 0, ret > 0 ? ret : 0, t0);
+    return ret;
+}
+
+// Timeouts must be -1 (forever) or a non-negative number of milliseconds
+int ipc_send_timed(IPC_Handle handle, const void *data, size_t len, int timeout_ms) {
+    if (!handle || !data || len == 0 || timeout_ms < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    const IPC_TransportOps *ops = core_h->ops;
+    if (!core_observed(core_h)) {
+        return ops->send_timed ? ops->send_timed(core_h->mech_handle, data, len, timeout_ms)
+                               : ops->send(core_h->mech_handle, data, len);
     }
+    CoreStart t0 = core_begin(core_h);
+    int ret = ops->send_timed ? ops->send_timed(core_h->mech_handle, data, len, timeout_ms)
+                              : ops->send(core_h->mech_handle, data, len);
+    core_end(core_h, IPC_TRACE_SEND, ret, 1, len, t0);
+    return ret;
+}
+
+int ipc_recv_timed(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    if (!handle || !buf || len == 0 || timeout_ms < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    const IPC_TransportOps *ops = core_h->ops;
+    if (!core_observed(core_h)) {
+        return ops->recv_timed ? ops->recv_timed(core_h->mech_handle, buf, len, timeout_ms)
+                               : ops->recv(core_h->mech_handle, buf, len);
+    }
+    CoreStart t0 = core_begin(core_h);
+    int ret = ops->recv_timed ? ops->recv_timed(core_h->mech_handle, buf, len, timeout_ms)
+                              : ops->recv(core_h->mech_handle, buf, len);
+    core_end(core_h, IPC_TRACE_RECV, ret, ret > 0, ret > 0 ? ret : 0, t0);
+    return ret;
+}
+
+int ipc_send_prio(IPC_Handle handle, const void *data, size_t len, unsigned prio) {
+    if (!handle || !data || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    const IPC_TransportOps *ops = core_h->ops;
+    if (!ops->send_prio && prio != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!core_observed(core_h)) {
+        return ops->send_prio ? ops->send_prio(core_h->mech_handle, data, len, prio)
+                              : ops->send(core_h->mech_handle, data, len);
+    }
+    CoreStart t0 = core_begin(core_h);
+    int ret = ops->send_prio ? ops->send_prio(core_h->mech_handle, data, len, prio)
+                             : ops->send(core_h->mech_handle, data, len);
+    core_end(core_h, IPC_TRACE_SEND, ret, 1, len, t0);
+    return ret;
+}
+
+int ipc_recv_prio(IPC_Handle handle, void *buf, size_t len, unsigned *prio) {
+    if (!handle || !buf || len == 0 || !prio) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    const IPC_TransportOps *ops = core_h->ops;
+    *prio = 0;
+    if (!core_observed(core_h)) {
+        return ops->recv_prio ? ops->recv_prio(core_h->mech_handle, buf, len, prio)
+                              : ops->recv(core_h->mech_handle, buf, len);
+    }
+    CoreStart t0 = core_begin(core_h);
+    int ret = ops->recv_prio ? ops->recv_prio(core_h->mech_handle, buf, len, prio)
+                             : ops->recv(core_h->mech_handle, buf, len);
+    core_end(core_h, IPC_TRACE_RECV, ret, ret > 0, ret > 0 ? ret : 0, t0);
+    return ret;
 }
 
 // Close and cleanup
@@ -177,36 +241,334 @@ void ipc_close(IPC_Handle handle) {
     if (!handle) return;
 
     IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
-    switch (core_h->mech) {
-        case IPC_SHM_MUTEX:
-            close_shm(core_h->mech_handle);
-            break;
-#ifdef __linux__
-        case IPC_MQ_POSIX:
-            close_mq_posix(core_h->mech_handle);
-            break;
-        case IPC_MQ_SYSV:
-            close_mq_sysv(core_h->mech_handle);
-            break;
-#endif
-        case IPC_PIPE_NAMED:
-            close_pipe_named(core_h->mech_handle);
-            break;
-        case IPC_PIPE_UNNAMED:
-            close_pipe_unnamed(core_h->mech_handle);
-            break;
-        case IPC_SOCKET_UNIX:
-            close_socket_unix(core_h->mech_handle);
-            break;
-        case IPC_SOCKET_TCP:
-            close_socket_tcp(core_h->mech_handle);
-            break;
-        default:
-            break;
-    }
+    core_h->ops->close(core_h->mech_handle);
+    if (core_h->stats) stats_close(core_h->stats, &core_h->stats_seg);
     free(core_h);
 }
 
+int ipc_send_to(IPC_Handle handle, uint32_t conn, const void *data, size_t len) {
+    if (!handle || !data || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->send_to) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!core_observed(core_h)) return core_h->ops->send_to(core_h->mech_handle, conn, data, len);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_h->ops->send_to(core_h->mech_handle, conn, data, len);
+    core_end(core_h, IPC_TRACE_SEND, ret, 1, len, t0);
+    return ret;
+}
+
+int ipc_recv_from(IPC_Handle handle, uint32_t *conn, void *buf, size_t len) {
+    if (!handle || !conn || !buf || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->recv_from) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!core_observed(core_h)) return core_h->ops->recv_from(core_h->mech_handle, conn, buf, len);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_h->ops->recv_from(core_h->mech_handle, conn, buf, len);
+    core_end(core_h, IPC_TRACE_RECV, ret, ret > 0, ret > 0 ? ret : 0, t0);
+    return ret;
+}
+
+static uint64_t msgs_bytes(const IPC_Msg *msgs, int n) {
+    uint64_t bytes = 0;
+    for (int i = 0; i < n; i++) bytes += msgs[i].len;
+    return bytes;
+}
+
+static int core_send_batch(IPC_CoreHandle *core_h, const IPC_Msg *msgs, size_t count) {
+    if (core_h->ops->send_batch) {
+        return core_h->ops->send_batch(core_h->mech_handle, msgs, count);
+    }
+    size_t sent;
+    for (sent = 0; sent < count; sent++) {
+        if (core_h->ops->send(core_h->mech_handle, msgs[sent].data, msgs[sent].len) == -1) break;
+    }
+    return sent ? (int)sent : -1;
+}
+
+// Send several messages with one dispatch
+int ipc_send_batch(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    if (!handle || !msgs || count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_observed(core_h)) return core_send_batch(core_h, msgs, count);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_send_batch(core_h, msgs, count);
+    core_end(core_h, IPC_TRACE_SEND, ret, ret > 0 ? ret : 0, msgs_bytes(msgs, ret), t0);
+    return ret;
+}
+
+static int core_recv_batch(IPC_CoreHandle *core_h, IPC_Msg *msgs, size_t count) {
+    if (core_h->ops->recv_batch) {
+        return core_h->ops->recv_batch(core_h->mech_handle, msgs, count);
+    }
+    int ret = core_h->ops->recv(core_h->mech_handle, msgs[0].data, msgs[0].len);
+    if (ret == -1) return -1;
+    msgs[0].len = ret;
+    return 1;
+}
+
+// Receive several messages with one dispatch
+int ipc_recv_batch(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    if (!handle || !msgs || count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_observed(core_h)) return core_recv_batch(core_h, msgs, count);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_recv_batch(core_h, msgs, count);
+    core_end(core_h, IPC_TRACE_RECV, ret, ret > 0 ? ret : 0, msgs_bytes(msgs, ret), t0);
+    return ret;
+}
+
+// Zero-copy send: reserve space in the channel, then publish it
+int ipc_send_reserve(IPC_Handle handle, size_t len, void **ptr) {
+    if (!handle || !ptr || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->send_reserve) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    int ret = core_h->ops->send_reserve(core_h->mech_handle, len, ptr);
+    if (ret == 0) core_h->loan_len = len;
+    return ret;
+}
+
+int ipc_send_commit(IPC_Handle handle, void *ptr) {
+    if (!handle || !ptr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->send_commit) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!core_observed(core_h)) return core_h->ops->send_commit(core_h->mech_handle, ptr);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_h->ops->send_commit(core_h->mech_handle, ptr);
+    core_end(core_h, IPC_TRACE_SEND, ret, 1, core_h->loan_len, t0);
+    return ret;
+}
+
+// Zero-copy receive: borrow the next message in place, then hand it back
+int ipc_recv_acquire(IPC_Handle handle, void **ptr, size_t *len) {
+    if (!handle || !ptr || !len) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->recv_acquire) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!core_observed(core_h)) return core_h->ops->recv_acquire(core_h->mech_handle, ptr, len);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_h->ops->recv_acquire(core_h->mech_handle, ptr, len);
+    core_end(core_h, IPC_TRACE_RECV, ret, 1, ret == -1 ? 0 : *len, t0);
+    return ret;
+}
+
+int ipc_recv_release(IPC_Handle handle, void *ptr) {
+    if (!handle || !ptr) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->recv_release) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return core_h->ops->recv_release(core_h->mech_handle, ptr);
+}
+
+int ipc_get_fd(IPC_Handle handle) {
+    if (!handle) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->get_fd) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return core_h->ops->get_fd(core_h->mech_handle);
+}
+
+int ipc_recv_splice(IPC_Handle handle, int fd, size_t len) {
+    if (!handle || fd < 0 || len == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->recv_splice) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (!core_observed(core_h)) return core_h->ops->recv_splice(core_h->mech_handle, fd, len);
+    CoreStart t0 = core_begin(core_h);
+    int ret = core_h->ops->recv_splice(core_h->mech_handle, fd, len);
+    // A splice moves bytes, not messages
+    core_end(core_h, IPC_TRACE_RECV, ret, 0, ret > 0 ? ret : 0, t0);
+    return ret;
+}
+
+int ipc_core_io_fd(IPC_Handle handle, int write, int *nonblock) {
+    if (!handle) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->ops->io_fd) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    return core_h->ops->io_fd(core_h->mech_handle, write, nonblock);
+}
+
+int ipc_get_stats(IPC_Handle handle, IPC_Stats *out) {
+    if (!handle || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    IPC_CoreHandle *core_h = (IPC_CoreHandle *)handle;
+    if (!core_h->stats) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    stats_copy(core_h->stats, out);
+    return 0;
+}
+
+#define IPC_POLL_STACK 64
+
+// A poll set that is rebuilt on every call is cheaper with poll(2) than with
+// epoll, which would need one epoll_ctl per handle before each wait.
+// Callers that keep a long-lived set can add ipc_get_fd() fds to their own
+// epoll instance.
+// One arm/poll/disarm round. *woke tells whether poll saw an fd fire.
+static int ipc_poll_once(IPC_Handle *handles, size_t n, int timeout_ms, int *ready,
+                         struct pollfd *fds, int *woke) {
+    // Handles that are ready up front are left out of the poll (fd -1) and
+    // make it return at once
+    size_t armed;
+    int nready = 0;
+    int ret = -1;
+    for (armed = 0; armed < n; armed++) {
+        IPC_CoreHandle *core_h = (IPC_CoreHandle *)handles[armed];
+        if (!core_h) {
+            errno = EINVAL;
+            goto out;
+        }
+        if (!core_h->ops->get_fd) {
+            errno = ENOTSUP;
+            goto out;
+        }
+        ready[armed] = 0;
+        fds[armed].fd = core_h->ops->get_fd(core_h->mech_handle);
+        fds[armed].events = POLLIN;
+        fds[armed].revents = 0;
+        if (fds[armed].fd == -1) goto out;
+        if (core_h->ops->poll_arm) {
+            int r = core_h->ops->poll_arm(core_h->mech_handle);
+            if (r == -1) goto out;
+            if (r == 1) {
+                ready[armed] = 1;
+                fds[armed].fd = -1;
+                nready++;
+            }
+        }
+    }
+
+    ret = poll(fds, n, nready ? 0 : timeout_ms);
+
+out:;
+    // Disarm everything that was armed, even when the poll failed
+    int saved = errno;
+    for (size_t i = 0; i < armed; i++) {
+        IPC_CoreHandle *core_h = (IPC_CoreHandle *)handles[i];
+        if (ready[i]) continue;
+        if (core_h->ops->poll_disarm) {
+            int r = core_h->ops->poll_disarm(core_h->mech_handle);
+            ready[i] = ret >= 0 && r == 1;
+        } else {
+            ready[i] = ret >= 0 && (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+        }
+        nready += ready[i];
+    }
+    *woke = ret > 0;
+    errno = saved;
+    return ret == -1 ? -1 : nready;
+}
+
+int ipc_poll(IPC_Handle *handles, size_t n, int timeout_ms, int *ready) {
+    if (!handles || !ready || n == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct pollfd stack[IPC_POLL_STACK];
+    struct pollfd *fds = stack;
+    if (n > IPC_POLL_STACK) {
+        fds = malloc(n * sizeof(*fds));
+        if (!fds) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+
+    struct timespec start;
+    if (timeout_ms > 0) clock_gettime(CLOCK_MONOTONIC, &start);
+    int wait_ms = timeout_ms;
+    int ret;
+    for (;;) {
+        int woke;
+        ret = ipc_poll_once(handles, n, wait_ms, ready, fds, &woke);
+        // A doorbell rung after an earlier disarm drained it wakes the poll
+        // with nothing to receive; keep waiting for the rest of the timeout
+        if (ret != 0 || !woke || timeout_ms == 0) break;
+        if (timeout_ms > 0) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long elapsed = (now.tv_sec - start.tv_sec) * 1000 +
+                           (now.tv_nsec - start.tv_nsec) / 1000000;
+            if (elapsed >= timeout_ms) break;
+            wait_ms = timeout_ms - (int)elapsed;
+        }
+    }
+    if (fds != stack) free(fds);
+    return ret;
+}
+
 // Mutex implementation
 typedef struct {
     pthread_mutex_t *mutex;
@@ -0,0 +1,376 @@
+#ifndef IPC_INTERNAL_H
+#define IPC_INTERNAL_H
+
+#include "ipc.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+
+#define IPC_CACHELINE 64
+
+// Built-in transports
+extern const IPC_TransportOps ipc_shm_mutex_ops;
+extern const IPC_TransportOps ipc_shm_ring_ops;
+extern const IPC_TransportOps ipc_shm_queue_ops;
+extern const IPC_TransportOps ipc_shm_broadcast_ops;
+extern const IPC_TransportOps ipc_mq_posix_ops;
+extern const IPC_TransportOps ipc_mq_sysv_ops;
+extern const IPC_TransportOps ipc_pipe_named_ops;
+extern const IPC_TransportOps ipc_pipe_unnamed_ops;
+extern const IPC_TransportOps ipc_socket_unix_ops;
+extern const IPC_TransportOps ipc_socket_tcp_ops;
+
+// Stream descriptor of a handle for the async backend
+int ipc_core_io_fd(IPC_Handle handle, int write, int *nonblock);
+
+// Every shared-memory transport starts its segment with this header. The
+// creator fills in the transport area and then sets ready, so attaching
+// processes never see a half-initialized segment. Attachers check magic,
+// version and mech before touching anything else; bump SHM_LAYOUT_VERSION
+// whenever this header or a transport's shared layout changes.
+#define SHM_MAGIC 0x49504353u  // "IPCS"
+#define SHM_LAYOUT_VERSION 2u
+
+typedef struct {
+    _Alignas(IPC_CACHELINE) atomic_uint ready;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t mech;  // IPC_Mechanism that laid out the transport area
+    uint64_t size;  // Bytes following the header
+} ShmSegmentHeader;
+
+typedef struct {
+    ShmSegmentHeader *hdr;
+    void *mem;         // Transport area following the header
+    size_t size;       // Size of the transport area
+    size_t map_size;
+    int owner;         // Created the segment; unlinks it on close
+    char *name;
+    char *path;        // hugetlbfs file backing the segment, NULL for POSIX shm
+    uid_t uid;         // Owner and permission bits of the backing object
+    mode_t mode;
+} ShmSegment;
+
+// Segments that are not transports are tagged past the mechanism range
+#define SHM_KIND_POOL IPC_MECH_MAX
+#define SHM_KIND_STATS (IPC_MECH_MAX + 1)
+
+typedef void (*ShmSegmentInit)(void *mem, size_t size, void *arg);
+
+// Create the segment config->name with a transport area of `size` bytes,
+// running `init` on it, or attach to it if another process already created
+// it. IPC_CREATE and IPC_ATTACH in config->flags restrict it to one of the
+// two. Attaching never runs `init` and ignores `size`.
+int shm_segment_open(ShmSegment *seg, const IPC_Config *config, size_t size,
+                     ShmSegmentInit init, void *arg);
+void shm_segment_close(ShmSegment *seg);
+
+// Backing object for a named segment: POSIX shm, or a file under the
+// hugetlbfs mount when opts asks for huge pages. *path receives the file
+// name in the latter case and NULL otherwise.
+int shm_backing_open(const char *name, int oflag, const IPC_ShmOptions *opts, char **path);
+int shm_backing_unlink(const char *name, const char *path);
+// Object size holding len bytes; hugetlbfs needs whole huge pages
+size_t shm_backing_size(int fd, size_t len, const char *path);
+// Apply NUMA binding, prefaulting and locking to a fresh mapping
+int shm_map_tune(void *mem, size_t len, const IPC_ShmOptions *opts);
+
+#if defined(__x86_64__) || defined(__i386__)
+#define IPC_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define IPC_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define IPC_CPU_RELAX() do {} while (0)
+#endif
+
+#define SHM_SPIN_DEFAULT 1024
+
+// Parking spot for receivers of a shared-memory channel. Receivers that run
+// out of spins register in waiters and sleep on seq; senders only touch seq
+// and enter the kernel when they see a registered waiter. Receivers parked
+// in ipc_poll also count themselves in pollers and are woken via a doorbell.
+typedef struct {
+    _Alignas(IPC_CACHELINE) atomic_uint seq;
+    atomic_uint waiters;
+    atomic_uint pollers;
+} ShmWaitQueue;
+
+// A futex cannot sit in a poll set, so pollers wait on a FIFO next to the
+// segment instead. Every process opens it read-write and non-blocking, which
+// rules out ENXIO, EPIPE/SIGPIPE and blocking on a full pipe. The FIFO takes
+// the segment's permission bits, and is only used if it belongs to this user
+// or to the segment's owner, so nobody who could not write the segment can
+// plant or ring it.
+typedef struct {
+    int fd;      // -1 until first used
+    char *path;
+    uid_t uid;   // Of the segment
+    mode_t mode;
+} ShmDoorbell;
+
+int shm_doorbell_init(ShmDoorbell *bell, const ShmSegment *seg);
+// Open the FIFO on first use; returns its fd
+int shm_doorbell_fd(ShmDoorbell *bell);
+void shm_doorbell_close(ShmDoorbell *bell, int unlink_fifo);
+
+// Attempt an operation; returns >= 0 on success, or -1 with errno set.
+// EAGAIN means "nothing yet" and keeps the caller waiting.
+typedef int (*ShmTryFn)(void *arg);
+
+void shm_wait_init(ShmWaitQueue *wq);
+// Retry `try` for up to `spins` iterations, then park until woken or the
+// deadline passes. IPC_NO_WAIT makes a single attempt.
+int shm_wait_until(ShmWaitQueue *wq, uint32_t spins, ShmTryFn try, void *arg,
+                   uint64_t deadline);
+void shm_wait_wake_slow(ShmWaitQueue *wq, ShmDoorbell *bell, int count);
+
+// Register as a poller before checking the channel and polling the doorbell,
+// and unregister afterwards. Disarming also drains the doorbell.
+int shm_wait_arm(ShmWaitQueue *wq, ShmDoorbell *bell);
+void shm_wait_disarm(ShmWaitQueue *wq, ShmDoorbell *bell);
+
+// Called by senders after publishing. The fence pairs with the one in
+// shm_wait_until so that either the waiter sees the new data or the sender
+// sees the waiter.
+static inline void shm_wait_wake(ShmWaitQueue *wq, ShmDoorbell *bell, int count) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&wq->waiters, memory_order_relaxed))
+        shm_wait_wake_slow(wq, bell, count);
+}
+
+// Counters behind IPC_Stats. Each direction is written only by the threads
+// calling it, and sits on its own cache lines so a sender and a receiver
+// sharing a handle do not contend. The same layout is the body of an export
+// segment.
+typedef struct {
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t msgs;
+    atomic_uint_fast64_t bytes;
+    atomic_uint_fast64_t would_block;
+    atomic_uint_fast64_t errors;
+    atomic_uint_fast64_t latency[IPC_STATS_BUCKETS];
+} StatsDir;
+
+typedef struct {
+    StatsDir send;
+    StatsDir recv;
+    // Charged from inside transports by whichever direction is running
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t syscalls;
+    atomic_uint_fast64_t blocked_ns;
+} StatsBlock;
+
+// Block of the handle whose call is running on this thread, NULL when stats
+// are off. Set by the dispatchers around the transport call, so transports
+// charge syscalls and waits without being handed the block.
+extern _Thread_local StatsBlock *ipc_stats_cur;
+
+// Allocate the block for an IPC_STATS handle, in an export segment when
+// config->stats_name is set (seg->hdr is NULL otherwise)
+StatsBlock *stats_open(const IPC_Config *config, ShmSegment *seg);
+void stats_close(StatsBlock *s, ShmSegment *seg);
+// Bracket one instrumented call. stats_end counts ret == -1 as a would-block
+// or an error, anything else as msgs messages of bytes in total.
+uint64_t stats_begin(StatsBlock *s);
+void stats_end(StatsDir *dir, int ret, uint64_t msgs, uint64_t bytes, uint64_t t0);
+void stats_copy(const StatsBlock *s, IPC_Stats *out);
+
+static inline uint64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static inline void ipc_stat_syscall(void) {
+    StatsBlock *s = ipc_stats_cur;
+    if (s) atomic_fetch_add_explicit(&s->syscalls, 1, memory_order_relaxed);
+}
+
+// Bracket a call that may sleep; returns 0 when stats are off
+static inline uint64_t ipc_stat_block_begin(void) {
+    return ipc_stats_cur ? stats_now_ns() : 0;
+}
+
+static inline void ipc_stat_block_end(uint64_t t0) {
+    StatsBlock *s = ipc_stats_cur;
+    if (s && t0) atomic_fetch_add_explicit(&s->blocked_ns, stats_now_ns() - t0, memory_order_relaxed);
+}
+
+// poll(2) for transports waiting on their own fds, charged as a blocking call
+static inline int ipc_stat_poll(struct pollfd *fds, nfds_t n, int timeout_ms) {
+    ipc_stat_syscall();
+    uint64_t t0 = ipc_stat_block_begin();
+    int ret = poll(fds, n, timeout_ms);
+    ipc_stat_block_end(t0);
+    return ret;
+}
+
+// Deadlines for calls that may wait: absolute CLOCK_MONOTONIC nanoseconds,
+// or one of the two sentinels. Transports keep the deadline their plain
+// send/recv use (IPC_NO_WAIT under IPC_NONBLOCK) and take one from the
+// caller in the timed variants.
+#define IPC_NO_DEADLINE UINT64_MAX
+#define IPC_NO_WAIT 0
+
+static inline uint64_t ipc_deadline(int timeout_ms) {
+    if (timeout_ms < 0) return IPC_NO_DEADLINE;
+    if (timeout_ms == 0) return IPC_NO_WAIT;
+    return stats_now_ns() + (uint64_t)timeout_ms * 1000000u;
+}
+
+static inline uint64_t ipc_default_deadline(const IPC_Config *config) {
+    return (config->flags & IPC_NONBLOCK) ? IPC_NO_WAIT : IPC_NO_DEADLINE;
+}
+
+// Nanoseconds left, 0 once the deadline has passed
+static inline uint64_t ipc_deadline_left(uint64_t deadline) {
+    uint64_t now = stats_now_ns();
+    return deadline > now ? deadline - now : 0;
+}
+
+// Fail a call whose deadline passed: EAGAIN if it was not to wait at all
+static inline int ipc_expired(uint64_t deadline) {
+    errno = deadline == IPC_NO_WAIT ? EAGAIN : ETIMEDOUT;
+    return -1;
+}
+
+// Wait until fd polls ready for events. Returns 0, or -1 with errno set,
+// by ipc_expired if the deadline passed first.
+static inline int ipc_wait_fd(int fd, short events, uint64_t deadline) {
+    struct pollfd pfd = { .fd = fd, .events = events };
+    for (;;) {
+        int ms = -1;
+        if (deadline != IPC_NO_DEADLINE) {
+            // Rounded up so the wait never ends just short of the deadline
+            uint64_t left = deadline == IPC_NO_WAIT ? 0 : ipc_deadline_left(deadline);
+            ms = left > (uint64_t)INT_MAX * 1000000u ? INT_MAX : (int)((left + 999999) / 1000000);
+        }
+        int ret = ipc_stat_poll(&pfd, 1, ms);
+        if (ret > 0) return 0;
+        if (ret == -1 && errno != EINTR) return -1;
+        if (ret == 0 && (ms == 0 || ipc_deadline_left(deadline) == 0)) {
+            return ipc_expired(deadline);
+        }
+    }
+}
+
+// Before an operation on a blocking fd under a deadline, wait for the fd
+// instead of letting the operation sleep. Non-blocking fds try first and
+// wait only after EAGAIN.
+static inline int ipc_wait_fd_before(int fd, short events, int nonblock, uint64_t deadline) {
+    if (nonblock || deadline == IPC_NO_DEADLINE) return 0;
+    return ipc_wait_fd(fd, events, deadline);
+}
+
+// After an operation on a non-blocking fd failed, wait for the fd if it was
+// EAGAIN and the deadline allows. Returns 0 to retry, or -1 with errno set.
+static inline int ipc_wait_fd_again(int fd, short events, uint64_t deadline) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+    if (deadline == IPC_NO_WAIT) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return ipc_wait_fd(fd, events, deadline);
+}
+
+// A stream send that has written part of a message waits for the rest only
+// until the caller's deadline, or IPC_FINISH_NS if it was not to wait at
+// all. If that runs out the reader is left mid-message, so the send fails
+// with ETIMEDOUT and the handle refuses further sends with EPIPE.
+#define IPC_FINISH_NS (100 * 1000000ull)
+
+static inline uint64_t ipc_finish_deadline(uint64_t deadline) {
+    return deadline == IPC_NO_WAIT ? stats_now_ns() + IPC_FINISH_NS : deadline;
+}
+
+// Set while ipc_trace_start is in effect
+extern atomic_int ipc_trace_on;
+
+static inline int trace_enabled(void) {
+    return atomic_load_explicit(&ipc_trace_on, memory_order_relaxed);
+}
+
+static inline uint64_t trace_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    return stats_now_ns();
+#endif
+}
+
+// Channel id of a handle: a hash of its name and mechanism
+uint64_t trace_channel(const IPC_Config *config);
+// Append an event to the calling thread's ring; *seq advances by count
+void trace_record(uint64_t channel, int op, uint64_t *seq, int ret, uint64_t count,
+                  uint64_t bytes, uint64_t ticks0);
+
+// Length-prefixed records on a byte stream: a native-endian uint32 length
+// followed by the payload. Used where a stream transport has to preserve
+// message boundaries: pipe batches and handles opened with IPC_FRAMED.
+// On Unix sockets a frame may instead carry its payload in a memfd passed
+// with SCM_RIGHTS: FRAME_FD_MARK, then the uint64 payload size.
+#define FRAME_HDR sizeof(uint32_t)
+#define FRAME_FD_MARK UINT32_MAX
+#define FRAME_FD_HDR (FRAME_HDR + sizeof(uint64_t))
+#define FRAME_BUF_MIN (64 * 1024)
+#define FRAME_MAX_FDS 32
+
+typedef struct {
+    unsigned char *buf;
+    size_t cap;
+    size_t start;  // First unconsumed byte
+    size_t end;    // One past the last byte read
+    // Descriptors received ahead of their frames, oldest first. Only
+    // collected when pass_fds is set; reads then go through recvmsg.
+    int pass_fds;
+    int fds[FRAME_MAX_FDS];
+    unsigned fd_head;
+    unsigned fd_count;
+} FrameBuffer;
+
+void frame_buffer_init(FrameBuffer *fb);
+void frame_buffer_free(FrameBuffer *fb);
+// Write every message as a frame, gathering them into as few writev calls as
+// possible; sock says fd is a socket. Returns the number of messages
+// written. A full fd is waited on until the deadline, or only before the
+// first frame under a finite one. A started frame that cannot be finished
+// by ipc_finish_deadline sets *broken and fails with ETIMEDOUT.
+int frame_send(int fd, int sock, const IPC_Msg *msgs, size_t count, uint64_t deadline,
+               int *broken);
+// Hand out frames already buffered, reading a large chunk from fd only when
+// no complete frame is left. Returns the number of messages received.
+int frame_recv(int fd, FrameBuffer *fb, IPC_Msg *msgs, size_t count);
+// Wait for the next frame without copying it. An in-buffer payload is
+// returned in *payload and stays valid until frame_consume(fb, *frame_size).
+// A memfd payload, checked to be sealed and at least *len bytes long, is
+// handed over in *memfd (otherwise -1) and its frame is consumed at once.
+int frame_peek(int fd, FrameBuffer *fb, void **payload, size_t *len,
+               int *memfd, size_t *frame_size);
+void frame_consume(FrameBuffer *fb, size_t frame_size);
+// Whether a whole frame is buffered, so the next receive needs no syscall
+int frame_ready(const FrameBuffer *fb);
+
+// Scratch space owned by a handle for building or unpacking messages. It is
+// sized at init and only grows, so steady-state traffic never allocates.
+typedef struct {
+    void *buf;
+    size_t cap;
+} StageBuffer;
+
+int stage_buffer_init(StageBuffer *sb, size_t cap);
+void stage_buffer_free(StageBuffer *sb);
+int stage_buffer_grow(StageBuffer *sb, size_t need);
+
+// Return a buffer of at least `need` bytes, or NULL with errno set
+static inline void *stage_buffer_get(StageBuffer *sb, size_t need) {
+    if (need <= sb->cap) return sb->buf;
+    return stage_buffer_grow(sb, need) == -1 ? NULL : sb->buf;
+}
+
+#endif
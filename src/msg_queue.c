@@ -1,24 +1,37 @@
-#include "ipc.h"
+#include "ipc_internal.h"
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
 
 #ifdef __linux__
 #include <mqueue.h>
 #include <sys/msg.h>
 
+// Longest sleep between polls of a SysV queue under a deadline
+#define SYSV_BACKOFF_MAX_US 1000
+// The Linux default of /proc/sys/fs/mqueue/msg_max
+#define MQ_POSIX_DEPTH 10
+
 typedef struct {
     mqd_t mq;
     char *mq_name;
+    unsigned prios;  // Priority levels accepted by send_prio
+    uint64_t wait;   // Deadline of the plain send/recv
 } MqPosixHandle;
 
+// Priority p travels as mtype prios - p, and receives ask for the lowest
+// mtype up to prios, which is the highest priority queued
 typedef struct {
     int msqid;
+    StageBuffer stage;  // mtype followed by the payload
+    long prios;
+    uint64_t wait;
 } MqSysvHandle;
 
-IPC_Handle init_mq_posix(const IPC_Config *config) {
+static IPC_Handle init_mq_posix(const IPC_Config *config) {
     struct mq_attr attr = {
-        .mq_maxmsg = 10,
+        .mq_maxmsg = config->depth ? config->depth : MQ_POSIX_DEPTH,
         .mq_msgsize = config->size
     };
     mqd_t mq = mq_open(config->name, O_CREAT | O_RDWR | O_EXCL, 0666, &attr);
@@ -38,6 +51,8 @@ IPC_Handle init_mq_posix(const IPC_Config *config) {
         return NULL;
     }
     h->mq = mq;
+    h->prios = config->priorities ? config->priorities : 1;
+    h->wait = ipc_default_deadline(config);
     h->mq_name = strdup(config->name);
     if (!h->mq_name) {
         free(h);
@@ -48,25 +63,102 @@ IPC_Handle init_mq_posix(const IPC_Config *config) {
     return (IPC_Handle)h;
 }
 
-int ipc_send_mq_posix(IPC_Handle handle, const void *data, size_t len) {
+// mq_timedsend/mq_timedreceive take an absolute CLOCK_REALTIME time. One
+// in the past, as for IPC_NO_WAIT, makes them return at once.
+static struct timespec mq_abstime(uint64_t deadline) {
+    struct timespec ts = {0, 0};
+    if (deadline == IPC_NO_WAIT) return ts;
+    uint64_t left = ipc_deadline_left(deadline);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += left / 1000000000u;
+    ts.tv_nsec += left % 1000000000u;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+static int posix_send(MqPosixHandle *h, const void *data, size_t len, unsigned prio,
+                      uint64_t deadline) {
+    ipc_stat_syscall();
+    if (deadline == IPC_NO_DEADLINE) return mq_send(h->mq, data, len, prio);
+    struct timespec ts = mq_abstime(deadline);
+    if (mq_timedsend(h->mq, data, len, prio, &ts) == 0) return 0;
+    return errno == ETIMEDOUT ? ipc_expired(deadline) : -1;
+}
+
+// The kernel already hands out the highest priority first
+static int posix_recv(MqPosixHandle *h, void *buf, size_t len, unsigned *prio, uint64_t deadline) {
+    ipc_stat_syscall();
+    if (deadline == IPC_NO_DEADLINE) return mq_receive(h->mq, buf, len, prio);
+    struct timespec ts = mq_abstime(deadline);
+    ssize_t ret = mq_timedreceive(h->mq, buf, len, prio, &ts);
+    if (ret == -1 && errno == ETIMEDOUT) return ipc_expired(deadline);
+    return (int)ret;
+}
+
+static int ipc_send_mq_posix(IPC_Handle handle, const void *data, size_t len) {
     MqPosixHandle *h = (MqPosixHandle *)handle;
-    if (!h || !data || len == 0) {
+    return posix_send(h, data, len, 0, h->wait);
+}
+
+static int ipc_recv_mq_posix(IPC_Handle handle, void *buf, size_t len) {
+    MqPosixHandle *h = (MqPosixHandle *)handle;
+    return posix_recv(h, buf, len, NULL, h->wait);
+}
+
+static int ipc_send_timed_mq_posix(IPC_Handle handle, const void *data, size_t len, int timeout_ms) {
+    return posix_send((MqPosixHandle *)handle, data, len, 0, ipc_deadline(timeout_ms));
+}
+
+static int ipc_recv_timed_mq_posix(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    return posix_recv((MqPosixHandle *)handle, buf, len, NULL, ipc_deadline(timeout_ms));
+}
+
+static int ipc_send_prio_mq_posix(IPC_Handle handle, const void *data, size_t len, unsigned prio) {
+    MqPosixHandle *h = (MqPosixHandle *)handle;
+    if (prio >= h->prios) {
         errno = EINVAL;
         return -1;
     }
-    return mq_send(h->mq, data, len, 0);
+    return posix_send(h, data, len, prio, h->wait);
 }
 
-int ipc_recv_mq_posix(IPC_Handle handle, void *buf, size_t len) {
+static int ipc_recv_prio_mq_posix(IPC_Handle handle, void *buf, size_t len, unsigned *prio) {
     MqPosixHandle *h = (MqPosixHandle *)handle;
-    if (!h || !buf || len == 0) {
-        errno = EINVAL;
-        return -1;
+    return posix_recv(h, buf, len, prio, h->wait);
+}
+
+static int ipc_send_batch_mq_posix(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    MqPosixHandle *h = (MqPosixHandle *)handle;
+    size_t sent;
+    for (sent = 0; sent < count; sent++) {
+        if (posix_send(h, msgs[sent].data, msgs[sent].len, 0, h->wait) == -1) break;
+    }
+    return sent ? (int)sent : -1;
+}
+
+// Waits for the first message, then drains what is already queued
+static int ipc_recv_batch_mq_posix(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    MqPosixHandle *h = (MqPosixHandle *)handle;
+    size_t got;
+    for (got = 0; got < count; got++) {
+        int ret = posix_recv(h, msgs[got].data, msgs[got].len, NULL,
+                             got == 0 ? h->wait : IPC_NO_WAIT);
+        if (ret == -1) break;
+        msgs[got].len = ret;
     }
-    return mq_receive(h->mq, buf, len, NULL);
+    return got ? (int)got : -1;
 }
 
-void close_mq_posix(IPC_Handle handle) {
+// On Linux a message queue descriptor is a pollable fd
+static int get_fd_mq_posix(IPC_Handle handle) {
+    MqPosixHandle *h = (MqPosixHandle *)handle;
+    return (int)h->mq;
+}
+
+static void close_mq_posix(IPC_Handle handle) {
     MqPosixHandle *h = (MqPosixHandle *)handle;
     if (!h) return;
     mq_close(h->mq);
@@ -80,7 +172,15 @@ typedef struct {
     char mtext[1];
 } SysvMsg;
 
-IPC_Handle init_mq_sysv(const IPC_Config *config) {
+// SysV limits a queue by bytes, so make room for depth messages of size
+static int sysv_set_depth(int msqid, uint32_t depth, uint32_t size) {
+    struct msqid_ds ds;
+    if (msgctl(msqid, IPC_STAT, &ds) == -1) return -1;
+    ds.msg_qbytes = (msglen_t)depth * size;
+    return msgctl(msqid, IPC_SET, &ds);
+}
+
+static IPC_Handle init_mq_sysv(const IPC_Config *config) {
     key_t key = ftok(config->name, 'a');
     if (key == -1) {
         return NULL;
@@ -96,61 +196,175 @@ IPC_Handle init_mq_sysv(const IPC_Config *config) {
         return NULL;
     }
     h->msqid = msqid;
+    h->prios = config->priorities ? config->priorities : 1;
+    h->wait = ipc_default_deadline(config);
+    if (stage_buffer_init(&h->stage, sizeof(SysvMsg) + config->size) == -1) {
+        msgctl(msqid, IPC_RMID, NULL);
+        free(h);
+        return NULL;
+    }
+    if (config->depth && sysv_set_depth(msqid, config->depth, config->size) == -1) {
+        int err = errno;
+        msgctl(msqid, IPC_RMID, NULL);
+        stage_buffer_free(&h->stage);
+        free(h);
+        errno = err;
+        return NULL;
+    }
     return (IPC_Handle)h;
 }
 
-int ipc_send_mq_sysv(IPC_Handle handle, const void *data, size_t len) {
-    MqSysvHandle *h = (MqSysvHandle *)handle;
-    if (!h || !data || len == 0) {
-        errno = EINVAL;
-        return -1;
+// SysV queues have no timed calls, so a finite deadline polls with
+// IPC_NOWAIT, sleeping a little longer each time up to SYSV_BACKOFF_MAX_US.
+// Returns 0 to try again or -1 once the deadline has passed.
+static int sysv_backoff(uint64_t deadline, useconds_t *delay_us) {
+    uint64_t left = ipc_deadline_left(deadline);
+    if (left == 0) return ipc_expired(deadline);
+    useconds_t us = *delay_us;
+    if ((uint64_t)us * 1000u > left) us = (useconds_t)((left + 999) / 1000);
+    uint64_t t0 = ipc_stat_block_begin();
+    usleep(us);
+    ipc_stat_block_end(t0);
+    if (*delay_us < SYSV_BACKOFF_MAX_US) *delay_us *= 2;
+    return 0;
+}
+
+static int sysv_send(MqSysvHandle *h, const void *data, size_t len, unsigned prio,
+                     uint64_t deadline) {
+    SysvMsg *msg = stage_buffer_get(&h->stage, sizeof(SysvMsg) + len);
+    if (!msg) return -1;
+    msg->mtype = h->prios - (long)prio;
+    memcpy(msg->mtext, data, len);
+    int flags = deadline == IPC_NO_DEADLINE ? 0 : IPC_NOWAIT;
+    useconds_t delay_us = 10;
+    for (;;) {
+        ipc_stat_syscall();
+        if (msgsnd(h->msqid, msg, len, flags) == 0) return 0;
+        if (errno != EAGAIN || deadline == IPC_NO_DEADLINE) return -1;
+        if (deadline == IPC_NO_WAIT) return ipc_expired(deadline);
+        if (sysv_backoff(deadline, &delay_us) == -1) return -1;
     }
-    SysvMsg *msg = malloc(sizeof(SysvMsg) + len);
-    if (!msg) {
-        errno = ENOMEM;
-        return -1;
+}
+
+static int sysv_recv(MqSysvHandle *h, void *buf, size_t len, unsigned *prio, uint64_t deadline) {
+    SysvMsg *msg = stage_buffer_get(&h->stage, sizeof(SysvMsg) + len);
+    if (!msg) return -1;
+    int flags = deadline == IPC_NO_DEADLINE ? 0 : IPC_NOWAIT;
+    useconds_t delay_us = 10;
+    for (;;) {
+        ipc_stat_syscall();
+        int ret = msgrcv(h->msqid, msg, len, -h->prios, flags);
+        if (ret != -1) {
+            memcpy(buf, msg->mtext, ret);
+            if (prio) *prio = (unsigned)(h->prios - msg->mtype);
+            return ret;
+        }
+        if (errno != ENOMSG) return -1;
+        if (deadline == IPC_NO_WAIT) return ipc_expired(deadline);
+        if (sysv_backoff(deadline, &delay_us) == -1) return -1;
     }
-    msg->mtype = 1;
-    memcpy(msg->mtext, data, len);
-    int ret = msgsnd(h->msqid, msg, len, 0);
-    free(msg);
-    return ret;
 }
 
-int ipc_recv_mq_sysv(IPC_Handle handle, void *buf, size_t len) {
+static int ipc_send_mq_sysv(IPC_Handle handle, const void *data, size_t len) {
     MqSysvHandle *h = (MqSysvHandle *)handle;
-    if (!h || !buf || len == 0) {
+    return sysv_send(h, data, len, 0, h->wait);
+}
+
+static int ipc_recv_mq_sysv(IPC_Handle handle, void *buf, size_t len) {
+    MqSysvHandle *h = (MqSysvHandle *)handle;
+    return sysv_recv(h, buf, len, NULL, h->wait);
+}
+
+static int ipc_send_timed_mq_sysv(IPC_Handle handle, const void *data, size_t len, int timeout_ms) {
+    return sysv_send((MqSysvHandle *)handle, data, len, 0, ipc_deadline(timeout_ms));
+}
+
+static int ipc_recv_timed_mq_sysv(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    return sysv_recv((MqSysvHandle *)handle, buf, len, NULL, ipc_deadline(timeout_ms));
+}
+
+static int ipc_send_prio_mq_sysv(IPC_Handle handle, const void *data, size_t len, unsigned prio) {
+    MqSysvHandle *h = (MqSysvHandle *)handle;
+    if (prio >= (unsigned long)h->prios) {
         errno = EINVAL;
         return -1;
     }
-    SysvMsg *msg = malloc(sizeof(SysvMsg) + len);
-    if (!msg) {
-        errno = ENOMEM;
-        return -1;
+    return sysv_send(h, data, len, prio, h->wait);
+}
+
+static int ipc_recv_prio_mq_sysv(IPC_Handle handle, void *buf, size_t len, unsigned *prio) {
+    MqSysvHandle *h = (MqSysvHandle *)handle;
+    return sysv_recv(h, buf, len, prio, h->wait);
+}
+
+static int ipc_send_batch_mq_sysv(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    MqSysvHandle *h = (MqSysvHandle *)handle;
+    size_t sent;
+    for (sent = 0; sent < count; sent++) {
+        if (sysv_send(h, msgs[sent].data, msgs[sent].len, 0, h->wait) == -1) break;
     }
-    int ret = msgrcv(h->msqid, msg, len, 0, 0);
-    if (ret != -1) {
-        memcpy(buf, msg->mtext, ret);
+    return sent ? (int)sent : -1;
+}
+
+// Waits for the first message, then drains what is already queued
+static int ipc_recv_batch_mq_sysv(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    MqSysvHandle *h = (MqSysvHandle *)handle;
+    size_t got;
+    for (got = 0; got < count; got++) {
+        int ret = sysv_recv(h, msgs[got].data, msgs[got].len, NULL,
+                            got == 0 ? h->wait : IPC_NO_WAIT);
+        if (ret == -1) break;
+        msgs[got].len = ret;
     }
-    free(msg);
-    return ret;
+    return got ? (int)got : -1;
 }
 
-void close_mq_sysv(IPC_Handle handle) {
+static void close_mq_sysv(IPC_Handle handle) {
     MqSysvHandle *h = (MqSysvHandle *)handle;
     if (!h) return;
     msgctl(h->msqid, IPC_RMID, NULL);
+    stage_buffer_free(&h->stage);
     free(h);
 }
 
+const IPC_TransportOps ipc_mq_posix_ops = {
+    .init = init_mq_posix,
+    .send = ipc_send_mq_posix,
+    .recv = ipc_recv_mq_posix,
+    .close = close_mq_posix,
+    .send_batch = ipc_send_batch_mq_posix,
+    .recv_batch = ipc_recv_batch_mq_posix,
+    .get_fd = get_fd_mq_posix,
+    .send_timed = ipc_send_timed_mq_posix,
+    .recv_timed = ipc_recv_timed_mq_posix,
+    .send_prio = ipc_send_prio_mq_posix,
+    .recv_prio = ipc_recv_prio_mq_posix,
+};
+
+const IPC_TransportOps ipc_mq_sysv_ops = {
+    .init = init_mq_sysv,
+    .send = ipc_send_mq_sysv,
+    .recv = ipc_recv_mq_sysv,
+    .close = close_mq_sysv,
+    .send_batch = ipc_send_batch_mq_sysv,
+    .recv_batch = ipc_recv_batch_mq_sysv,
+    .send_timed = ipc_send_timed_mq_sysv,
+    .recv_timed = ipc_recv_timed_mq_sysv,
+    .send_prio = ipc_send_prio_mq_sysv,
+    .recv_prio = ipc_recv_prio_mq_sysv,
+};
+
 #else // macOS or other non-Linux
-IPC_Handle init_mq_posix(const IPC_Config *config) { errno = ENOTSUP; return NULL; }
-int ipc_send_mq_posix(IPC_Handle handle, const void *data, size_t len) { errno = ENOTSUP; return -1; }
-int ipc_recv_mq_posix(IPC_Handle handle, void *buf, size_t len) { errno = ENOTSUP; return -1; }
-void close_mq_posix(IPC_Handle handle) {}
-
-IPC_Handle init_mq_sysv(const IPC_Config *config) { errno = ENOTSUP; return NULL; }
-int ipc_send_mq_sysv(IPC_Handle handle, const void *data, size_t len) { errno = ENOTSUP; return -1; }
-int ipc_recv_mq_sysv(IPC_Handle handle, void *buf, size_t len) { errno = ENOTSUP; return -1; }
-void close_mq_sysv(IPC_Handle handle) {}
+static IPC_Handle init_mq_unsupported(const IPC_Config *config) { errno = ENOTSUP; return NULL; }
+static void close_mq_unsupported(IPC_Handle handle) {}
+
+const IPC_TransportOps ipc_mq_posix_ops = {
+    .init = init_mq_unsupported,
+    .close = close_mq_unsupported,
+};
+
+const IPC_TransportOps ipc_mq_sysv_ops = {
+    .init = init_mq_unsupported,
+    .close = close_mq_unsupported,
+};
 #endif
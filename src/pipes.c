@@ -1,18 +1,64 @@
-#include "ipc.h"
+#define _GNU_SOURCE  // vmsplice, splice, F_SETPIPE_SZ
+#include "ipc_internal.h"
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
 
 typedef struct {
     int read_fd;
     int write_fd;
     char *fifo_name;  // NULL for unnamed
+    int framed;       // IPC_FRAMED
+    int gift;         // IPC_PIPE_GIFT
+    int nonblock;     // Both fds have O_NONBLOCK; always set for FIFOs
+    uint64_t wait;    // Deadline of the plain calls
+    int broken;       // A frame was left half-written; sends fail with EPIPE
+    FrameBuffer rx;   // Frames read ahead by framed and batch receives
 } PipeHandle;
 
-IPC_Handle init_pipe_named(const IPC_Config *config) {
+// Apply the per-handle config shared by named and unnamed pipes
+static int pipe_configure(PipeHandle *h, const IPC_Config *config) {
+    h->framed = (config->flags & IPC_FRAMED) != 0;
+    h->gift = (config->flags & IPC_PIPE_GIFT) != 0;
+    h->wait = ipc_default_deadline(config);
+    h->broken = 0;
+    if (!h->nonblock && (config->flags & IPC_NONBLOCK)) {
+        if (fcntl(h->read_fd, F_SETFL, fcntl(h->read_fd, F_GETFL) | O_NONBLOCK) == -1 ||
+            fcntl(h->write_fd, F_SETFL, fcntl(h->write_fd, F_GETFL) | O_NONBLOCK) == -1) {
+            return -1;
+        }
+        h->nonblock = 1;
+    }
+#ifndef __linux__
+    if (h->gift || config->pipe_size) {
+        errno = ENOTSUP;
+        return -1;
+    }
+#else
+    // Frame headers are built on the stack, which cannot be handed over
+    if (h->gift && h->framed) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Raises the capacity for both ends; unprivileged callers are capped by
+    // /proc/sys/fs/pipe-max-size
+    if (config->pipe_size && fcntl(h->write_fd, F_SETPIPE_SZ, (int)config->pipe_size) == -1) {
+        return -1;
+    }
+#endif
+    frame_buffer_init(&h->rx);
+    return 0;
+}
+
+static IPC_Handle init_pipe_named(const IPC_Config *config) {
     if (mkfifo(config->name, 0600) == -1 && errno != EEXIST) {
         return NULL;
     }
@@ -20,46 +66,185 @@ IPC_Handle init_pipe_named(const IPC_Config *config) {
     PipeHandle *h = malloc(sizeof(PipeHandle));
     if (!h) return NULL;
 
+    // Open the read end first: a non-blocking open for writing fails with
+    // ENXIO while the FIFO has no reader. The fds stay non-blocking and
+    // waits go through poll.
+    h->nonblock = 1;
+    h->read_fd = open(config->name, O_RDONLY | O_NONBLOCK);
+    if (h->read_fd == -1) {
+        free(h);
+        return NULL;
+    }
     h->write_fd = open(config->name, O_WRONLY | O_NONBLOCK);
     if (h->write_fd == -1) {
+        close(h->read_fd);
         free(h);
         return NULL;
     }
-    h->read_fd = open(config->name, O_RDONLY | O_NONBLOCK);
-    if (h->read_fd == -1) {
+    h->fifo_name = strdup(config->name);
+    if (!h->fifo_name) {
+        close(h->read_fd);
         close(h->write_fd);
         free(h);
         return NULL;
     }
-    h->fifo_name = strdup(config->name);
-    if (!h->fifo_name) {
+    if (pipe_configure(h, config) == -1) {
+        int err = errno;
         close(h->read_fd);
         close(h->write_fd);
+        free(h->fifo_name);
         free(h);
+        errno = err;
         return NULL;
     }
     return (IPC_Handle)h;
 }
 
-int ipc_send_pipe_named(IPC_Handle handle, const void *data, size_t len) {
+// One write or vmsplice, without waiting on a non-blocking fd
+static ssize_t pipe_write(PipeHandle *h, const void *data, size_t len) {
+#ifdef __linux__
+    if (h->gift) {
+        // The pipe references the caller's pages instead of copying them.
+        // Gifting additionally lets a splicing reader move whole pages.
+        long page = sysconf(_SC_PAGESIZE);
+        unsigned int flags = 0;
+        if (((uintptr_t)data & (page - 1)) == 0 && (len & (page - 1)) == 0) {
+            flags |= SPLICE_F_GIFT;
+        }
+        // vmsplice ignores O_NONBLOCK on the fd and would sleep on a full pipe
+        if (h->nonblock) flags |= SPLICE_F_NONBLOCK;
+        struct iovec iov = { (void *)data, len > INT_MAX ? INT_MAX : len };
+        ipc_stat_syscall();
+        return vmsplice(h->write_fd, &iov, 1, flags);
+    }
+#endif
+    ipc_stat_syscall();
+    return write(h->write_fd, data, len);
+}
+
+static int pipe_frame_send(PipeHandle *h, const IPC_Msg *msgs, size_t count, uint64_t deadline) {
+    if (h->broken) {
+        errno = EPIPE;
+        return -1;
+    }
+    if (ipc_wait_fd_before(h->write_fd, POLLOUT, h->nonblock, deadline) == -1) return -1;
+    return frame_send(h->write_fd, 0, msgs, count, deadline, &h->broken);
+}
+
+// Buffered frames are handed out without waiting on the fd
+static int pipe_frame_recv(PipeHandle *h, IPC_Msg *msgs, size_t count, uint64_t deadline) {
+    for (;;) {
+        if (!frame_ready(&h->rx) &&
+            ipc_wait_fd_before(h->read_fd, POLLIN, h->nonblock, deadline) == -1) {
+            return -1;
+        }
+        int ret = frame_recv(h->read_fd, &h->rx, msgs, count);
+        if (ret != -1) return ret;
+        if (ipc_wait_fd_again(h->read_fd, POLLIN, deadline) == -1) return -1;
+    }
+}
+
+static int pipe_send(PipeHandle *h, const void *data, size_t len, uint64_t deadline) {
+    if (h->framed) {
+        IPC_Msg msg = { (void *)data, len };
+        return pipe_frame_send(h, &msg, 1, deadline) == 1 ? (int)len : -1;
+    }
+    for (;;) {
+        if (ipc_wait_fd_before(h->write_fd, POLLOUT, h->nonblock, deadline) == -1) return -1;
+        ssize_t n = pipe_write(h, data, len);
+        if (n != -1) return (int)n;
+        if (ipc_wait_fd_again(h->write_fd, POLLOUT, deadline) == -1) return -1;
+    }
+}
+
+static int pipe_recv(PipeHandle *h, void *buf, size_t len, uint64_t deadline) {
+    if (h->framed) {
+        IPC_Msg msg = { buf, len };
+        int ret = pipe_frame_recv(h, &msg, 1, deadline);
+        return ret == 1 ? (int)msg.len : ret;
+    }
+    for (;;) {
+        if (ipc_wait_fd_before(h->read_fd, POLLIN, h->nonblock, deadline) == -1) return -1;
+        ipc_stat_syscall();
+        ssize_t n = read(h->read_fd, buf, len);
+        if (n != -1) return (int)n;
+        if (ipc_wait_fd_again(h->read_fd, POLLIN, deadline) == -1) return -1;
+    }
+}
+
+static int ipc_send_pipe_named(IPC_Handle handle, const void *data, size_t len) {
     PipeHandle *h = (PipeHandle *)handle;
-    if (!h || !data || len == 0) {
-        errno = EINVAL;
+    return pipe_send(h, data, len, h->wait);
+}
+
+static int ipc_recv_pipe_named(IPC_Handle handle, void *buf, size_t len) {
+    PipeHandle *h = (PipeHandle *)handle;
+    return pipe_recv(h, buf, len, h->wait);
+}
+
+static int ipc_send_timed_pipe(IPC_Handle handle, const void *data, size_t len, int timeout_ms) {
+    return pipe_send((PipeHandle *)handle, data, len, ipc_deadline(timeout_ms));
+}
+
+static int ipc_recv_timed_pipe(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    return pipe_recv((PipeHandle *)handle, buf, len, ipc_deadline(timeout_ms));
+}
+
+// Batches travel as length-prefixed frames so the receiver can split them
+static int ipc_send_batch_pipe_named(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    PipeHandle *h = (PipeHandle *)handle;
+    return pipe_frame_send(h, msgs, count, h->wait);
+}
+
+static int ipc_recv_batch_pipe_named(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    PipeHandle *h = (PipeHandle *)handle;
+    return pipe_frame_recv(h, msgs, count, h->wait);
+}
+
+static int get_fd_pipe(IPC_Handle handle) {
+    PipeHandle *h = (PipeHandle *)handle;
+    return h->read_fd;
+}
+
+// Async writes would interleave with frames, so framed pipes opt out
+static int io_fd_pipe(IPC_Handle handle, int write, int *nonblock) {
+    PipeHandle *h = (PipeHandle *)handle;
+    if (h->framed) {
+        errno = ENOTSUP;
         return -1;
     }
-    return write(h->write_fd, data, len);
+    *nonblock = h->nonblock;
+    return write ? h->write_fd : h->read_fd;
 }
 
-int ipc_recv_pipe_named(IPC_Handle handle, void *buf, size_t len) {
+#ifdef __linux__
+// Bytes go from the pipe to fd inside the kernel. Frames would lose their
+// boundaries, so framed pipes opt out.
+static int recv_splice_pipe(IPC_Handle handle, int fd, size_t len) {
     PipeHandle *h = (PipeHandle *)handle;
-    if (!h || !buf || len == 0) {
-        errno = EINVAL;
+    if (h->framed) {
+        errno = ENOTSUP;
         return -1;
     }
-    return read(h->read_fd, buf, len);
+    unsigned int flags = SPLICE_F_MOVE;
+    if (h->nonblock) flags |= SPLICE_F_NONBLOCK;
+    // A FIFO waits for data first, so EAGAIN from splice can only mean a
+    // full non-blocking fd, which is the caller's to wait on
+    if (h->nonblock && h->wait != IPC_NO_WAIT && ipc_wait_fd(h->read_fd, POLLIN, h->wait) == -1) {
+        return -1;
+    }
+    ipc_stat_syscall();
+    return splice(h->read_fd, NULL, fd, NULL, len > INT_MAX ? INT_MAX : len, flags);
+}
+#endif
+
+// Frames left over from a batch receive are ready without touching the fd
+static int poll_arm_pipe(IPC_Handle handle) {
+    PipeHandle *h = (PipeHandle *)handle;
+    return frame_ready(&h->rx);
 }
 
-void close_pipe_named(IPC_Handle handle) {
+static void close_pipe_named(IPC_Handle handle) {
     PipeHandle *h = (PipeHandle *)handle;
     if (!h) return;
     close(h->read_fd);
@@ -68,10 +253,11 @@ void close_pipe_named(IPC_Handle handle) {
         unlink(h->fifo_name);
         free(h->fifo_name);
     }
+    frame_buffer_free(&h->rx);
     free(h);
 }
 
-IPC_Handle init_pipe_unnamed(const IPC_Config *config) {
+static IPC_Handle init_pipe_unnamed(const IPC_Config *config) {
     int pipefds[2];
     if (pipe(pipefds) == -1) {
         return NULL;
@@ -86,17 +272,49 @@ IPC_Handle init_pipe_unnamed(const IPC_Config *config) {
     h->read_fd = pipefds[0];
     h->write_fd = pipefds[1];
     h->fifo_name = NULL;
+    h->nonblock = 0;
+    if (pipe_configure(h, config) == -1) {
+        int err = errno;
+        close(h->read_fd);
+        close(h->write_fd);
+        free(h);
+        errno = err;
+        return NULL;
+    }
     return (IPC_Handle)h;
 }
 
-int ipc_send_pipe_unnamed(IPC_Handle handle, const void *data, size_t len) {
-    return ipc_send_pipe_named(handle, data, len);
-}
-
-int ipc_recv_pipe_unnamed(IPC_Handle handle, void *buf, size_t len) {
-    return ipc_recv_pipe_named(handle, buf, len);
-}
+const IPC_TransportOps ipc_pipe_named_ops = {
+    .init = init_pipe_named,
+    .send = ipc_send_pipe_named,
+    .recv = ipc_recv_pipe_named,
+    .close = close_pipe_named,
+    .send_batch = ipc_send_batch_pipe_named,
+    .recv_batch = ipc_recv_batch_pipe_named,
+    .get_fd = get_fd_pipe,
+    .poll_arm = poll_arm_pipe,
+    .io_fd = io_fd_pipe,
+#ifdef __linux__
+    .recv_splice = recv_splice_pipe,
+#endif
+    .send_timed = ipc_send_timed_pipe,
+    .recv_timed = ipc_recv_timed_pipe,
+};
 
-void close_pipe_unnamed(IPC_Handle handle) {
-    close_pipe_named(handle);
-}
+// Unnamed pipes only differ in how they are created
+const IPC_TransportOps ipc_pipe_unnamed_ops = {
+    .init = init_pipe_unnamed,
+    .send = ipc_send_pipe_named,
+    .recv = ipc_recv_pipe_named,
+    .close = close_pipe_named,
+    .send_batch = ipc_send_batch_pipe_named,
+    .recv_batch = ipc_recv_batch_pipe_named,
+    .get_fd = get_fd_pipe,
+    .poll_arm = poll_arm_pipe,
+    .io_fd = io_fd_pipe,
+#ifdef __linux__
+    .recv_splice = recv_splice_pipe,
+#endif
+    .send_timed = ipc_send_timed_pipe,
+    .recv_timed = ipc_recv_timed_pipe,
+};
@@ -0,0 +1,254 @@
+#include "ipc_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+// Request/reply on top of message-preserving handles. Every message starts
+// with an RpcHeader; the caller's id comes back in the reply, so any number
+// of calls can be outstanding and replies may arrive in any order.
+// Outstanding calls live in a power-of-two table indexed by id, which keeps
+// lookups constant-time without allocating per call.
+
+#define RPC_REQUEST 1u
+#define RPC_REPLY 2u
+
+// How long a reply may wait for room before it is dropped
+#define RPC_REPLY_MS 1000
+
+typedef struct {
+    uint64_t id;
+    uint32_t kind;
+    int32_t status;  // Replies: 0 or the errno the handler failed with
+} RpcHeader;
+
+typedef struct {
+    uint64_t id;  // 0 while the slot is free
+    IPC_RpcCallback cb;
+    void *ctx;
+} RpcPending;
+
+struct IPC_Rpc {
+    IPC_Handle tx;
+    IPC_Handle rx;
+    size_t max_msg;
+    unsigned char *tx_buf;  // Header plus max_msg payload bytes
+    unsigned char *rx_buf;
+    RpcPending *pending;
+    uint64_t mask;
+    uint64_t next_id;
+    unsigned inflight;
+    int multi;  // rx is a multi-client server; reply with ipc_send_to
+    // Serving side, set for the duration of ipc_rpc_serve
+    IPC_RpcHandler handler;
+    void *handler_ctx;
+};
+
+IPC_Rpc *ipc_rpc_create(IPC_Handle tx, IPC_Handle rx, size_t max_msg, unsigned max_inflight) {
+    if (!tx || !rx || max_msg == 0 || max_inflight == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    IPC_Rpc *rpc = calloc(1, sizeof(IPC_Rpc));
+    if (!rpc) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t slots = 1;
+    while (slots < max_inflight) slots <<= 1;
+    rpc->tx = tx;
+    rpc->rx = rx;
+    rpc->max_msg = max_msg;
+    rpc->mask = slots - 1;
+    rpc->next_id = 1;
+    rpc->tx_buf = malloc(sizeof(RpcHeader) + max_msg);
+    rpc->rx_buf = malloc(sizeof(RpcHeader) + max_msg);
+    rpc->pending = calloc(slots, sizeof(RpcPending));
+    if (!rpc->tx_buf || !rpc->rx_buf || !rpc->pending) {
+        ipc_rpc_destroy(rpc);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return rpc;
+}
+
+// Calls still outstanding complete with ECANCELED
+void ipc_rpc_destroy(IPC_Rpc *rpc) {
+    if (!rpc) return;
+    if (rpc->pending) {
+        for (uint64_t i = 0; i <= rpc->mask; i++) {
+            RpcPending *p = &rpc->pending[i];
+            if (p->id) p->cb(p->ctx, ECANCELED, NULL, 0);
+        }
+    }
+    free(rpc->pending);
+    free(rpc->tx_buf);
+    free(rpc->rx_buf);
+    free(rpc);
+}
+
+static int rpc_send(IPC_Rpc *rpc, int to_conn, uint32_t conn, uint64_t id, uint32_t kind,
+                    int32_t status, size_t len) {
+    RpcHeader hdr = { id, kind, status };
+    memcpy(rpc->tx_buf, &hdr, sizeof(hdr));
+    size_t total = sizeof(hdr) + len;
+    // A full channel fails a call at once so the caller can drain replies
+    if (kind != RPC_REPLY) return ipc_send(rpc->tx, rpc->tx_buf, total) == -1 ? -1 : 0;
+
+    // A reply waits for room, since dropping it strands the call, but only
+    // up to RPC_REPLY_MS so a client that stopped reading cannot hang the
+    // server. Ring and queue sends never wait, hence the retry on EAGAIN.
+    uint64_t deadline = ipc_deadline(RPC_REPLY_MS);
+    for (;;) {
+        int ret;
+        if (to_conn) {
+            ret = ipc_send_to(rpc->rx, conn, rpc->tx_buf, total);
+        } else {
+            uint64_t left = ipc_deadline_left(deadline);
+            ret = ipc_send_timed(rpc->tx, rpc->tx_buf, total, (int)((left + 999999) / 1000000));
+        }
+        if (ret != -1) return 0;
+        if (errno != EAGAIN) return -1;
+        if (ipc_deadline_left(deadline) == 0) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        sched_yield();
+    }
+}
+
+int ipc_call_async(IPC_Rpc *rpc, const void *req, size_t len, IPC_RpcCallback cb, void *ctx) {
+    if (!rpc || (!req && len) || !cb) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > rpc->max_msg) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint64_t id = rpc->next_id;
+    RpcPending *p = &rpc->pending[id & rpc->mask];
+    // A slow call still holds the slot this id maps to
+    if (p->id) {
+        errno = EAGAIN;
+        return -1;
+    }
+    if (len) memcpy(rpc->tx_buf + sizeof(RpcHeader), req, len);
+    if (rpc_send(rpc, 0, 0, id, RPC_REQUEST, 0, len) == -1) return -1;
+    rpc->next_id++;
+    p->id = id;
+    p->cb = cb;
+    p->ctx = ctx;
+    rpc->inflight++;
+    return 0;
+}
+
+unsigned ipc_rpc_inflight(IPC_Rpc *rpc) {
+    return rpc ? rpc->inflight : 0;
+}
+
+// Receive one message into rx_buf, from any peer on multi-client servers.
+// Returns its length, or -1 when nothing usable arrived.
+static int rpc_recv(IPC_Rpc *rpc, uint32_t *conn) {
+    size_t cap = sizeof(RpcHeader) + rpc->max_msg;
+    int n;
+    if (rpc->multi) {
+        n = ipc_recv_from(rpc->rx, conn, rpc->rx_buf, cap);
+    } else {
+        n = ipc_recv(rpc->rx, rpc->rx_buf, cap);
+        if (n == -1 && errno == EDESTADDRREQ) {
+            rpc->multi = 1;
+            n = ipc_recv_from(rpc->rx, conn, rpc->rx_buf, cap);
+        }
+    }
+    // A multi-client peer hanging up reads as 0
+    if (n >= 0 && (size_t)n < sizeof(RpcHeader)) {
+        errno = EPROTO;
+        return -1;
+    }
+    return n;
+}
+
+// Wait up to timeout_ms for rx, then drain what is ready. `one` handles a
+// received message and returns 1, 0 if it dropped the message, or -1 to
+// stop with errno set.
+static int rpc_pump(IPC_Rpc *rpc, int timeout_ms, int (*one)(IPC_Rpc *, uint32_t, size_t)) {
+    int done = 0;
+    int ready;
+    for (;;) {
+        int r = ipc_poll(&rpc->rx, 1, done ? 0 : timeout_ms, &ready);
+        if (r == -1) return done ? done : -1;
+        if (r == 0) return done;
+        uint32_t conn = 0;
+        int n = rpc_recv(rpc, &conn);
+        if (n == -1) {
+            // An oversized request costs a multi-client peer its connection
+            // and nobody else anything
+            if (errno == EPROTO || errno == EAGAIN || (rpc->multi && errno == EMSGSIZE)) continue;
+            return done ? done : -1;
+        }
+        int ret = one(rpc, conn, (size_t)n);
+        if (ret == -1) return -1;
+        done += ret;
+    }
+}
+
+static int rpc_on_reply(IPC_Rpc *rpc, uint32_t conn, size_t n) {
+    (void)conn;
+    RpcHeader hdr;
+    memcpy(&hdr, rpc->rx_buf, sizeof(hdr));
+    RpcPending *p = &rpc->pending[hdr.id & rpc->mask];
+    // Unknown or already completed ids are dropped
+    if (hdr.kind != RPC_REPLY || hdr.id == 0 || p->id != hdr.id) return 0;
+    IPC_RpcCallback cb = p->cb;
+    void *ctx = p->ctx;
+    p->id = 0;
+    rpc->inflight--;
+    cb(ctx, hdr.status, rpc->rx_buf + sizeof(hdr), n - sizeof(hdr));
+    return 1;
+}
+
+int ipc_rpc_wait(IPC_Rpc *rpc, int timeout_ms) {
+    if (!rpc) {
+        errno = EINVAL;
+        return -1;
+    }
+    return rpc_pump(rpc, timeout_ms, rpc_on_reply);
+}
+
+static int rpc_on_request(IPC_Rpc *rpc, uint32_t conn, size_t n) {
+    RpcHeader hdr;
+    memcpy(&hdr, rpc->rx_buf, sizeof(hdr));
+    if (hdr.kind != RPC_REQUEST) return 0;
+    errno = 0;
+    int len = rpc->handler(rpc->handler_ctx, rpc->rx_buf + sizeof(hdr), n - sizeof(hdr),
+                          rpc->tx_buf + sizeof(hdr), rpc->max_msg);
+    int32_t status = 0;
+    if (len < 0) {
+        status = errno ? errno : EIO;
+        len = 0;
+    } else if ((size_t)len > rpc->max_msg) {
+        status = EMSGSIZE;
+        len = 0;
+    }
+    if (rpc_send(rpc, rpc->multi, conn, hdr.id, RPC_REPLY, status, (size_t)len) == -1) {
+        // A multi-client peer that hung up or was cut off takes its calls
+        // with it; any other failure stops the server
+        if (rpc->multi && (errno == ENOTCONN || errno == EPIPE || errno == ECONNRESET)) return 0;
+        return -1;
+    }
+    return 1;
+}
+
+int ipc_rpc_serve(IPC_Rpc *rpc, IPC_RpcHandler handler, void *ctx, int timeout_ms) {
+    if (!rpc || !handler) {
+        errno = EINVAL;
+        return -1;
+    }
+    rpc->handler = handler;
+    rpc->handler_ctx = ctx;
+    int ret = rpc_pump(rpc, timeout_ms, rpc_on_request);
+    rpc->handler = NULL;
+    rpc->handler_ctx = NULL;
+    return ret;
+}
@@ -0,0 +1,212 @@
+#include "ipc_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+
+// Latest-value channel for one writer and any number of readers, guarded by
+// a sequence lock. The writer makes seq odd, overwrites the value and makes
+// seq even again; it never waits for readers. A reader copies the value
+// between two loads of seq and retries if they differ or the first was odd,
+// so readers never write to shared memory and cannot slow the writer down.
+
+typedef struct {
+    // Odd while a write is in progress; 0 until the first publish
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t seq;
+    atomic_uint_fast64_t len;
+    // Where readers waiting in ipc_poll for a newer value park
+    ShmWaitQueue wq;
+    // Written once by the creator
+    _Alignas(IPC_CACHELINE) uint64_t capacity;
+} BroadcastHeader;
+
+typedef struct {
+    ShmSegment seg;
+    ShmDoorbell bell;
+    BroadcastHeader *hdr;
+    unsigned char *data;
+    uint64_t last_seq;  // Version this handle last read
+    unsigned char *send_loan;
+    uint32_t spins;
+} BroadcastHandle;
+
+static void broadcast_init(void *mem, size_t size, void *arg) {
+    (void)arg;
+    BroadcastHeader *hdr = (BroadcastHeader *)mem;
+    atomic_init(&hdr->seq, 0);
+    atomic_init(&hdr->len, 0);
+    shm_wait_init(&hdr->wq);
+    hdr->capacity = size - sizeof(BroadcastHeader);
+}
+
+static IPC_Handle init_shm_broadcast(const IPC_Config *config) {
+    BroadcastHandle *h = malloc(sizeof(BroadcastHandle));
+    if (!h) return NULL;
+
+    size_t size = sizeof(BroadcastHeader) + config->size;
+    if (shm_segment_open(&h->seg, config, size, broadcast_init, NULL) == -1) {
+        free(h);
+        return NULL;
+    }
+    h->hdr = (BroadcastHeader *)h->seg.mem;
+    if (sizeof(BroadcastHeader) + h->hdr->capacity != h->seg.size) {
+        shm_segment_close(&h->seg);
+        free(h);
+        errno = EPROTO;
+        return NULL;
+    }
+    if (shm_doorbell_init(&h->bell, &h->seg) == -1) {
+        shm_segment_close(&h->seg);
+        free(h);
+        return NULL;
+    }
+    h->data = (unsigned char *)(h->hdr + 1);
+    h->last_seq = 0;
+    h->send_loan = NULL;
+    h->spins = config->spin_count ? config->spin_count : SHM_SPIN_DEFAULT;
+    return (IPC_Handle)h;
+}
+
+// Open a write section. The release fence keeps the payload stores that
+// follow from becoming visible before the odd sequence number.
+static uint64_t broadcast_write_begin(BroadcastHandle *h) {
+    uint64_t seq = atomic_load_explicit(&h->hdr->seq, memory_order_relaxed);
+    atomic_store_explicit(&h->hdr->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return seq + 1;
+}
+
+static void broadcast_write_end(BroadcastHandle *h, uint64_t seq, size_t len) {
+    atomic_store_explicit(&h->hdr->len, len, memory_order_relaxed);
+    atomic_store_explicit(&h->hdr->seq, seq + 1, memory_order_release);
+    shm_wait_wake(&h->hdr->wq, &h->bell, INT_MAX);
+}
+
+static int ipc_send_shm_broadcast(IPC_Handle handle, const void *data, size_t len) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    if (h->send_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (len > h->hdr->capacity) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint64_t seq = broadcast_write_begin(h);
+    memcpy(h->data, data, len);
+    broadcast_write_end(h, seq, len);
+    return 0;
+}
+
+// Copy a consistent snapshot. A writer that is descheduled mid-write keeps
+// seq odd, so after spinning for a while the reader yields to let it finish.
+static int ipc_recv_shm_broadcast(IPC_Handle handle, void *buf, size_t len) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    uint32_t spins = 0;
+    for (;;) {
+        uint64_t seq = atomic_load_explicit(&h->hdr->seq, memory_order_acquire);
+        if (seq == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (!(seq & 1)) {
+            uint64_t msg_len = atomic_load_explicit(&h->hdr->len, memory_order_relaxed);
+            if (msg_len <= h->hdr->capacity) {
+                memcpy(buf, h->data, msg_len < len ? msg_len : len);
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&h->hdr->seq, memory_order_relaxed) == seq) {
+                if (msg_len > len) {
+                    errno = EMSGSIZE;
+                    return -1;
+                }
+                h->last_seq = seq;
+                return (int)msg_len;
+            }
+        }
+        if (++spins < h->spins) {
+            IPC_CPU_RELAX();
+        } else {
+            spins = 0;
+            sched_yield();
+        }
+    }
+}
+
+// The writer may build the next value in place. Readers retry until commit,
+// so keep the loan short.
+static int ipc_send_reserve_shm_broadcast(IPC_Handle handle, size_t len, void **ptr) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    if (h->send_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (len > h->hdr->capacity) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    broadcast_write_begin(h);
+    atomic_store_explicit(&h->hdr->len, len, memory_order_relaxed);
+    h->send_loan = h->data;
+    *ptr = h->data;
+    return 0;
+}
+
+static int ipc_send_commit_shm_broadcast(IPC_Handle handle, void *ptr) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    if (!h->send_loan || ptr != h->send_loan) {
+        errno = EINVAL;
+        return -1;
+    }
+    h->send_loan = NULL;
+    uint64_t seq = atomic_load_explicit(&h->hdr->seq, memory_order_relaxed);
+    size_t len = atomic_load_explicit(&h->hdr->len, memory_order_relaxed);
+    broadcast_write_end(h, seq, len);
+    return 0;
+}
+
+static int get_fd_shm_broadcast(IPC_Handle handle) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    return shm_doorbell_fd(&h->bell);
+}
+
+// Ready once a value newer than the one this handle last read is published
+static int broadcast_updated(BroadcastHandle *h) {
+    uint64_t seq = atomic_load_explicit(&h->hdr->seq, memory_order_acquire);
+    return seq != 0 && !(seq & 1) && seq != h->last_seq;
+}
+
+static int poll_arm_shm_broadcast(IPC_Handle handle) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    if (shm_wait_arm(&h->hdr->wq, &h->bell) == -1) return -1;
+    if (!broadcast_updated(h)) return 0;
+    shm_wait_disarm(&h->hdr->wq, &h->bell);
+    return 1;
+}
+
+static int poll_disarm_shm_broadcast(IPC_Handle handle) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    shm_wait_disarm(&h->hdr->wq, &h->bell);
+    return broadcast_updated(h);
+}
+
+static void close_shm_broadcast(IPC_Handle handle) {
+    BroadcastHandle *h = (BroadcastHandle *)handle;
+    if (!h) return;
+    shm_doorbell_close(&h->bell, h->seg.owner);
+    shm_segment_close(&h->seg);
+    free(h);
+}
+
+const IPC_TransportOps ipc_shm_broadcast_ops = {
+    .init = init_shm_broadcast,
+    .send = ipc_send_shm_broadcast,
+    .recv = ipc_recv_shm_broadcast,
+    .close = close_shm_broadcast,
+    .send_reserve = ipc_send_reserve_shm_broadcast,
+    .send_commit = ipc_send_commit_shm_broadcast,
+    .get_fd = get_fd_shm_broadcast,
+    .poll_arm = poll_arm_shm_broadcast,
+    .poll_disarm = poll_disarm_shm_broadcast,
+};
@@ -0,0 +1,542 @@
+#include "ipc_internal.h"
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+
+// Locks in caller-provided shared memory. Every lock word names its holder
+// by PID, so a sleeper that has waited LOCK_PROBE_NS asks the kernel whether
+// that process still exists and takes the lock over if it does not. PIDs fit
+// in 31 bits (pid_max is at most 2^22), which leaves the top bit of a word
+// to record that someone sleeps on it.
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define LOCK_WAITERS 0x80000000u
+#define LOCK_PID_MASK 0x7FFFFFFFu
+#define LOCK_ANY 0xFFFFFFFFu  // Futex bitset matching every waiter
+#define LOCK_SPIN 256
+#define LOCK_PROBE_NS 50000000u
+
+typedef struct {
+    _Alignas(IPC_CACHELINE) atomic_uint pid;  // Reader's PID, 0 when free
+} RWSlot;
+
+typedef struct {
+    // Writer's PID | LOCK_WAITERS, set from the moment a writer asks for the
+    // lock until it releases it
+    _Alignas(IPC_CACHELINE) atomic_uint writer;
+    atomic_uint drain;     // Bumped when a reader leaves while someone waits
+    atomic_uint drainers;  // Writers and readers sleeping on drain
+    // A writer died; set until someone holds the lock exclusively to repair
+    atomic_uint dirty;
+    RWSlot slots[IPC_RWLOCK_SLOTS];
+} RWLock;
+
+// Ticket t is recorded in slots[t % IPC_TICKET_SLOTS] as t << 32 | PID of
+// the caller holding it, with PID 0 once it is given up or passed over. A
+// caller sleeps on serving with futex bit t % 32.
+typedef struct {
+    _Alignas(IPC_CACHELINE) atomic_uint next;
+    _Alignas(IPC_CACHELINE) atomic_uint serving;
+    atomic_uint sleepers;
+    atomic_uint dirty;  // Set when a holder died, for the next holder
+    _Alignas(IPC_CACHELINE) _Atomic uint64_t slots[IPC_TICKET_SLOTS];
+} TicketLock;
+
+_Static_assert(sizeof(RWLock) == IPC_RWLOCK_SIZE, "IPC_RWLOCK_SIZE");
+_Static_assert(sizeof(TicketLock) == IPC_TICKET_SIZE, "IPC_TICKET_SIZE");
+
+#define TICKET_SLOT(t, pid) ((uint64_t)(t) << 32 | (pid))
+
+// Forked children must not keep their parent's PID
+static atomic_uint lock_pid;
+static pthread_once_t lock_once = PTHREAD_ONCE_INIT;
+
+static void lock_forget_pid(void) {
+    atomic_store_explicit(&lock_pid, 0, memory_order_relaxed);
+}
+
+static void lock_atfork(void) {
+    pthread_atfork(NULL, NULL, lock_forget_pid);
+}
+
+static uint32_t lock_self(void) {
+    uint32_t pid = atomic_load_explicit(&lock_pid, memory_order_relaxed);
+    if (pid == 0) {
+        pthread_once(&lock_once, lock_atfork);
+        pid = (uint32_t)getpid();
+        atomic_store_explicit(&lock_pid, pid, memory_order_relaxed);
+    }
+    return pid;
+}
+
+// EPERM means the process exists under another user
+static int lock_owner_dead(uint32_t pid) {
+    int saved = errno;
+    int dead = pid != 0 && kill((pid_t)pid, 0) == -1 && errno == ESRCH;
+    errno = saved;
+    return dead;
+}
+
+static int lock_expired(uint64_t deadline) {
+    return deadline != IPC_NO_DEADLINE && (deadline == IPC_NO_WAIT || stats_now_ns() >= deadline);
+}
+
+// Sleep on addr while it holds val, until woken on one of bits or until
+// `until`, the earlier of the deadline and the next probe
+static void lock_park(atomic_uint *addr, uint32_t val, uint32_t bits, uint64_t until) {
+    ipc_stat_syscall();
+    uint64_t t0 = ipc_stat_block_begin();
+#ifdef __linux__
+    // FUTEX_WAIT_BITSET takes an absolute CLOCK_MONOTONIC time, as deadlines are
+    struct timespec ts = { .tv_sec = (time_t)(until / 1000000000u),
+                           .tv_nsec = (long)(until % 1000000000u) };
+    syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, &ts, NULL, bits);
+#else
+    (void)addr;
+    (void)val;
+    (void)bits;
+    (void)until;
+    usleep(50);
+#endif
+    ipc_stat_block_end(t0);
+}
+
+static void lock_wake(atomic_uint *addr, uint32_t bits, int count) {
+    ipc_stat_syscall();
+#ifdef __linux__
+    syscall(SYS_futex, addr, FUTEX_WAKE_BITSET, count, NULL, NULL, bits);
+#else
+    (void)addr;
+    (void)bits;
+    (void)count;
+#endif
+}
+
+static uint64_t lock_until(uint64_t probe, uint64_t deadline) {
+    return probe < deadline ? probe : deadline;
+}
+
+// Returns whether a probe is due, and schedules the next one
+static int lock_probe_due(uint64_t *probe) {
+    uint64_t now = stats_now_ns();
+    if (now < *probe) return 0;
+    *probe = now + LOCK_PROBE_NS;
+    return 1;
+}
+
+// Contended path of an exclusive word: spin, then flag LOCK_WAITERS and
+// sleep. A caller that slept takes the word with LOCK_WAITERS set, since
+// others may still be asleep behind it.
+static int word_lock_slow(atomic_uint *word, uint32_t self, uint64_t deadline) {
+    uint32_t v;
+    for (uint32_t i = 0; i < LOCK_SPIN && deadline != IPC_NO_WAIT; i++) {
+        v = atomic_load_explicit(word, memory_order_relaxed);
+        if (v == 0 && atomic_compare_exchange_weak_explicit(word, &v, self, memory_order_acquire,
+                                                            memory_order_relaxed)) {
+            return 0;
+        }
+        IPC_CPU_RELAX();
+    }
+    uint64_t probe = stats_now_ns() + LOCK_PROBE_NS;
+    for (;;) {
+        v = atomic_load_explicit(word, memory_order_relaxed);
+        if (v == 0) {
+            if (atomic_compare_exchange_strong_explicit(word, &v, self | LOCK_WAITERS,
+                                                        memory_order_acquire, memory_order_relaxed)) {
+                return 0;
+            }
+            continue;
+        }
+        if (lock_probe_due(&probe) && lock_owner_dead(v & LOCK_PID_MASK)) {
+            if (atomic_compare_exchange_strong_explicit(word, &v, self | LOCK_WAITERS,
+                                                        memory_order_acquire, memory_order_relaxed)) {
+                return IPC_LOCK_OWNER_DIED;
+            }
+            continue;
+        }
+        if (lock_expired(deadline)) return ipc_expired(deadline);
+        if (!(v & LOCK_WAITERS) &&
+            !atomic_compare_exchange_strong_explicit(word, &v, v | LOCK_WAITERS,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+            continue;
+        }
+        lock_park(word, v | LOCK_WAITERS, LOCK_ANY, lock_until(probe, deadline));
+    }
+}
+
+static void word_unlock(atomic_uint *word, int count) {
+    if (atomic_exchange_explicit(word, 0, memory_order_release) & LOCK_WAITERS) {
+        lock_wake(word, LOCK_ANY, count);
+    }
+}
+
+void ipc_lock_init(IPC_Lock *lock) {
+    atomic_init((atomic_uint *)&lock->opaque, 0);
+}
+
+int ipc_lock_acquire(IPC_Lock *lock, int timeout_ms) {
+    if (!lock || timeout_ms < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_uint *word = (atomic_uint *)&lock->opaque;
+    uint32_t self = lock_self();
+    uint32_t v = 0;
+    if (atomic_compare_exchange_strong_explicit(word, &v, self, memory_order_acquire,
+                                                memory_order_relaxed)) {
+        return 0;
+    }
+    return word_lock_slow(word, self, ipc_deadline(timeout_ms));
+}
+
+void ipc_lock_release(IPC_Lock *lock) {
+    if (lock) word_unlock((atomic_uint *)&lock->opaque, 1);
+}
+
+// Readers start looking for a slot at one derived from the thread, so that
+// a thread keeps coming back to the same line and threads spread out
+static _Thread_local unsigned char rw_thread_tag;
+
+static unsigned rw_hint(uint32_t self) {
+    uint32_t h = (self ^ (uint32_t)((uintptr_t)&rw_thread_tag >> 12)) * 2654435761u;
+    return (h >> 16) % IPC_RWLOCK_SLOTS;
+}
+
+static int rw_claim(RWLock *rw, uint32_t self) {
+    unsigned start = rw_hint(self);
+    for (unsigned i = 0; i < IPC_RWLOCK_SLOTS; i++) {
+        RWSlot *slot = &rw->slots[(start + i) % IPC_RWLOCK_SLOTS];
+        uint32_t v = 0;
+        if (atomic_load_explicit(&slot->pid, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&slot->pid, &v, self)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Threads of one process share a PID, so any slot carrying it will do: the
+// count of such slots is what matters
+static void rw_leave(RWLock *rw, uint32_t self) {
+    unsigned start = rw_hint(self);
+    for (unsigned i = 0; i < IPC_RWLOCK_SLOTS; i++) {
+        RWSlot *slot = &rw->slots[(start + i) % IPC_RWLOCK_SLOTS];
+        uint32_t v = self;
+        if (atomic_load_explicit(&slot->pid, memory_order_relaxed) == self &&
+            atomic_compare_exchange_strong_explicit(&slot->pid, &v, 0, memory_order_release,
+                                                    memory_order_relaxed)) {
+            break;
+        }
+    }
+    // Pairs with the fence in rw_drain_wait
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&rw->drainers, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&rw->drain, 1, memory_order_release);
+        lock_wake(&rw->drain, LOCK_ANY, INT_MAX);
+    }
+}
+
+// Readers holding a slot. When reap is set, slots of readers whose process
+// is gone are freed first.
+static unsigned rw_readers(RWLock *rw, int reap) {
+    unsigned n = 0;
+    for (unsigned i = 0; i < IPC_RWLOCK_SLOTS; i++) {
+        uint32_t pid = atomic_load(&rw->slots[i].pid);
+        if (pid == 0) continue;
+        if (reap && lock_owner_dead(pid) &&
+            atomic_compare_exchange_strong(&rw->slots[i].pid, &pid, 0)) {
+            continue;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Sleep on drain until a reader leaves, the deadline or the next probe
+static void rw_drain_wait(RWLock *rw, uint32_t seq, uint64_t until) {
+    atomic_fetch_add_explicit(&rw->drainers, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&rw->drain, memory_order_relaxed) == seq) {
+        lock_park(&rw->drain, seq, LOCK_ANY, until);
+    }
+    atomic_fetch_sub_explicit(&rw->drainers, 1, memory_order_relaxed);
+}
+
+// Wait for the writer word to clear. Returns 0, IPC_LOCK_OWNER_DIED if its
+// owner died and this caller took the word over, or -1 once the deadline
+// passes.
+static int rw_writer_wait(RWLock *rw, uint32_t self, uint64_t deadline, uint64_t *probe) {
+    for (uint32_t i = 0; i < LOCK_SPIN && deadline != IPC_NO_WAIT; i++) {
+        if (atomic_load_explicit(&rw->writer, memory_order_relaxed) == 0) return 0;
+        IPC_CPU_RELAX();
+    }
+    for (;;) {
+        uint32_t w = atomic_load_explicit(&rw->writer, memory_order_acquire);
+        if (w == 0) return 0;
+        if (lock_probe_due(probe) && lock_owner_dead(w & LOCK_PID_MASK)) {
+            if (atomic_compare_exchange_strong(&rw->writer, &w, self | (w & LOCK_WAITERS))) {
+                atomic_store(&rw->dirty, 1);
+                return IPC_LOCK_OWNER_DIED;
+            }
+            continue;
+        }
+        if (lock_expired(deadline)) return ipc_expired(deadline);
+        if (!(w & LOCK_WAITERS) &&
+            !atomic_compare_exchange_strong_explicit(&rw->writer, &w, w | LOCK_WAITERS,
+                                                     memory_order_relaxed, memory_order_relaxed)) {
+            continue;
+        }
+        lock_park(&rw->writer, w | LOCK_WAITERS, LOCK_ANY, lock_until(*probe, deadline));
+    }
+}
+
+// With the writer word held, wait for the readers inside to leave. Returns
+// 0, or IPC_LOCK_OWNER_DIED if a writer died since the last exclusive
+// holder, with the lock held exclusively; or -1, having released the word
+// but kept the news of a death for the next one.
+static int rw_write_drain(RWLock *rw, uint64_t deadline) {
+    // New readers now back out; wait for those already inside to leave
+    int drained = 0;
+    for (uint32_t i = 0; i < LOCK_SPIN && deadline != IPC_NO_WAIT && !drained; i++) {
+        drained = rw_readers(rw, 0) == 0;
+        IPC_CPU_RELAX();
+    }
+    uint64_t probe = stats_now_ns() + LOCK_PROBE_NS;
+    while (!drained) {
+        uint32_t seq = atomic_load_explicit(&rw->drain, memory_order_acquire);
+        if (rw_readers(rw, lock_probe_due(&probe)) == 0) break;
+        if (lock_expired(deadline)) {
+            word_unlock(&rw->writer, INT_MAX);
+            return ipc_expired(deadline);
+        }
+        rw_drain_wait(rw, seq, lock_until(probe, deadline));
+    }
+    if (atomic_load_explicit(&rw->dirty, memory_order_relaxed) && atomic_exchange(&rw->dirty, 0)) {
+        return IPC_LOCK_OWNER_DIED;
+    }
+    return 0;
+}
+
+static int rw_write_lock(RWLock *rw, uint32_t self, uint64_t deadline) {
+    uint32_t v = 0;
+    if (!atomic_compare_exchange_strong(&rw->writer, &v, self)) {
+        int ret = word_lock_slow(&rw->writer, self, deadline);
+        if (ret == -1) return -1;
+        if (ret == IPC_LOCK_OWNER_DIED) atomic_store(&rw->dirty, 1);
+        // The slow path only acquires; order the word before the slot scan
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    return rw_write_drain(rw, deadline);
+}
+
+void ipc_rwlock_init(IPC_RWLock *lock) {
+    RWLock *rw = (RWLock *)lock;
+    atomic_init(&rw->writer, 0);
+    atomic_init(&rw->drain, 0);
+    atomic_init(&rw->drainers, 0);
+    atomic_init(&rw->dirty, 0);
+    for (unsigned i = 0; i < IPC_RWLOCK_SLOTS; i++) atomic_init(&rw->slots[i].pid, 0);
+}
+
+// Data a dead writer left half-written must not be read under a shared
+// lock, so a reader that learns of the death becomes the repairing writer
+int ipc_rwlock_rdlock(IPC_RWLock *lock, int timeout_ms) {
+    if (!lock || timeout_ms < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    RWLock *rw = (RWLock *)lock;
+    uint32_t self = lock_self();
+    uint64_t deadline = ipc_deadline(timeout_ms);
+    uint64_t probe = stats_now_ns() + LOCK_PROBE_NS;
+    for (;;) {
+        int ret = rw_writer_wait(rw, self, deadline, &probe);
+        if (ret == -1) return -1;
+        if (ret == IPC_LOCK_OWNER_DIED) {
+            atomic_thread_fence(memory_order_seq_cst);
+            return rw_write_drain(rw, deadline);
+        }
+        if (atomic_load_explicit(&rw->dirty, memory_order_relaxed)) {
+            // Whoever took over from the dead writer gave up before repairing
+            ret = rw_write_lock(rw, self, deadline);
+            if (ret != 0) return ret;
+            // Someone else repaired it in the meantime
+            word_unlock(&rw->writer, INT_MAX);
+            continue;
+        }
+
+        uint32_t seq = atomic_load_explicit(&rw->drain, memory_order_acquire);
+        if (rw_claim(rw, self) == -1) {
+            // Every slot is taken
+            if (lock_expired(deadline)) return ipc_expired(deadline);
+            rw_drain_wait(rw, seq, lock_until(probe, deadline));
+            continue;
+        }
+        // The slot is claimed with a sequentially consistent exchange and the
+        // writer sets its word with one before scanning the slots, so either
+        // it sees this reader or this reader sees it
+        if (atomic_load(&rw->writer) == 0) return 0;
+        rw_leave(rw, self);
+    }
+}
+
+void ipc_rwlock_rdunlock(IPC_RWLock *lock) {
+    if (lock) rw_leave((RWLock *)lock, lock_self());
+}
+
+int ipc_rwlock_wrlock(IPC_RWLock *lock, int timeout_ms) {
+    if (!lock || timeout_ms < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    return rw_write_lock((RWLock *)lock, lock_self(), ipc_deadline(timeout_ms));
+}
+
+void ipc_rwlock_wrunlock(IPC_RWLock *lock) {
+    if (lock) word_unlock(&((RWLock *)lock)->writer, INT_MAX);
+}
+
+void ipc_ticket_init(IPC_TicketLock *lock) {
+    TicketLock *tl = (TicketLock *)lock;
+    atomic_init(&tl->next, 0);
+    atomic_init(&tl->serving, 0);
+    atomic_init(&tl->sleepers, 0);
+    atomic_init(&tl->dirty, 0);
+    // Each slot starts with a ticket from before the first one handed out
+    for (uint32_t i = 0; i < IPC_TICKET_SLOTS; i++) {
+        atomic_init(&tl->slots[i], TICKET_SLOT(i - IPC_TICKET_SLOTS, 0));
+    }
+}
+
+// Move serving on from ticket t, past every following ticket already given
+// up, and wake whoever it lands on. Whoever advances serving wakes for it.
+static void ticket_advance(TicketLock *tl, uint32_t t) {
+    uint32_t cur = t;
+    if (!atomic_compare_exchange_strong(&tl->serving, &cur, t + 1)) return;
+    t++;
+    while (atomic_load(&tl->slots[t % IPC_TICKET_SLOTS]) == TICKET_SLOT(t, 0)) {
+        cur = t;
+        if (!atomic_compare_exchange_strong(&tl->serving, &cur, t + 1)) return;
+        t++;
+    }
+    if (atomic_load(&tl->sleepers)) lock_wake(&tl->serving, 1u << (t % 32), INT_MAX);
+}
+
+// Run by sleepers every LOCK_PROBE_NS. Passes over the ticket being served
+// if its caller died, or if nobody has recorded it for two probes in a row
+// (its caller died between taking and recording it, or is so late that it
+// will find itself passed over and take another).
+static void ticket_probe(TicketLock *tl, uint64_t *unrecorded) {
+    uint32_t s = atomic_load(&tl->serving);
+    _Atomic uint64_t *slot = &tl->slots[s % IPC_TICKET_SLOTS];
+    uint64_t v = atomic_load(slot);
+    if ((uint32_t)(v >> 32) == s) {
+        uint32_t pid = (uint32_t)v;
+        if (pid == 0) {
+            ticket_advance(tl, s);
+        } else if (lock_owner_dead(pid) && atomic_compare_exchange_strong(slot, &v, TICKET_SLOT(s, 0))) {
+            atomic_store(&tl->dirty, 1);
+            ticket_advance(tl, s);
+        }
+        return;
+    }
+    uint64_t seen = (uint64_t)1 << 32 | s;
+    if (*unrecorded != seen) {
+        *unrecorded = seen;
+    } else if (atomic_compare_exchange_strong(slot, &v, TICKET_SLOT(s, 0))) {
+        ticket_advance(tl, s);
+    }
+}
+
+// Sleep on serving while it is still s
+static void ticket_sleep(TicketLock *tl, uint32_t s, uint32_t bits, uint64_t until) {
+    atomic_fetch_add(&tl->sleepers, 1);
+    if (atomic_load(&tl->serving) == s) lock_park(&tl->serving, s, bits, until);
+    atomic_fetch_sub_explicit(&tl->sleepers, 1, memory_order_relaxed);
+}
+
+#define TICKET_PASSED 2
+
+// Wait for ticket t to be served. Returns 0, IPC_LOCK_OWNER_DIED,
+// TICKET_PASSED if t was passed over before it was recorded, or -1.
+static int ticket_wait(TicketLock *tl, uint32_t t, uint32_t self, uint64_t deadline) {
+    uint64_t probe = stats_now_ns() + LOCK_PROBE_NS;
+    uint64_t unrecorded = 0;
+    _Atomic uint64_t *slot = &tl->slots[t % IPC_TICKET_SLOTS];
+
+    // The slot is still in use while ticket t - IPC_TICKET_SLOTS is queued.
+    // Giving up here leaves t unrecorded for the probes to pass over.
+    for (;;) {
+        uint32_t s = atomic_load(&tl->serving);
+        if (t - s < IPC_TICKET_SLOTS) break;
+        if (lock_probe_due(&probe)) ticket_probe(tl, &unrecorded);
+        if (lock_expired(deadline)) return ipc_expired(deadline);
+        ticket_sleep(tl, s, LOCK_ANY, lock_until(probe, deadline));
+    }
+    uint64_t v = atomic_load(slot);
+    do {
+        if ((uint32_t)(v >> 32) == t) return TICKET_PASSED;
+    } while (!atomic_compare_exchange_weak(slot, &v, TICKET_SLOT(t, self)));
+
+    uint32_t spins = 0;
+    for (;;) {
+        uint32_t s = atomic_load_explicit(&tl->serving, memory_order_acquire);
+        if (s == t) break;
+        // Spin less the further back in line this caller is
+        if (spins < LOCK_SPIN && deadline != IPC_NO_WAIT) {
+            for (uint32_t i = 0; i < t - s && i < LOCK_SPIN; i++) IPC_CPU_RELAX();
+            spins++;
+            continue;
+        }
+        if (lock_probe_due(&probe)) ticket_probe(tl, &unrecorded);
+        if (lock_expired(deadline)) {
+            // Give the place up; if it has already come round, pass it on
+            v = TICKET_SLOT(t, self);
+            atomic_compare_exchange_strong(slot, &v, TICKET_SLOT(t, 0));
+            if (atomic_load(&tl->serving) == t) ticket_advance(tl, t);
+            return ipc_expired(deadline);
+        }
+        ticket_sleep(tl, s, 1u << (t % 32), lock_until(probe, deadline));
+    }
+    if (atomic_load_explicit(&tl->dirty, memory_order_relaxed) && atomic_exchange(&tl->dirty, 0)) {
+        return IPC_LOCK_OWNER_DIED;
+    }
+    return 0;
+}
+
+int ipc_ticket_acquire(IPC_TicketLock *lock, int timeout_ms) {
+    if (!lock || timeout_ms < -1) {
+        errno = EINVAL;
+        return -1;
+    }
+    TicketLock *tl = (TicketLock *)lock;
+    uint32_t self = lock_self();
+    uint64_t deadline = ipc_deadline(timeout_ms);
+    for (;;) {
+        uint32_t t;
+        if (deadline == IPC_NO_WAIT) {
+            // Only take a ticket that is served at once
+            t = atomic_load(&tl->serving);
+            uint32_t n = t;
+            if (!atomic_compare_exchange_strong(&tl->next, &n, t + 1)) {
+                errno = EAGAIN;
+                return -1;
+            }
+        } else {
+            t = atomic_fetch_add(&tl->next, 1);
+        }
+        int ret = ticket_wait(tl, t, self, deadline);
+        if (ret != TICKET_PASSED) return ret;
+    }
+}
+
+void ipc_ticket_release(IPC_TicketLock *lock) {
+    if (!lock) return;
+    TicketLock *tl = (TicketLock *)lock;
+    ticket_advance(tl, atomic_load_explicit(&tl->serving, memory_order_relaxed));
+}
@@ -1,135 +1,159 @@
-#include "ipc.h"
-#include <sys/mman.h>
-#include <fcntl.h>
-#include <unistd.h>
+#include "ipc_internal.h"
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
 #include <stdio.h>
+#include <unistd.h>
 
 typedef struct {
+    ShmSegment seg;
     void *mem;
     size_t size;
     pthread_mutex_t *mux;
-    char *shm_name;
+    uint64_t wait;  // Deadline of the plain send/recv
 } ShmHandle;
 
-IPC_Handle init_shm(const IPC_Config *config) {
-    // Validate name length
-    if (strlen(config->name) > 255) {
-        fprintf(stderr, "shm name too long: %s\n", config->name);
-        errno = EINVAL;
-        return NULL;
-    }
-
-    // Clean up existing shared memory
-    if (shm_unlink(config->name) == -1 && errno != ENOENT) {
-        fprintf(stderr, "shm_unlink failed: %s\n", strerror(errno));
-    }
-
-    // Open shared memory
-    int fd = shm_open(config->name, O_CREAT | O_RDWR | O_EXCL, 0666);
-    if (fd == -1) {
-        fprintf(stderr, "shm_open failed: %s\n", strerror(errno));
-        if (errno == EEXIST) {
-            fd = shm_open(config->name, O_RDWR, 0666);
-            if (fd == -1) {
-                fprintf(stderr, "shm_open retry failed: %s\n", strerror(errno));
-                return NULL;
-            }
-        } else {
-            return NULL;
-        }
-    }
-
-    // Set size
-    size_t total_size = config->size + sizeof(pthread_mutex_t);
-    if (ftruncate(fd, total_size) == -1) {
-        fprintf(stderr, "ftruncate failed: %s\n", strerror(errno));
-        close(fd);
-        shm_unlink(config->name);
-        return NULL;
-    }
-
-    // Map shared memory
-    void *mem = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    close(fd);
-    if (mem == MAP_FAILED) {
-        fprintf(stderr, "mmap failed: %s\n", strerror(errno));
-        shm_unlink(config->name);
-        return NULL;
-    }
+// Runs once, in the process that creates the segment
+static void shm_mutex_init(void *mem, size_t size, void *arg) {
+    (void)size;
+    int *err = (int *)arg;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    *err = pthread_mutex_init((pthread_mutex_t *)mem, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
 
-    // Allocate handle
+// The first process creates the segment and its mutex; later ones attach to
+// the live segment without reinitializing anything
+static IPC_Handle init_shm(const IPC_Config *config) {
     ShmHandle *h = malloc(sizeof(ShmHandle));
     if (!h) {
         fprintf(stderr, "malloc failed: %s\n", strerror(errno));
-        munmap(mem, total_size);
-        shm_unlink(config->name);
         return NULL;
     }
 
-    // Initialize handle
-    h->mux = (pthread_mutex_t *)mem;
-    h->mem = mem + sizeof(pthread_mutex_t);
-    h->size = config->size;
-    h->shm_name = strdup(config->name);
-    if (!h->shm_name) {
-        fprintf(stderr, "strdup failed: %s\n", strerror(errno));
+    int err = 0;
+    size_t size = sizeof(pthread_mutex_t) + config->size;
+    if (shm_segment_open(&h->seg, config, size, shm_mutex_init, &err) == -1) {
+        fprintf(stderr, "shm segment open failed: %s\n", strerror(errno));
         free(h);
-        munmap(mem, total_size);
-        shm_unlink(config->name);
         return NULL;
     }
-
-    // Initialize mutex
-    pthread_mutexattr_t attr;
-    pthread_mutexattr_init(&attr);
-    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
-    if (pthread_mutex_init(h->mux, &attr) != 0) {
-        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(errno));
-        free(h->shm_name);
+    if (err) {
+        fprintf(stderr, "pthread_mutex_init failed: %s\n", strerror(err));
+        shm_segment_close(&h->seg);
         free(h);
-        munmap(mem, total_size);
-        shm_unlink(config->name);
+        errno = err;
+        return NULL;
+    }
+    if (h->seg.size < sizeof(pthread_mutex_t)) {
+        shm_segment_close(&h->seg);
+        free(h);
+        errno = EPROTO;
         return NULL;
     }
-    pthread_mutexattr_destroy(&attr);
 
+    h->mux = (pthread_mutex_t *)h->seg.mem;
+    h->mem = (unsigned char *)h->seg.mem + sizeof(pthread_mutex_t);
+    h->size = h->seg.size - sizeof(pthread_mutex_t);
+    h->wait = ipc_default_deadline(config);
     return (IPC_Handle)h;
 }
 
-int ipc_send_shm(IPC_Handle handle, const void *data, size_t len) {
-    ShmHandle *h = (ShmHandle *)handle;
-    if (!h || len > h->size) {
+// Lock mux before the deadline. pthread_mutex_timedlock takes a
+// CLOCK_REALTIME time, so the monotonic time left is added to the current
+// wall clock. Only a contended lock is timed, so the uncontended path stays
+// two atomics.
+static int shm_lock(pthread_mutex_t *mux, uint64_t deadline) {
+    if (pthread_mutex_trylock(mux) == 0) return 0;
+    if (deadline == IPC_NO_WAIT) return ipc_expired(deadline);
+    uint64_t t0 = ipc_stat_block_begin();
+    int err = 0;
+    if (deadline == IPC_NO_DEADLINE) {
+        err = pthread_mutex_lock(mux);
+    } else {
+#ifdef __linux__
+        uint64_t left = ipc_deadline_left(deadline);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += left / 1000000000u;
+        ts.tv_nsec += left % 1000000000u;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        err = pthread_mutex_timedlock(mux, &ts);
+#else
+        while ((err = pthread_mutex_trylock(mux)) == EBUSY && ipc_deadline_left(deadline)) {
+            usleep(50);
+        }
+        if (err == EBUSY) err = ETIMEDOUT;
+#endif
+    }
+    ipc_stat_block_end(t0);
+    if (err == ETIMEDOUT) return ipc_expired(deadline);
+    if (err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int shm_send(ShmHandle *h, const void *data, size_t len, uint64_t deadline) {
+    if (len > h->size) {
         errno = EINVAL;
         return -1;
     }
-    pthread_mutex_lock(h->mux);
+    if (shm_lock(h->mux, deadline) == -1) return -1;
     memcpy(h->mem, data, len);
     pthread_mutex_unlock(h->mux);
     return 0;
 }
 
-int ipc_recv_shm(IPC_Handle handle, void *buf, size_t len) {
-    ShmHandle *h = (ShmHandle *)handle;
-    if (!h || len > h->size) {
+static int shm_recv(ShmHandle *h, void *buf, size_t len, uint64_t deadline) {
+    if (len > h->size) {
         errno = EINVAL;
         return -1;
     }
-    pthread_mutex_lock(h->mux);
+    if (shm_lock(h->mux, deadline) == -1) return -1;
     memcpy(buf, h->mem, len);
     pthread_mutex_unlock(h->mux);
     return 0;
 }
 
-void close_shm(IPC_Handle handle) {
+static int ipc_send_shm(IPC_Handle handle, const void *data, size_t len) {
+    ShmHandle *h = (ShmHandle *)handle;
+    return shm_send(h, data, len, h->wait);
+}
+
+static int ipc_recv_shm(IPC_Handle handle, void *buf, size_t len) {
+    ShmHandle *h = (ShmHandle *)handle;
+    return shm_recv(h, buf, len, h->wait);
+}
+
+static int ipc_send_timed_shm(IPC_Handle handle, const void *data, size_t len, int timeout_ms) {
+    return shm_send((ShmHandle *)handle, data, len, ipc_deadline(timeout_ms));
+}
+
+static int ipc_recv_timed_shm(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    return shm_recv((ShmHandle *)handle, buf, len, ipc_deadline(timeout_ms));
+}
+
+static void close_shm(IPC_Handle handle) {
     ShmHandle *h = (ShmHandle *)handle;
     if (!h) return;
-    pthread_mutex_destroy(h->mux);
-    munmap(h->mux, h->size + sizeof(pthread_mutex_t));
-    shm_unlink(h->shm_name);
-    free(h->shm_name);
+    // The mutex is left alone: attached processes may still be using it
+    shm_segment_close(&h->seg);
     free(h);
 }
+
+const IPC_TransportOps ipc_shm_mutex_ops = {
+    .init = init_shm,
+    .send = ipc_send_shm,
+    .recv = ipc_recv_shm,
+    .close = close_shm,
+    .send_timed = ipc_send_timed_shm,
+    .recv_timed = ipc_recv_timed_shm,
+};
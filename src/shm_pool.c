@@ -0,0 +1,250 @@
+#include "ipc_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Size-classed slab allocator inside a named shared-memory segment.
+// The data area is cut into fixed-size slabs. A slab is handed to one size
+// class the first time that class runs dry and is then carved into blocks
+// of that size; it stays with the class afterwards. Free slabs and the free
+// blocks of each class sit on lock-free stacks, so any attached process can
+// allocate and free without a lock. Stack heads pack a 32-bit index with a
+// 32-bit tag bumped on every update to rule out ABA, and a free block holds
+// the index of the next one in its first four bytes.
+//
+// References are byte offsets from the start of the pool, the same in every
+// process; 0 is never a valid block.
+
+#define POOL_MIN_SHIFT 6   // 64-byte blocks
+#define POOL_SLAB_SHIFT 18 // 256 KiB slabs, also the largest block
+#define POOL_CLASSES (POOL_SLAB_SHIFT - POOL_MIN_SHIFT + 1)
+#define POOL_SLAB_SIZE ((uint64_t)1 << POOL_SLAB_SHIFT)
+#define POOL_NO_CLASS 0xFFu
+
+typedef struct {
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t head;
+} PoolStack;
+
+typedef struct {
+    PoolStack free_slabs;            // Slab number + 1
+    PoolStack classes[POOL_CLASSES]; // Block offset >> POOL_MIN_SHIFT
+    // Written once by the creator
+    _Alignas(IPC_CACHELINE) uint64_t nslabs;
+    uint64_t data_off;  // Offset of slab 0 from the pool start
+    // Followed by one class byte per slab
+} PoolHeader;
+
+struct IPC_Pool {
+    ShmSegment seg;
+    PoolHeader *hdr;
+    unsigned char *base;
+    unsigned char *slab_class;
+};
+
+// Maps a stack entry to the offset of the entry's next word
+typedef uint64_t (*PoolOffsetFn)(uint32_t idx, const PoolHeader *hdr);
+
+static inline uint32_t *pool_next(unsigned char *base, uint64_t off) {
+    return (uint32_t *)(base + off);
+}
+
+// Returns 0 when the stack is empty
+static uint32_t pool_pop(PoolStack *s, unsigned char *base, PoolOffsetFn off_of,
+                         const PoolHeader *hdr) {
+    uint64_t head = atomic_load_explicit(&s->head, memory_order_acquire);
+    for (;;) {
+        uint32_t idx = (uint32_t)head;
+        if (idx == 0) return 0;
+        // May read a block another process just popped; the tag check below
+        // throws the stale value away
+        _Atomic uint32_t *next_p = (_Atomic uint32_t *)pool_next(base, off_of(idx, hdr));
+        uint32_t next = atomic_load_explicit(next_p, memory_order_relaxed);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | next;
+        if (atomic_compare_exchange_weak_explicit(&s->head, &head, new_head,
+                                                  memory_order_acquire, memory_order_acquire)) {
+            return idx;
+        }
+    }
+}
+
+// Push the chain first..last, already linked through their next words
+static void pool_push(PoolStack *s, unsigned char *base, PoolOffsetFn off_of,
+                      const PoolHeader *hdr, uint32_t first, uint32_t last) {
+    _Atomic uint32_t *last_next = (_Atomic uint32_t *)pool_next(base, off_of(last, hdr));
+    uint64_t head = atomic_load_explicit(&s->head, memory_order_relaxed);
+    for (;;) {
+        atomic_store_explicit(last_next, (uint32_t)head, memory_order_relaxed);
+        uint64_t new_head = ((head >> 32) + 1) << 32 | first;
+        if (atomic_compare_exchange_weak_explicit(&s->head, &head, new_head,
+                                                  memory_order_release, memory_order_relaxed)) {
+            return;
+        }
+    }
+}
+
+static uint64_t slab_off(uint32_t idx, const PoolHeader *hdr) {
+    return hdr->data_off + (uint64_t)(idx - 1) * POOL_SLAB_SIZE;
+}
+
+static uint64_t block_off(uint32_t idx, const PoolHeader *hdr) {
+    (void)hdr;
+    return (uint64_t)idx << POOL_MIN_SHIFT;
+}
+
+static uint64_t pool_data_off(uint64_t nslabs) {
+    uint64_t off = sizeof(PoolHeader) + nslabs;
+    return (off + IPC_CACHELINE - 1) & ~(uint64_t)(IPC_CACHELINE - 1);
+}
+
+// Block indices are 32-bit in units of the smallest block, and the slab
+// class bytes ahead of the data count against the same range
+static int pool_fits(uint64_t nslabs) {
+    if (nslabs == 0 || nslabs > UINT32_MAX >> (POOL_SLAB_SHIFT - POOL_MIN_SHIFT)) return 0;
+    return (pool_data_off(nslabs) + nslabs * POOL_SLAB_SIZE) >> POOL_MIN_SHIFT <= UINT32_MAX;
+}
+
+static void pool_init(void *mem, size_t size, void *arg) {
+    (void)size;
+    uint64_t nslabs = *(uint64_t *)arg;
+    PoolHeader *hdr = (PoolHeader *)mem;
+    unsigned char *base = (unsigned char *)mem;
+    hdr->nslabs = nslabs;
+    hdr->data_off = pool_data_off(nslabs);
+    memset(base + sizeof(PoolHeader), POOL_NO_CLASS, nslabs);
+    for (unsigned c = 0; c < POOL_CLASSES; c++) atomic_init(&hdr->classes[c].head, 0);
+    for (uint64_t i = 1; i < nslabs; i++) {
+        *pool_next(base, slab_off((uint32_t)i, hdr)) = (uint32_t)(i + 1);
+    }
+    *pool_next(base, slab_off((uint32_t)nslabs, hdr)) = 0;
+    atomic_init(&hdr->free_slabs.head, 1);
+}
+
+IPC_Pool *ipc_pool_open(const IPC_Config *config) {
+    if (!config || !config->name) {
+        errno = EINVAL;
+        return NULL;
+    }
+    uint64_t nslabs = config->size / POOL_SLAB_SIZE;
+    if (!pool_fits(nslabs)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    IPC_Pool *pool = malloc(sizeof(IPC_Pool));
+    if (!pool) {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    IPC_Config seg_config = *config;
+    seg_config.mech = SHM_KIND_POOL;
+    size_t size = pool_data_off(nslabs) + nslabs * POOL_SLAB_SIZE;
+    if (shm_segment_open(&pool->seg, &seg_config, size, pool_init, &nslabs) == -1) {
+        free(pool);
+        return NULL;
+    }
+    pool->hdr = (PoolHeader *)pool->seg.mem;
+    // An attached pool was sized by its creator
+    uint64_t have = pool->hdr->nslabs;
+    if (!pool_fits(have) || pool_data_off(have) + have * POOL_SLAB_SIZE != pool->seg.size) {
+        shm_segment_close(&pool->seg);
+        free(pool);
+        errno = EPROTO;
+        return NULL;
+    }
+    pool->base = (unsigned char *)pool->seg.mem;
+    pool->slab_class = pool->base + sizeof(PoolHeader);
+    return pool;
+}
+
+void ipc_pool_close(IPC_Pool *pool) {
+    if (!pool) return;
+    shm_segment_close(&pool->seg);
+    free(pool);
+}
+
+static unsigned pool_class(size_t len) {
+    unsigned c = 0;
+    while (((size_t)1 << (POOL_MIN_SHIFT + c)) < len) c++;
+    return c;
+}
+
+// Carve a fresh slab into blocks of class c: keep the first, publish the
+// rest with one push
+static uint32_t pool_refill(IPC_Pool *pool, unsigned c) {
+    PoolHeader *hdr = pool->hdr;
+    uint32_t slab = pool_pop(&hdr->free_slabs, pool->base, slab_off, hdr);
+    if (slab == 0) {
+        errno = ENOMEM;
+        return 0;
+    }
+    pool->slab_class[slab - 1] = (unsigned char)c;
+
+    uint32_t first = (uint32_t)(slab_off(slab, hdr) >> POOL_MIN_SHIFT);
+    uint32_t step = 1u << c;
+    uint32_t count = 1u << (POOL_SLAB_SHIFT - POOL_MIN_SHIFT - c);
+    if (count > 1) {
+        for (uint32_t i = 1; i + 1 < count; i++) {
+            *pool_next(pool->base, block_off(first + i * step, hdr)) = first + (i + 1) * step;
+        }
+        pool_push(&hdr->classes[c], pool->base, block_off, hdr, first + step,
+                  first + (count - 1) * step);
+    }
+    return first;
+}
+
+IPC_PoolRef ipc_pool_alloc(IPC_Pool *pool, size_t len) {
+    if (!pool || len == 0) {
+        errno = EINVAL;
+        return 0;
+    }
+    if (len > POOL_SLAB_SIZE) {
+        errno = EMSGSIZE;
+        return 0;
+    }
+    unsigned c = pool_class(len);
+    uint32_t idx = pool_pop(&pool->hdr->classes[c], pool->base, block_off, pool->hdr);
+    if (idx == 0) idx = pool_refill(pool, c);
+    return block_off(idx, pool->hdr);
+}
+
+// Slab holding ref, or -1 if ref is not the start of a block
+static int64_t pool_slab_of(IPC_Pool *pool, IPC_PoolRef ref) {
+    PoolHeader *hdr = pool->hdr;
+    if (ref < hdr->data_off || ref >= hdr->data_off + hdr->nslabs * POOL_SLAB_SIZE) return -1;
+    uint64_t slab = (ref - hdr->data_off) >> POOL_SLAB_SHIFT;
+    unsigned c = pool->slab_class[slab];
+    if (c >= POOL_CLASSES) return -1;
+    if ((ref - hdr->data_off) & ((((uint64_t)1) << (POOL_MIN_SHIFT + c)) - 1)) return -1;
+    return (int64_t)slab;
+}
+
+int ipc_pool_free(IPC_Pool *pool, IPC_PoolRef ref) {
+    if (!pool) {
+        errno = EINVAL;
+        return -1;
+    }
+    int64_t slab = pool_slab_of(pool, ref);
+    if (slab < 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t idx = (uint32_t)(ref >> POOL_MIN_SHIFT);
+    PoolStack *s = &pool->hdr->classes[pool->slab_class[slab]];
+    pool_push(s, pool->base, block_off, pool->hdr, idx, idx);
+    return 0;
+}
+
+void *ipc_pool_ptr(IPC_Pool *pool, IPC_PoolRef ref) {
+    if (!pool || ref == 0 || ref >= pool->seg.size) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return pool->base + ref;
+}
+
+size_t ipc_pool_block_size(IPC_Pool *pool, IPC_PoolRef ref) {
+    if (!pool) return 0;
+    int64_t slab = pool_slab_of(pool, ref);
+    if (slab < 0) return 0;
+    return (size_t)1 << (POOL_MIN_SHIFT + pool->slab_class[slab]);
+}
@@ -0,0 +1,552 @@
+#include "ipc_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Bounded multi-producer/multi-consumer queue of fixed-size slots. Each slot
+// carries a sequence number that tells producers and consumers whose turn it
+// is, so the only shared write traffic is one CAS on the enqueue or dequeue
+// counter per message. A slot at index i is free for the producer at
+// position p when seq == p, and holds a message for the consumer at position
+// p when seq == p + 1.
+//
+// Each priority has a lane of its own: a separate ring of slots with its own
+// counters, so a burst of bulk messages never delays a control message
+// behind it. Consumers look at the lanes from the highest priority down;
+// all of them share one wait queue.
+
+#define QUEUE_DEPTH 64
+#define QUEUE_SLOT_HDR 16
+
+typedef struct {
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t enqueue_pos;
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t dequeue_pos;
+} QueueLane;
+
+// Followed by the lanes, then each lane's slots in turn
+typedef struct {
+    // Where idle consumers sleep
+    ShmWaitQueue wq;
+    // Written once by the creator
+    _Alignas(IPC_CACHELINE) uint64_t depth;
+    uint64_t slot_size;
+    uint64_t lanes;
+} QueueHeader;
+
+typedef struct {
+    uint64_t msg_size;
+    uint64_t depth;
+    uint64_t lanes;
+} QueueParams;
+
+typedef struct {
+    atomic_uint_fast64_t seq;
+    uint32_t len;
+} QueueSlot;
+
+typedef struct {
+    ShmSegment seg;
+    ShmDoorbell bell;
+    QueueHeader *hdr;
+    QueueLane *lanes;
+    uint32_t nlanes;
+    unsigned char *slots;
+    uint64_t mask;
+    uint64_t stride;
+    uint64_t lane_size;  // Bytes of slots per lane
+    uint64_t msg_size;
+    // Outstanding zero-copy loans and the position each one was claimed at
+    QueueSlot *send_loan;
+    uint64_t send_pos;
+    QueueSlot *recv_loan;
+    uint64_t recv_pos;
+    uint32_t spins;
+    uint64_t wait;  // Deadline of the plain receive calls
+} QueueHandle;
+
+// Slots are padded to whole cache lines so neighbours never share one
+static inline uint64_t queue_stride(uint64_t msg_size) {
+    return (QUEUE_SLOT_HDR + msg_size + IPC_CACHELINE - 1) & ~(uint64_t)(IPC_CACHELINE - 1);
+}
+
+static inline QueueSlot *queue_slot(QueueHandle *h, uint32_t lane, uint64_t pos) {
+    return (QueueSlot *)(h->slots + lane * h->lane_size + (pos & h->mask) * h->stride);
+}
+
+// Bytes of a queue with this layout, or -1 if they do not fit in a size_t
+static int queue_size(uint64_t depth, uint64_t slot_size, uint64_t lanes, size_t *size) {
+    size_t lane, total;
+    if (__builtin_mul_overflow(depth, slot_size, &lane) ||
+        __builtin_add_overflow(lane, sizeof(QueueLane), &lane) ||
+        __builtin_mul_overflow(lane, lanes, &total) ||
+        __builtin_add_overflow(total, sizeof(QueueHeader), &total)) {
+        return -1;
+    }
+    *size = total;
+    return 0;
+}
+
+static void queue_init(void *mem, size_t size, void *arg) {
+    (void)size;
+    QueueHeader *hdr = (QueueHeader *)mem;
+    const QueueParams *qp = (const QueueParams *)arg;
+    QueueLane *lanes = (QueueLane *)(hdr + 1);
+    shm_wait_init(&hdr->wq);
+    hdr->depth = qp->depth;
+    hdr->slot_size = queue_stride(qp->msg_size);
+    hdr->lanes = qp->lanes;
+    unsigned char *slots = (unsigned char *)(lanes + hdr->lanes);
+    for (uint64_t l = 0; l < hdr->lanes; l++) {
+        atomic_init(&lanes[l].enqueue_pos, 0);
+        atomic_init(&lanes[l].dequeue_pos, 0);
+        for (uint64_t i = 0; i < hdr->depth; i++) {
+            QueueSlot *slot = (QueueSlot *)(slots + (l * hdr->depth + i) * hdr->slot_size);
+            atomic_init(&slot->seq, i);
+            slot->len = 0;
+        }
+    }
+}
+
+static IPC_Handle init_shm_queue(const IPC_Config *config) {
+    if (config->depth > (1u << 31)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    QueueHandle *h = malloc(sizeof(QueueHandle));
+    if (!h) return NULL;
+
+    // The depth is rounded up so a position maps to a slot with a mask
+    QueueParams qp = { config->size, QUEUE_DEPTH, config->priorities ? config->priorities : 1 };
+    if (config->depth) {
+        qp.depth = 1;
+        while (qp.depth < config->depth) qp.depth <<= 1;
+    }
+    size_t size;
+    if (queue_size(qp.depth, queue_stride(qp.msg_size), qp.lanes, &size) == -1) {
+        free(h);
+        errno = EINVAL;
+        return NULL;
+    }
+    if (shm_segment_open(&h->seg, config, size, queue_init, &qp) == -1) {
+        free(h);
+        return NULL;
+    }
+    // An attacher takes the creator's depth and lanes
+    h->hdr = (QueueHeader *)h->seg.mem;
+    uint64_t depth = h->hdr->depth;
+    size_t have;
+    if (depth == 0 || (depth & (depth - 1)) || h->hdr->lanes == 0 ||
+        h->hdr->lanes > IPC_PRIORITIES_MAX ||
+        queue_size(depth, h->hdr->slot_size, h->hdr->lanes, &have) == -1 || have != h->seg.size) {
+        shm_segment_close(&h->seg);
+        free(h);
+        errno = EPROTO;
+        return NULL;
+    }
+    if (shm_doorbell_init(&h->bell, &h->seg) == -1) {
+        shm_segment_close(&h->seg);
+        free(h);
+        return NULL;
+    }
+    h->lanes = (QueueLane *)(h->hdr + 1);
+    h->nlanes = (uint32_t)h->hdr->lanes;
+    h->slots = (unsigned char *)(h->lanes + h->nlanes);
+    h->mask = depth - 1;
+    h->stride = h->hdr->slot_size;
+    h->lane_size = depth * h->stride;
+    h->msg_size = h->stride - QUEUE_SLOT_HDR;
+    h->send_loan = NULL;
+    h->recv_loan = NULL;
+    h->spins = config->spin_count ? config->spin_count : SHM_SPIN_DEFAULT;
+    h->wait = ipc_default_deadline(config);
+    return (IPC_Handle)h;
+}
+
+// Claim the slot at the enqueue position. The message becomes visible once
+// the slot's sequence is set to *pos + 1.
+static QueueSlot *queue_claim_send(QueueHandle *h, uint32_t lane, uint64_t *pos_out) {
+    QueueLane *l = &h->lanes[lane];
+    QueueSlot *slot;
+    uint64_t pos = atomic_load_explicit(&l->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        slot = queue_slot(h, lane, pos);
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&l->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            errno = EAGAIN;
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&l->enqueue_pos, memory_order_relaxed);
+        }
+    }
+    *pos_out = pos;
+    return slot;
+}
+
+// Claim the slot at the dequeue position if its message fits in max_len.
+// The slot is handed back to producers once its sequence is advanced by a
+// full lap.
+static QueueSlot *queue_claim_recv(QueueHandle *h, uint32_t lane, size_t max_len,
+                                   uint64_t *pos_out) {
+    QueueLane *l = &h->lanes[lane];
+    QueueSlot *slot;
+    uint64_t pos = atomic_load_explicit(&l->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        slot = queue_slot(h, lane, pos);
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int64_t diff = (int64_t)(seq - (pos + 1));
+        if (diff == 0) {
+            // Leave an oversized message in place, but only report it if no
+            // other consumer took the slot while its length was being read.
+            if (slot->len > max_len) {
+                atomic_thread_fence(memory_order_acquire);
+                if (atomic_load_explicit(&slot->seq, memory_order_relaxed) == seq) {
+                    errno = EMSGSIZE;
+                    return NULL;
+                }
+                pos = atomic_load_explicit(&l->dequeue_pos, memory_order_relaxed);
+                continue;
+            }
+            if (atomic_compare_exchange_weak_explicit(&l->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            errno = EAGAIN;
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&l->dequeue_pos, memory_order_relaxed);
+        }
+    }
+    *pos_out = pos;
+    return slot;
+}
+
+// Claim up to `want` consecutive free slots with a single CAS on the
+// enqueue counter. Returns how many were claimed, starting at *pos_out.
+static size_t queue_claim_send_n(QueueHandle *h, uint32_t lane, size_t want, uint64_t *pos_out) {
+    QueueLane *l = &h->lanes[lane];
+    uint64_t pos = atomic_load_explicit(&l->enqueue_pos, memory_order_relaxed);
+    for (;;) {
+        size_t n = 0;
+        while (n < want && n <= h->mask) {
+            uint64_t seq = atomic_load_explicit(&queue_slot(h, lane, pos + n)->seq,
+                                                memory_order_acquire);
+            if (seq != pos + n) break;
+            n++;
+        }
+        if (n == 0) {
+            uint64_t seq = atomic_load_explicit(&queue_slot(h, lane, pos)->seq, memory_order_acquire);
+            if ((int64_t)(seq - pos) < 0) {
+                errno = EAGAIN;
+                return 0;
+            }
+            pos = atomic_load_explicit(&l->enqueue_pos, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&l->enqueue_pos, &pos, pos + n,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            *pos_out = pos;
+            return n;
+        }
+    }
+}
+
+// Claim up to `want` consecutive filled slots whose messages fit the
+// matching buffers, with a single CAS on the dequeue counter.
+static size_t queue_claim_recv_n(QueueHandle *h, uint32_t lane, const IPC_Msg *msgs, size_t want,
+                                 uint64_t *pos_out) {
+    QueueLane *l = &h->lanes[lane];
+    uint64_t pos = atomic_load_explicit(&l->dequeue_pos, memory_order_relaxed);
+    for (;;) {
+        size_t n = 0;
+        while (n < want && n <= h->mask) {
+            QueueSlot *slot = queue_slot(h, lane, pos + n);
+            uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if (seq != pos + n + 1 || slot->len > msgs[n].len) break;
+            n++;
+        }
+        if (n == 0) return 0;
+        if (atomic_compare_exchange_weak_explicit(&l->dequeue_pos, &pos, pos + n,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed)) {
+            *pos_out = pos;
+            return n;
+        }
+    }
+}
+
+typedef struct {
+    QueueHandle *h;
+    size_t max_len;
+    QueueSlot *slot;
+    uint64_t pos;
+    uint32_t lane;
+} QueueClaim;
+
+// Take the oldest message of the highest lane that has one. A message too
+// big for max_len stops the scan, so lower lanes never overtake it.
+static int queue_try_claim_recv(void *arg) {
+    QueueClaim *c = (QueueClaim *)arg;
+    QueueHandle *h = c->h;
+    for (uint32_t lane = h->nlanes; lane-- > 0;) {
+        c->slot = queue_claim_recv(h, lane, c->max_len, &c->pos);
+        if (c->slot) {
+            c->lane = lane;
+            return 0;
+        }
+        if (errno != EAGAIN) return -1;
+    }
+    return -1;
+}
+
+// Like queue_claim_recv across all lanes, but spins and then sleeps until a
+// message arrives or the deadline passes
+static QueueSlot *queue_wait_recv(QueueHandle *h, size_t max_len, uint64_t *pos_out,
+                                  uint32_t *lane_out, uint64_t deadline) {
+    QueueClaim c = { .h = h, .max_len = max_len };
+    if (queue_try_claim_recv(&c) == -1) {
+        if (errno != EAGAIN || deadline == IPC_NO_WAIT) return NULL;
+        if (shm_wait_until(&h->hdr->wq, h->spins, queue_try_claim_recv, &c, deadline) == -1) {
+            return NULL;
+        }
+    }
+    *pos_out = c.pos;
+    *lane_out = c.lane;
+    return c.slot;
+}
+
+static inline unsigned char *queue_payload(QueueSlot *slot) {
+    return (unsigned char *)slot + QUEUE_SLOT_HDR;
+}
+
+static int queue_send(QueueHandle *h, const void *data, size_t len, uint32_t lane) {
+    if (len > h->msg_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    uint64_t pos;
+    QueueSlot *slot = queue_claim_send(h, lane, &pos);
+    if (!slot) return -1;
+    slot->len = (uint32_t)len;
+    memcpy(queue_payload(slot), data, len);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    shm_wait_wake(&h->hdr->wq, &h->bell, 1);
+    return 0;
+}
+
+static int queue_recv(QueueHandle *h, void *buf, size_t len, uint32_t *lane, uint64_t deadline) {
+    uint64_t pos;
+    QueueSlot *slot = queue_wait_recv(h, len, &pos, lane, deadline);
+    if (!slot) return -1;
+    uint32_t msg_len = slot->len;
+    memcpy(buf, queue_payload(slot), msg_len);
+    atomic_store_explicit(&slot->seq, pos + h->mask + 1, memory_order_release);
+    return (int)msg_len;
+}
+
+static int ipc_send_shm_queue(IPC_Handle handle, const void *data, size_t len) {
+    return queue_send((QueueHandle *)handle, data, len, 0);
+}
+
+static int ipc_recv_shm_queue(IPC_Handle handle, void *buf, size_t len) {
+    QueueHandle *h = (QueueHandle *)handle;
+    uint32_t lane;
+    return queue_recv(h, buf, len, &lane, h->wait);
+}
+
+static int ipc_recv_timed_shm_queue(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    uint32_t lane;
+    return queue_recv((QueueHandle *)handle, buf, len, &lane, ipc_deadline(timeout_ms));
+}
+
+static int ipc_send_prio_shm_queue(IPC_Handle handle, const void *data, size_t len,
+                                   unsigned prio) {
+    QueueHandle *h = (QueueHandle *)handle;
+    if (prio >= h->nlanes) {
+        errno = EINVAL;
+        return -1;
+    }
+    return queue_send(h, data, len, prio);
+}
+
+static int ipc_recv_prio_shm_queue(IPC_Handle handle, void *buf, size_t len, unsigned *prio) {
+    QueueHandle *h = (QueueHandle *)handle;
+    uint32_t lane;
+    int ret = queue_recv(h, buf, len, &lane, h->wait);
+    if (ret != -1) *prio = lane;
+    return ret;
+}
+
+// Batches go out at the lowest priority
+static int ipc_send_batch_shm_queue(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    QueueHandle *h = (QueueHandle *)handle;
+    size_t sent = 0;
+    while (sent < count) {
+        size_t want = 0;
+        while (sent + want < count && msgs[sent + want].len <= h->msg_size) want++;
+        if (want == 0) {
+            errno = EMSGSIZE;
+            break;
+        }
+        uint64_t pos;
+        size_t n = queue_claim_send_n(h, 0, want, &pos);
+        if (n == 0) break;
+        for (size_t i = 0; i < n; i++) {
+            QueueSlot *slot = queue_slot(h, 0, pos + i);
+            slot->len = (uint32_t)msgs[sent + i].len;
+            memcpy(queue_payload(slot), msgs[sent + i].data, msgs[sent + i].len);
+            atomic_store_explicit(&slot->seq, pos + i + 1, memory_order_release);
+        }
+        sent += n;
+        shm_wait_wake(&h->hdr->wq, &h->bell, (int)n);
+    }
+    return sent ? (int)sent : -1;
+}
+
+// Waits for the first message, then takes whatever else is already queued,
+// highest lane first
+static int ipc_recv_batch_shm_queue(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    QueueHandle *h = (QueueHandle *)handle;
+    uint32_t first;
+    int ret = queue_recv(h, msgs[0].data, msgs[0].len, &first, h->wait);
+    if (ret == -1) return -1;
+    msgs[0].len = ret;
+
+    size_t got = 1;
+    for (uint32_t lane = h->nlanes; lane-- > 0 && got < count;) {
+        uint64_t pos;
+        size_t n = queue_claim_recv_n(h, lane, msgs + got, count - got, &pos);
+        for (size_t i = 0; i < n; i++) {
+            QueueSlot *slot = queue_slot(h, lane, pos + i);
+            msgs[got + i].len = slot->len;
+            memcpy(msgs[got + i].data, queue_payload(slot), slot->len);
+            atomic_store_explicit(&slot->seq, pos + i + h->mask + 1, memory_order_release);
+        }
+        got += n;
+    }
+    return (int)got;
+}
+
+static int ipc_send_reserve_shm_queue(IPC_Handle handle, size_t len, void **ptr) {
+    QueueHandle *h = (QueueHandle *)handle;
+    if (h->send_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (len > h->msg_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    QueueSlot *slot = queue_claim_send(h, 0, &h->send_pos);
+    if (!slot) return -1;
+    slot->len = (uint32_t)len;
+    h->send_loan = slot;
+    *ptr = queue_payload(slot);
+    return 0;
+}
+
+static int ipc_send_commit_shm_queue(IPC_Handle handle, void *ptr) {
+    QueueHandle *h = (QueueHandle *)handle;
+    if (!h->send_loan || ptr != queue_payload(h->send_loan)) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store_explicit(&h->send_loan->seq, h->send_pos + 1, memory_order_release);
+    h->send_loan = NULL;
+    shm_wait_wake(&h->hdr->wq, &h->bell, 1);
+    return 0;
+}
+
+static int ipc_recv_acquire_shm_queue(IPC_Handle handle, void **ptr, size_t *len) {
+    QueueHandle *h = (QueueHandle *)handle;
+    if (h->recv_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    uint32_t lane;
+    QueueSlot *slot = queue_wait_recv(h, h->msg_size, &h->recv_pos, &lane, h->wait);
+    if (!slot) return -1;
+    h->recv_loan = slot;
+    *ptr = queue_payload(slot);
+    *len = slot->len;
+    return 0;
+}
+
+static int ipc_recv_release_shm_queue(IPC_Handle handle, void *ptr) {
+    QueueHandle *h = (QueueHandle *)handle;
+    if (!h->recv_loan || ptr != queue_payload(h->recv_loan)) {
+        errno = EINVAL;
+        return -1;
+    }
+    atomic_store_explicit(&h->recv_loan->seq, h->recv_pos + h->mask + 1,
+                          memory_order_release);
+    h->recv_loan = NULL;
+    return 0;
+}
+
+static int get_fd_shm_queue(IPC_Handle handle) {
+    QueueHandle *h = (QueueHandle *)handle;
+    return shm_doorbell_fd(&h->bell);
+}
+
+// With several consumers this is only a hint: another one may take the
+// message first
+static int queue_readable(QueueHandle *h) {
+    for (uint32_t lane = 0; lane < h->nlanes; lane++) {
+        uint64_t pos = atomic_load_explicit(&h->lanes[lane].dequeue_pos, memory_order_relaxed);
+        QueueSlot *slot = queue_slot(h, lane, pos);
+        if (atomic_load_explicit(&slot->seq, memory_order_acquire) == pos + 1) return 1;
+    }
+    return 0;
+}
+
+
+static int poll_arm_shm_queue(IPC_Handle handle) {
+    QueueHandle *h = (QueueHandle *)handle;
+    if (shm_wait_arm(&h->hdr->wq, &h->bell) == -1) return -1;
+    if (!queue_readable(h)) return 0;
+    shm_wait_disarm(&h->hdr->wq, &h->bell);
+    return 1;
+}
+
+static int poll_disarm_shm_queue(IPC_Handle handle) {
+    QueueHandle *h = (QueueHandle *)handle;
+    shm_wait_disarm(&h->hdr->wq, &h->bell);
+    return queue_readable(h);
+}
+
+static void close_shm_queue(IPC_Handle handle) {
+    QueueHandle *h = (QueueHandle *)handle;
+    if (!h) return;
+    shm_doorbell_close(&h->bell, h->seg.owner);
+    shm_segment_close(&h->seg);
+    free(h);
+}
+
+const IPC_TransportOps ipc_shm_queue_ops = {
+    .init = init_shm_queue,
+    .send = ipc_send_shm_queue,
+    .recv = ipc_recv_shm_queue,
+    .close = close_shm_queue,
+    .send_batch = ipc_send_batch_shm_queue,
+    .recv_batch = ipc_recv_batch_shm_queue,
+    .send_reserve = ipc_send_reserve_shm_queue,
+    .send_commit = ipc_send_commit_shm_queue,
+    .recv_acquire = ipc_recv_acquire_shm_queue,
+    .recv_release = ipc_recv_release_shm_queue,
+    .get_fd = get_fd_shm_queue,
+    .poll_arm = poll_arm_shm_queue,
+    .poll_disarm = poll_disarm_shm_queue,
+    .recv_timed = ipc_recv_timed_shm_queue,
+    .send_prio = ipc_send_prio_shm_queue,
+    .recv_prio = ipc_recv_prio_shm_queue,
+};
@@ -0,0 +1,379 @@
+#include "ipc_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+// Single-producer/single-consumer ring of variable-length records.
+// Positions are free-running byte counters; the data area is a power of two
+// so a position maps to an offset with a mask. Each record is an 8-byte
+// header holding the payload length followed by the payload, padded to 8
+// bytes. A record never straddles the end of the data area: when it does not
+// fit, the producer writes a wrap marker and continues at offset 0. Records
+// are limited to half the data area so that one always fits after a wrap.
+
+#define RING_REC_HDR 8
+#define RING_WRAP 0xFFFFFFFFu
+#define RING_MIN_CAPACITY 64
+
+typedef struct {
+    // Written by the producer only
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t head;
+    // Written by the consumer only
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t tail;
+    // Where an idle consumer sleeps
+    ShmWaitQueue wq;
+    // Written once by the creator
+    _Alignas(IPC_CACHELINE) uint64_t capacity;
+} RingHeader;
+
+typedef struct {
+    ShmSegment seg;
+    ShmDoorbell bell;
+    RingHeader *hdr;
+    unsigned char *data;
+    uint64_t mask;
+    // Process-local copies of the peer's index, refreshed only when the ring
+    // looks full (producer) or empty (consumer).
+    uint64_t cached_tail;
+    uint64_t cached_head;
+    // Outstanding zero-copy loans and the index each one publishes
+    unsigned char *send_loan;
+    uint64_t send_next;
+    unsigned char *recv_loan;
+    uint64_t recv_next;
+    uint32_t spins;
+    uint64_t wait;  // Deadline of the plain receive calls
+} RingHandle;
+
+static inline uint64_t ring_align(uint64_t n) {
+    return (n + 7) & ~(uint64_t)7;
+}
+
+static uint64_t ring_capacity(uint32_t size) {
+    uint64_t cap = RING_MIN_CAPACITY;
+    while (cap < size) cap <<= 1;
+    return cap;
+}
+
+static void ring_init(void *mem, size_t size, void *arg) {
+    (void)arg;
+    RingHeader *hdr = (RingHeader *)mem;
+    atomic_init(&hdr->head, 0);
+    atomic_init(&hdr->tail, 0);
+    shm_wait_init(&hdr->wq);
+    hdr->capacity = size - sizeof(RingHeader);
+}
+
+static IPC_Handle init_shm_ring(const IPC_Config *config) {
+    RingHandle *h = malloc(sizeof(RingHandle));
+    if (!h) return NULL;
+
+    size_t size = sizeof(RingHeader) + ring_capacity(config->size);
+    if (shm_segment_open(&h->seg, config, size, ring_init, NULL) == -1) {
+        free(h);
+        return NULL;
+    }
+    h->hdr = (RingHeader *)h->seg.mem;
+    if (sizeof(RingHeader) + h->hdr->capacity != h->seg.size) {
+        shm_segment_close(&h->seg);
+        free(h);
+        errno = EPROTO;
+        return NULL;
+    }
+    if (shm_doorbell_init(&h->bell, &h->seg) == -1) {
+        shm_segment_close(&h->seg);
+        free(h);
+        return NULL;
+    }
+    h->data = (unsigned char *)(h->hdr + 1);
+    h->mask = h->hdr->capacity - 1;
+    h->cached_head = atomic_load_explicit(&h->hdr->head, memory_order_acquire);
+    h->cached_tail = atomic_load_explicit(&h->hdr->tail, memory_order_acquire);
+    h->send_loan = NULL;
+    h->recv_loan = NULL;
+    h->spins = config->spin_count ? config->spin_count : SHM_SPIN_DEFAULT;
+    h->wait = ipc_default_deadline(config);
+    return (IPC_Handle)h;
+}
+
+// Make room for a record of len bytes at position head and write its
+// header. Returns the payload address; the record becomes visible once the
+// shared head is set to *next.
+static unsigned char *ring_claim(RingHandle *h, uint64_t head, size_t len, uint64_t *next) {
+    uint64_t cap = h->mask + 1;
+    uint64_t rec = ring_align(RING_REC_HDR + len);
+    if (rec > cap / 2 || len >= RING_WRAP) {
+        errno = EMSGSIZE;
+        return NULL;
+    }
+
+    uint64_t off = head & h->mask;
+    uint64_t to_end = cap - off;
+    uint64_t need = to_end < rec ? to_end + rec : rec;
+    if (need > cap - (head - h->cached_tail)) {
+        h->cached_tail = atomic_load_explicit(&h->hdr->tail, memory_order_acquire);
+        if (need > cap - (head - h->cached_tail)) {
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    if (to_end < rec) {
+        *(uint32_t *)(h->data + off) = RING_WRAP;
+        head += to_end;
+        off = 0;
+    }
+    *(uint32_t *)(h->data + off) = (uint32_t)len;
+    *next = head + rec;
+    return h->data + off + RING_REC_HDR;
+}
+
+// Find the record at position tail. Returns its payload address and
+// length; the record is released once the shared tail is set to *next.
+static unsigned char *ring_peek(RingHandle *h, uint64_t tail, uint32_t *len, uint64_t *next) {
+    if (tail == h->cached_head) {
+        h->cached_head = atomic_load_explicit(&h->hdr->head, memory_order_acquire);
+        if (tail == h->cached_head) {
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    uint64_t off = tail & h->mask;
+    uint32_t msg_len = *(uint32_t *)(h->data + off);
+    if (msg_len == RING_WRAP) {
+        // The wrapped record is published together with the marker
+        tail += h->mask + 1 - off;
+        off = 0;
+        msg_len = *(uint32_t *)(h->data + off);
+    }
+    *len = msg_len;
+    *next = tail + ring_align(RING_REC_HDR + msg_len);
+    return h->data + off + RING_REC_HDR;
+}
+
+typedef struct {
+    RingHandle *h;
+    unsigned char *p;
+    uint32_t len;
+    uint64_t next;
+} RingPeek;
+
+static int ring_try_peek(void *arg) {
+    RingPeek *pk = (RingPeek *)arg;
+    uint64_t tail = atomic_load_explicit(&pk->h->hdr->tail, memory_order_relaxed);
+    pk->p = ring_peek(pk->h, tail, &pk->len, &pk->next);
+    return pk->p ? 0 : -1;
+}
+
+// Like ring_peek, but spins and then sleeps until a record arrives or the
+// deadline passes
+static unsigned char *ring_wait_peek(RingHandle *h, uint32_t *len, uint64_t *next,
+                                     uint64_t deadline) {
+    RingPeek pk = { .h = h };
+    if (ring_try_peek(&pk) == -1) {
+        if (errno != EAGAIN || deadline == IPC_NO_WAIT) return NULL;
+        if (shm_wait_until(&h->hdr->wq, h->spins, ring_try_peek, &pk, deadline) == -1) return NULL;
+    }
+    *len = pk.len;
+    *next = pk.next;
+    return pk.p;
+}
+
+static int ipc_send_shm_ring(IPC_Handle handle, const void *data, size_t len) {
+    RingHandle *h = (RingHandle *)handle;
+    if (h->send_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    uint64_t next;
+    uint64_t head = atomic_load_explicit(&h->hdr->head, memory_order_relaxed);
+    unsigned char *p = ring_claim(h, head, len, &next);
+    if (!p) return -1;
+    memcpy(p, data, len);
+    atomic_store_explicit(&h->hdr->head, next, memory_order_release);
+    shm_wait_wake(&h->hdr->wq, &h->bell, 1);
+    return 0;
+}
+
+static int ring_recv(RingHandle *h, void *buf, size_t len, uint64_t deadline) {
+    if (h->recv_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    uint32_t msg_len;
+    uint64_t next;
+    unsigned char *p = ring_wait_peek(h, &msg_len, &next, deadline);
+    if (!p) return -1;
+    if (msg_len > len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buf, p, msg_len);
+    atomic_store_explicit(&h->hdr->tail, next, memory_order_release);
+    return (int)msg_len;
+}
+
+static int ipc_recv_shm_ring(IPC_Handle handle, void *buf, size_t len) {
+    RingHandle *h = (RingHandle *)handle;
+    return ring_recv(h, buf, len, h->wait);
+}
+
+static int ipc_recv_timed_shm_ring(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    return ring_recv((RingHandle *)handle, buf, len, ipc_deadline(timeout_ms));
+}
+
+// All records of a batch are written first and published with one store
+static int ipc_send_batch_shm_ring(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    RingHandle *h = (RingHandle *)handle;
+    if (h->send_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    uint64_t head = atomic_load_explicit(&h->hdr->head, memory_order_relaxed);
+    size_t sent;
+    for (sent = 0; sent < count; sent++) {
+        uint64_t next;
+        unsigned char *p = ring_claim(h, head, msgs[sent].len, &next);
+        if (!p) break;
+        memcpy(p, msgs[sent].data, msgs[sent].len);
+        head = next;
+    }
+    if (sent == 0) return -1;
+    atomic_store_explicit(&h->hdr->head, head, memory_order_release);
+    shm_wait_wake(&h->hdr->wq, &h->bell, 1);
+    return (int)sent;
+}
+
+// Waits for the first record, then takes whatever else is already there and
+// releases all of them with one store
+static int ipc_recv_batch_shm_ring(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    RingHandle *h = (RingHandle *)handle;
+    if (h->recv_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    uint32_t msg_len;
+    uint64_t tail;
+    unsigned char *p = ring_wait_peek(h, &msg_len, &tail, h->wait);
+    if (!p) return -1;
+    if (msg_len > msgs[0].len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(msgs[0].data, p, msg_len);
+    msgs[0].len = msg_len;
+
+    size_t got;
+    for (got = 1; got < count; got++) {
+        uint64_t next;
+        p = ring_peek(h, tail, &msg_len, &next);
+        if (!p || msg_len > msgs[got].len) break;
+        memcpy(msgs[got].data, p, msg_len);
+        msgs[got].len = msg_len;
+        tail = next;
+    }
+    atomic_store_explicit(&h->hdr->tail, tail, memory_order_release);
+    return (int)got;
+}
+
+static int ipc_send_reserve_shm_ring(IPC_Handle handle, size_t len, void **ptr) {
+    RingHandle *h = (RingHandle *)handle;
+    if (h->send_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    uint64_t head = atomic_load_explicit(&h->hdr->head, memory_order_relaxed);
+    unsigned char *p = ring_claim(h, head, len, &h->send_next);
+    if (!p) return -1;
+    h->send_loan = p;
+    *ptr = p;
+    return 0;
+}
+
+static int ipc_send_commit_shm_ring(IPC_Handle handle, void *ptr) {
+    RingHandle *h = (RingHandle *)handle;
+    if (!h->send_loan || ptr != h->send_loan) {
+        errno = EINVAL;
+        return -1;
+    }
+    h->send_loan = NULL;
+    atomic_store_explicit(&h->hdr->head, h->send_next, memory_order_release);
+    shm_wait_wake(&h->hdr->wq, &h->bell, 1);
+    return 0;
+}
+
+static int ipc_recv_acquire_shm_ring(IPC_Handle handle, void **ptr, size_t *len) {
+    RingHandle *h = (RingHandle *)handle;
+    if (h->recv_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    uint32_t msg_len;
+    unsigned char *p = ring_wait_peek(h, &msg_len, &h->recv_next, h->wait);
+    if (!p) return -1;
+    h->recv_loan = p;
+    *ptr = p;
+    *len = msg_len;
+    return 0;
+}
+
+static int ipc_recv_release_shm_ring(IPC_Handle handle, void *ptr) {
+    RingHandle *h = (RingHandle *)handle;
+    if (!h->recv_loan || ptr != h->recv_loan) {
+        errno = EINVAL;
+        return -1;
+    }
+    h->recv_loan = NULL;
+    atomic_store_explicit(&h->hdr->tail, h->recv_next, memory_order_release);
+    return 0;
+}
+
+static int get_fd_shm_ring(IPC_Handle handle) {
+    RingHandle *h = (RingHandle *)handle;
+    return shm_doorbell_fd(&h->bell);
+}
+
+static int ring_readable(RingHandle *h) {
+    uint64_t tail = atomic_load_explicit(&h->hdr->tail, memory_order_relaxed);
+    return atomic_load_explicit(&h->hdr->head, memory_order_acquire) != tail;
+}
+
+static int poll_arm_shm_ring(IPC_Handle handle) {
+    RingHandle *h = (RingHandle *)handle;
+    if (shm_wait_arm(&h->hdr->wq, &h->bell) == -1) return -1;
+    if (!ring_readable(h)) return 0;
+    shm_wait_disarm(&h->hdr->wq, &h->bell);
+    return 1;
+}
+
+static int poll_disarm_shm_ring(IPC_Handle handle) {
+    RingHandle *h = (RingHandle *)handle;
+    shm_wait_disarm(&h->hdr->wq, &h->bell);
+    return ring_readable(h);
+}
+
+static void close_shm_ring(IPC_Handle handle) {
+    RingHandle *h = (RingHandle *)handle;
+    if (!h) return;
+    shm_doorbell_close(&h->bell, h->seg.owner);
+    shm_segment_close(&h->seg);
+    free(h);
+}
+
+const IPC_TransportOps ipc_shm_ring_ops = {
+    .init = init_shm_ring,
+    .send = ipc_send_shm_ring,
+    .recv = ipc_recv_shm_ring,
+    .close = close_shm_ring,
+    .send_batch = ipc_send_batch_shm_ring,
+    .recv_batch = ipc_recv_batch_shm_ring,
+    .send_reserve = ipc_send_reserve_shm_ring,
+    .send_commit = ipc_send_commit_shm_ring,
+    .recv_acquire = ipc_recv_acquire_shm_ring,
+    .recv_release = ipc_recv_release_shm_ring,
+    .get_fd = get_fd_shm_ring,
+    .poll_arm = poll_arm_shm_ring,
+    .poll_disarm = poll_disarm_shm_ring,
+    .recv_timed = ipc_recv_timed_shm_ring,
+};
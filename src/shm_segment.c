@@ -0,0 +1,222 @@
+#include "ipc_internal.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#define SEGMENT_ATTACH_RETRIES 1000
+#define HUGETLBFS_DEFAULT_DIR "/dev/hugepages"
+
+// hugetlbfs has no shm_open equivalent, so segments become files named
+// after the segment with '/' mapped to '_', like the doorbell FIFOs
+int shm_backing_open(const char *name, int oflag, const IPC_ShmOptions *opts, char **path) {
+    *path = NULL;
+    if (!opts || !opts->huge_pages) return shm_open(name, oflag, 0666);
+
+    const char *dir = opts->huge_dir ? opts->huge_dir : HUGETLBFS_DEFAULT_DIR;
+    size_t dlen = strlen(dir), nlen = strlen(name);
+    char *p = malloc(dlen + sizeof("/ipc") + nlen);
+    if (!p) return -1;
+    memcpy(p, dir, dlen);
+    memcpy(p + dlen, "/ipc", 4);
+    for (size_t i = 0; i <= nlen; i++) {
+        p[dlen + 4 + i] = name[i] == '/' ? '_' : name[i];
+    }
+    int fd = open(p, oflag | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        free(p);
+        return -1;
+    }
+    *path = p;
+    return fd;
+}
+
+int shm_backing_unlink(const char *name, const char *path) {
+    return path ? unlink(path) : shm_unlink(name);
+}
+
+size_t shm_backing_size(int fd, size_t len, const char *path) {
+    struct statvfs st;
+    if (!path || fstatvfs(fd, &st) == -1 || st.f_bsize == 0) return len;
+    return (len + st.f_bsize - 1) / st.f_bsize * st.f_bsize;
+}
+
+int shm_map_tune(void *mem, size_t len, const IPC_ShmOptions *opts) {
+    if (!opts) return 0;
+#ifdef __linux__
+    // Bind before anything is faulted in so the pages are allocated on the
+    // requested nodes; MPOL_MF_MOVE migrates pages another process already
+    // touched. On a shared mapping the policy sticks to the object.
+    if (opts->numa_nodes) {
+        unsigned long mask = opts->numa_nodes;
+        if (syscall(SYS_mbind, mem, len, MPOL_BIND, &mask, sizeof(mask) * 8,
+                    MPOL_MF_MOVE) == -1) {
+            return -1;
+        }
+    }
+#endif
+    if (opts->populate) {
+        int done = 0;
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(mem, len, MADV_POPULATE_WRITE) == 0) {
+            done = 1;
+        } else if (errno != EINVAL) {
+            return -1;
+        }
+#endif
+        if (!done) {
+            // Older kernels: a read fault allocates the page for shared
+            // file mappings without changing its contents
+            long page = sysconf(_SC_PAGESIZE);
+            for (size_t off = 0; off < len; off += page) {
+                (void)*(volatile unsigned char *)((unsigned char *)mem + off);
+            }
+        }
+    }
+    if (opts->lock && mlock(mem, len) == -1) return -1;
+    return 0;
+}
+
+// Wait for the creator to size and initialize the segment, then map it.
+static int segment_attach(ShmSegment *seg, int fd, const IPC_Config *config) {
+    for (int i = 0; i < SEGMENT_ATTACH_RETRIES; i++) {
+        struct stat st;
+        if (fstat(fd, &st) == -1) return -1;
+        if ((size_t)st.st_size > sizeof(ShmSegmentHeader)) {
+            void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (mem == MAP_FAILED) return -1;
+            ShmSegmentHeader *hdr = (ShmSegmentHeader *)mem;
+            if (atomic_load_explicit(&hdr->ready, memory_order_acquire)) {
+                if (hdr->magic != SHM_MAGIC || hdr->version != SHM_LAYOUT_VERSION ||
+                    hdr->mech != (uint32_t)config->mech) {
+                    munmap(mem, st.st_size);
+                    errno = EPROTO;
+                    return -1;
+                }
+                uint64_t need = sizeof(ShmSegmentHeader) + hdr->size;
+                if (seg->path ? need > (uint64_t)st.st_size : need != (uint64_t)st.st_size) {
+                    munmap(mem, st.st_size);
+                    errno = EPROTO;
+                    return -1;
+                }
+                if (shm_map_tune(mem, st.st_size, config->shm_opts) == -1) {
+                    int err = errno;
+                    munmap(mem, st.st_size);
+                    errno = err;
+                    return -1;
+                }
+                seg->hdr = hdr;
+                seg->map_size = st.st_size;
+                return 0;
+            }
+            munmap(mem, st.st_size);
+        }
+        usleep(1000);
+    }
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+// Recorded for the doorbell FIFO, which copies them
+static void segment_note_owner(ShmSegment *seg, int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        seg->uid = st.st_uid;
+        seg->mode = st.st_mode & 0777;
+    } else {
+        seg->uid = geteuid();
+        seg->mode = 0600;
+    }
+}
+
+int shm_segment_open(ShmSegment *seg, const IPC_Config *config, size_t size,
+                     ShmSegmentInit init, void *arg) {
+    const char *name = config->name;
+    const IPC_ShmOptions *opts = config->shm_opts;
+    uint32_t mode = config->flags & (IPC_CREATE | IPC_ATTACH);
+    if (strlen(name) > 255 || mode == (IPC_CREATE | IPC_ATTACH)) {
+        errno = EINVAL;
+        return -1;
+    }
+    seg->name = strdup(name);
+    if (!seg->name) return -1;
+
+    // The first process creates and initializes the segment, later ones attach
+    int fd = -1;
+    if (mode != IPC_ATTACH) {
+        fd = shm_backing_open(name, O_CREAT | O_RDWR | O_EXCL, opts, &seg->path);
+    } else {
+        errno = EEXIST;
+    }
+    if (fd != -1) {
+        seg->owner = 1;
+        segment_note_owner(seg, fd);
+        seg->map_size = shm_backing_size(fd, sizeof(ShmSegmentHeader) + size, seg->path);
+        if (ftruncate(fd, seg->map_size) == -1) {
+            close(fd);
+            goto fail_unlink;
+        }
+        void *mem = mmap(NULL, seg->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mem == MAP_FAILED) goto fail_unlink;
+        if (shm_map_tune(mem, seg->map_size, opts) == -1) {
+            munmap(mem, seg->map_size);
+            goto fail_unlink;
+        }
+        seg->hdr = (ShmSegmentHeader *)mem;
+        seg->hdr->magic = SHM_MAGIC;
+        seg->hdr->version = SHM_LAYOUT_VERSION;
+        seg->hdr->mech = config->mech;
+        seg->hdr->size = size;
+        if (init) init(seg->hdr + 1, size, arg);
+        atomic_store_explicit(&seg->hdr->ready, 1, memory_order_release);
+    } else if (errno == EEXIST && mode != IPC_CREATE) {
+        fd = shm_backing_open(name, O_RDWR, opts, &seg->path);
+        if (fd == -1) {
+            free(seg->name);
+            return -1;
+        }
+        seg->owner = 0;
+        segment_note_owner(seg, fd);
+        int ret = segment_attach(seg, fd, config);
+        int err = errno;
+        close(fd);
+        if (ret == -1) {
+            free(seg->path);
+            free(seg->name);
+            errno = err;
+            return -1;
+        }
+    } else {
+        free(seg->name);
+        return -1;
+    }
+
+    seg->mem = seg->hdr + 1;
+    seg->size = seg->hdr->size;
+    return 0;
+
+fail_unlink: {
+        int err = errno;
+        shm_backing_unlink(name, seg->path);
+        free(seg->path);
+        free(seg->name);
+        errno = err;
+        return -1;
+    }
+}
+
+void shm_segment_close(ShmSegment *seg) {
+    munmap(seg->hdr, seg->map_size);
+    if (seg->owner) shm_backing_unlink(seg->name, seg->path);
+    free(seg->path);
+    free(seg->name);
+}
@@ -0,0 +1,163 @@
+#include "ipc_internal.h"
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Not FUTEX_PRIVATE: the word lives in memory shared between processes.
+// timeout is relative, NULL to wait until woken.
+static void futex_wait(atomic_uint *addr, unsigned int val, const struct timespec *timeout) {
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr, int count) {
+    syscall(SYS_futex, addr, FUTEX_WAKE, count, NULL, NULL, 0);
+}
+#else
+static void futex_wait(atomic_uint *addr, unsigned int val, const struct timespec *timeout) {
+    (void)addr;
+    (void)val;
+    (void)timeout;
+    usleep(50);
+}
+
+static void futex_wake(atomic_uint *addr, int count) {
+    (void)addr;
+    (void)count;
+}
+#endif
+
+void shm_wait_init(ShmWaitQueue *wq) {
+    atomic_init(&wq->seq, 0);
+    atomic_init(&wq->waiters, 0);
+    atomic_init(&wq->pollers, 0);
+}
+
+int shm_wait_until(ShmWaitQueue *wq, uint32_t spins, ShmTryFn try, void *arg,
+                   uint64_t deadline) {
+    int ret;
+    if (deadline == IPC_NO_WAIT) return try(arg);
+    for (uint32_t i = 0; i < spins; i++) {
+        ret = try(arg);
+        if (ret >= 0 || errno != EAGAIN) return ret;
+        IPC_CPU_RELAX();
+    }
+
+    for (;;) {
+        atomic_fetch_add_explicit(&wq->waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        unsigned int seq = atomic_load_explicit(&wq->seq, memory_order_acquire);
+        ret = try(arg);
+        if (ret >= 0 || errno != EAGAIN) {
+            atomic_fetch_sub_explicit(&wq->waiters, 1, memory_order_relaxed);
+            return ret;
+        }
+        struct timespec ts, *timeout = NULL;
+        if (deadline != IPC_NO_DEADLINE) {
+            uint64_t left = ipc_deadline_left(deadline);
+            if (left == 0) {
+                atomic_fetch_sub_explicit(&wq->waiters, 1, memory_order_relaxed);
+                return ipc_expired(deadline);
+            }
+            ts.tv_sec = left / 1000000000u;
+            ts.tv_nsec = left % 1000000000u;
+            timeout = &ts;
+        }
+        // Returns at once if a sender bumped seq after it was read above
+        ipc_stat_syscall();
+        uint64_t t0 = ipc_stat_block_begin();
+        futex_wait(&wq->seq, seq, timeout);
+        ipc_stat_block_end(t0);
+        atomic_fetch_sub_explicit(&wq->waiters, 1, memory_order_relaxed);
+        ret = try(arg);
+        if (ret >= 0 || errno != EAGAIN) return ret;
+    }
+}
+
+void shm_wait_wake_slow(ShmWaitQueue *wq, ShmDoorbell *bell, int count) {
+    atomic_fetch_add_explicit(&wq->seq, 1, memory_order_release);
+    ipc_stat_syscall();
+    futex_wake(&wq->seq, count);
+    if (atomic_load_explicit(&wq->pollers, memory_order_relaxed)) {
+        // EAGAIN only means the pipe is already full of rings
+        int fd = shm_doorbell_fd(bell);
+        if (fd != -1) {
+            ipc_stat_syscall();
+            ssize_t ret = write(fd, "", 1);
+            (void)ret;
+        }
+    }
+}
+
+int shm_wait_arm(ShmWaitQueue *wq, ShmDoorbell *bell) {
+    if (shm_doorbell_fd(bell) == -1) return -1;
+    atomic_fetch_add_explicit(&wq->pollers, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&wq->waiters, 1, memory_order_relaxed);
+    // Pairs with the fence in shm_wait_wake, as in shm_wait_until
+    atomic_thread_fence(memory_order_seq_cst);
+    return 0;
+}
+
+void shm_wait_disarm(ShmWaitQueue *wq, ShmDoorbell *bell) {
+    atomic_fetch_sub_explicit(&wq->waiters, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&wq->pollers, 1, memory_order_relaxed);
+    char buf[64];
+    while (read(bell->fd, buf, sizeof(buf)) > 0) {}
+}
+
+// The FIFO sits beside POSIX shm objects, named after the segment with '/'
+// mapped to '_'. /dev/shm is world-writable like /tmp, so the name may have
+// been taken by someone else first: the FIFO is opened without following
+// links and checked before use.
+#ifdef __linux__
+#define SHM_BELL_PREFIX "/dev/shm/ipc-bell"
+#else
+#define SHM_BELL_PREFIX "/tmp/ipc-bell"
+#endif
+
+int shm_doorbell_init(ShmDoorbell *bell, const ShmSegment *seg) {
+    static const char prefix[] = SHM_BELL_PREFIX;
+    size_t len = strlen(seg->name);
+    bell->fd = -1;
+    bell->uid = seg->uid;
+    bell->mode = seg->mode;
+    bell->path = malloc(sizeof(prefix) + len);
+    if (!bell->path) return -1;
+    memcpy(bell->path, prefix, sizeof(prefix) - 1);
+    for (size_t i = 0; i <= len; i++) {
+        bell->path[sizeof(prefix) - 1 + i] = seg->name[i] == '/' ? '_' : seg->name[i];
+    }
+    return 0;
+}
+
+int shm_doorbell_fd(ShmDoorbell *bell) {
+    if (bell->fd != -1) return bell->fd;
+    if (mkfifo(bell->path, bell->mode) == -1 && errno != EEXIST) return -1;
+    int fd = open(bell->path, O_RDWR | O_NONBLOCK | O_CLOEXEC | O_NOFOLLOW);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISFIFO(st.st_mode) ||
+        (st.st_uid != geteuid() && st.st_uid != bell->uid)) {
+        close(fd);
+        errno = EACCES;
+        return -1;
+    }
+    bell->fd = fd;
+    return fd;
+}
+
+void shm_doorbell_close(ShmDoorbell *bell, int unlink_fifo) {
+    if (bell->fd != -1) close(bell->fd);
+    if (unlink_fifo) unlink(bell->path);
+    free(bell->path);
+    bell->fd = -1;
+    bell->path = NULL;
+}
@@ -1,33 +1,372 @@
-#include "ipc.h"
+#define _GNU_SOURCE  // recvmmsg, accept4
+#include "ipc_internal.h"
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#endif
+
+#define SOCK_BATCH 64
+#define SOCK_EVENTS 64
+
+// A connection id is the slot index in the low bits and the slot's
+// generation above it, so ids of closed connections are not reused at once
+#define SOCK_SLOT_BITS 16
+#define SOCK_MAX_CONNS (1u << SOCK_SLOT_BITS)
+
+typedef struct {
+    int fd;        // -1 while the slot is free
+    uint16_t gen;
+    int broken;    // A message was left half-sent; sends fail with EPIPE
+    FrameBuffer rx;
+} SockConn;
 
 typedef struct {
     int sock;
     int client_sock;  // For accepted connections
     char *sock_path;  // For Unix socket cleanup
+    int framed;       // IPC_FRAMED
+    int nonblock;     // IPC_NONBLOCK: the listener and peer are non-blocking
+    uint64_t wait;    // Deadline of the plain calls
+    int broken;       // A message was left half-sent; sends fail with EPIPE
+    FrameBuffer rx;
+    // Options for accepted connections; TCP-only ones are cleared for Unix
+    // sockets so the data path only tests the field
+    IPC_SocketOptions opts;
+    // Zero-copy loans (fd_pass_min): the memfd being filled, and the frame
+    // or mapping lent to the receiver
+    void *send_loan;
+    int send_memfd;
+    size_t send_len;
+    void *recv_loan;
+    size_t recv_map_len;  // Non-zero if recv_loan is a memfd mapping
+    size_t recv_frame;
+    // Multi-client servers (IPC_MULTI_CLIENT)
+    int multi;
+    int epfd;
+    SockConn *conns;
+    uint32_t nconns;    // Slots handed out so far
+    uint32_t conn_cap;
+#ifdef __linux__
+    struct epoll_event events[SOCK_EVENTS];
+#endif
+    int nevents;
+    int next_event;     // Events are handed out one per receive
 } SockHandle;
 
-IPC_Handle init_socket_unix(const IPC_Config *config) {
-    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (sock == -1) return NULL;
+static void close_socket_unix(IPC_Handle handle);
+static int sock_multi_init(SockHandle *h);
 
-    struct sockaddr_un addr = {0};
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, config->name, sizeof(addr.sun_path) - 1);
-    unlink(config->name);
+static int sock_setopt(int fd, int level, int name, int val) {
+    return setsockopt(fd, level, name, &val, sizeof(val));
+}
 
-    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
-        close(sock);
-        return NULL;
+// Apply per-connection options to a freshly accepted socket. Buffer sizes
+// are set on the listener and inherited.
+static void sock_configure(SockHandle *h, int fd) {
+    if (h->opts.nodelay) sock_setopt(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+#ifdef __linux__
+    if (h->opts.quickack) sock_setopt(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+    if (h->opts.busy_poll_us) sock_setopt(fd, SOL_SOCKET, SO_BUSY_POLL, h->opts.busy_poll_us);
+    if (h->opts.zerocopy_min && sock_setopt(fd, SOL_SOCKET, SO_ZEROCOPY, 1) == -1) {
+        h->opts.zerocopy_min = 0;
+    }
+#endif
+}
+
+// Quick ACK mode is not sticky; the kernel may leave it after any receive
+static inline void sock_quickack(SockHandle *h, int fd) {
+#ifdef __linux__
+    if (h->opts.quickack) {
+        ipc_stat_syscall();
+        sock_setopt(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+    }
+#else
+    (void)h;
+    (void)fd;
+#endif
+}
+
+// Under a deadline a send must not sleep in the kernel, even on a blocking
+// socket; waits go through poll instead
+static inline int sock_dontwait(uint64_t deadline) {
+    return deadline == IPC_NO_DEADLINE ? 0 : MSG_DONTWAIT;
+}
+
+// Refuse to send on a stream left mid-message by an earlier send
+static inline int sock_check(int broken) {
+    if (!broken) return 0;
+    errno = EPIPE;
+    return -1;
+}
+
+// Send the rest of a message that has partly gone out, waiting for room
+// until the finish deadline. Failing leaves the reader mid-message, so the
+// stream is marked broken.
+static int sock_send_rest(int fd, const void *data, size_t len, int flags, uint64_t finish,
+                          int *broken) {
+    size_t off = 0;
+    while (off < len) {
+        ipc_stat_syscall();
+        ssize_t ret = send(fd, (const char *)data + off, len - off,
+                           flags | MSG_NOSIGNAL | sock_dontwait(finish));
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            if (ipc_wait_fd_again(fd, POLLOUT, finish) == -1) {
+                *broken = 1;
+                return -1;
+            }
+            continue;
+        }
+        off += ret;
+    }
+    return 0;
+}
+
+// Send all of data, waiting for room on a non-blocking socket until the
+// deadline for the first byte and ipc_finish_deadline for the rest
+static int sock_send_all(int fd, const void *data, size_t len, int flags, uint64_t deadline,
+                         int *broken) {
+    for (;;) {
+        ipc_stat_syscall();
+        ssize_t ret = send(fd, data, len, flags | MSG_NOSIGNAL | sock_dontwait(deadline));
+        if (ret != -1) {
+            if ((size_t)ret == len) return 0;
+            return sock_send_rest(fd, (const char *)data + ret, len - ret, flags,
+                                  ipc_finish_deadline(deadline), broken);
+        }
+        if (errno == EINTR) continue;
+        if (ipc_wait_fd_again(fd, POLLOUT, deadline) == -1) return -1;
+    }
+}
+
+#ifdef __linux__
+// Wait until the kernel has released the pages of `pending` zero-copy
+// sends. Completions arrive on the error queue as ranges of send ids. The
+// bytes are already queued, so the wait runs to the finish deadline; if it
+// passes the pages are still the kernel's and the stream is marked broken.
+static int sock_zc_reap(SockHandle *h, int fd, uint32_t pending, uint64_t finish, int *broken) {
+    char control[256];
+    while (pending) {
+        struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+        ipc_stat_syscall();
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            // Error-queue events are always reported as POLLERR
+            if (ipc_wait_fd(fd, 0, finish) == -1) {
+                if (errno == ETIMEDOUT) *broken = 1;
+                return -1;
+            }
+            continue;
+        }
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err *ee = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            uint32_t done = ee->ee_data - ee->ee_info + 1;
+            pending = done < pending ? pending - done : 0;
+            // The kernel copied after all (loopback does); the notifications
+            // are pure overhead from here on
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) h->opts.zerocopy_min = 0;
+        }
+    }
+    return 0;
+}
+
+static int sock_send_zc(SockHandle *h, int fd, const void *data, size_t len, uint64_t deadline,
+                        int *broken) {
+    if (h->framed) {
+        if (len > UINT32_MAX) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        uint32_t hdr = (uint32_t)len;
+        if (sock_send_all(fd, &hdr, FRAME_HDR, MSG_MORE, deadline, broken) == -1) return -1;
+    }
+
+    // Past the frame header or the first byte the message is under way
+    uint64_t finish = ipc_finish_deadline(deadline);
+    uint32_t issued = 0;
+    size_t off = 0;
+    int ret = (int)len;
+    while (off < len) {
+        int started = h->framed || off;
+        uint64_t wait = started ? finish : deadline;
+        ipc_stat_syscall();
+        ssize_t n = send(fd, (const char *)data + off, len - off,
+                         MSG_ZEROCOPY | MSG_NOSIGNAL | sock_dontwait(wait));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == ENOBUFS) {
+                // Out of option memory for notifications: drain them first
+                if (sock_zc_reap(h, fd, issued, finish, broken) == -1) return -1;
+                issued = 0;
+                continue;
+            }
+            if (ipc_wait_fd_again(fd, POLLOUT, wait) == 0) continue;
+            if (started) *broken = 1;
+            ret = -1;
+            break;
+        }
+        off += n;
+        issued++;
+    }
+    // The pages stay pinned until reaped, even after a failed send
+    int saved = errno;
+    if (sock_zc_reap(h, fd, issued, finish, broken) == -1) return -1;
+    errno = saved;
+    return ret;
+}
+#else
+static int sock_send_zc(SockHandle *h, int fd, const void *data, size_t len, uint64_t deadline,
+                        int *broken) {
+    (void)h;
+    (void)fd;
+    (void)data;
+    (void)len;
+    (void)deadline;
+    (void)broken;
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
+
+#ifdef __linux__
+static int sock_memfd_create(size_t len) {
+    int mfd = memfd_create("ipc-msg", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (mfd == -1) return -1;
+    if (ftruncate(mfd, len) == -1) {
+        close(mfd);
+        return -1;
+    }
+    return mfd;
+}
+
+// Seal the memfd so the receiver can map it without fear of later changes,
+// then pass it along with its marker frame
+static int sock_send_memfd(int fd, int mfd, uint64_t len, uint64_t deadline, int *broken) {
+    if (fcntl(mfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1) {
+        return -1;
+    }
+    unsigned char hdr[FRAME_FD_HDR];
+    uint32_t mark = FRAME_FD_MARK;
+    memcpy(hdr, &mark, FRAME_HDR);
+    memcpy(hdr + FRAME_HDR, &len, sizeof(len));
+
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct iovec iov = { hdr, sizeof(hdr) };
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = control.buf, .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cm), &mfd, sizeof(int));
+
+    for (;;) {
+        ipc_stat_syscall();
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | sock_dontwait(deadline));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (ipc_wait_fd_again(fd, POLLOUT, deadline) == -1) return -1;
+            continue;
+        }
+        // The descriptor went with the first byte; finish the header
+        if ((size_t)n < sizeof(hdr)) {
+            return sock_send_rest(fd, hdr + n, sizeof(hdr) - n, 0, ipc_finish_deadline(deadline),
+                                  broken);
+        }
+        return 0;
+    }
+}
+
+// ipc_send above fd_pass_min: one copy into the memfd instead of two
+// through the socket buffer
+static int sock_send_fd_copy(int fd, const void *data, size_t len, uint64_t deadline,
+                             int *broken) {
+    int mfd = sock_memfd_create(len);
+    if (mfd == -1) return -1;
+    size_t off = 0;
+    while (off < len) {
+        ssize_t n = pwrite(mfd, (const char *)data + off, len - off, off);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            close(mfd);
+            return -1;
+        }
+        off += n;
+    }
+    int ret = sock_send_memfd(fd, mfd, len, deadline, broken);
+    close(mfd);
+    return ret == -1 ? -1 : (int)len;
+}
+#else
+static int sock_memfd_create(size_t len) {
+    (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+static int sock_send_memfd(int fd, int mfd, uint64_t len, uint64_t deadline, int *broken) {
+    (void)fd;
+    (void)mfd;
+    (void)len;
+    (void)deadline;
+    (void)broken;
+    errno = ENOTSUP;
+    return -1;
+}
+
+static int sock_send_fd_copy(int fd, const void *data, size_t len, uint64_t deadline,
+                             int *broken) {
+    (void)fd;
+    (void)data;
+    (void)len;
+    (void)deadline;
+    (void)broken;
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
+
+// Listen on a bound socket and wrap it in a handle
+static IPC_Handle sock_listen(int sock, const IPC_Config *config, const char *path) {
+    IPC_SocketOptions opts = {0};
+    if (config->sock_opts) opts = *config->sock_opts;
+    if (config->mech != IPC_SOCKET_TCP) {
+        opts.nodelay = 0;
+        opts.quickack = 0;
+        opts.zerocopy_min = 0;
     }
-    if (listen(sock, 5) == -1) {
+#ifdef __linux__
+    if (config->mech != IPC_SOCKET_UNIX) opts.fd_pass_min = 0;
+#else
+    opts.fd_pass_min = 0;
+#endif
+    // Set before listen so TCP can pick a matching window scale
+    if ((opts.sndbuf && sock_setopt(sock, SOL_SOCKET, SO_SNDBUF, opts.sndbuf) == -1) ||
+        (opts.rcvbuf && sock_setopt(sock, SOL_SOCKET, SO_RCVBUF, opts.rcvbuf) == -1) ||
+        listen(sock, SOMAXCONN) == -1) {
         close(sock);
         return NULL;
     }
@@ -39,45 +378,616 @@ IPC_Handle init_socket_unix(const IPC_Config *config) {
     }
     h->sock = sock;
     h->client_sock = -1;
-    h->sock_path = strdup(config->name);
-    if (!h->sock_path) {
-        free(h);
-        close(sock);
+    h->sock_path = NULL;
+    h->framed = (config->flags & IPC_FRAMED) || opts.fd_pass_min;
+    h->nonblock = (config->flags & IPC_NONBLOCK) != 0;
+    h->wait = ipc_default_deadline(config);
+    h->broken = 0;
+    frame_buffer_init(&h->rx);
+    h->rx.pass_fds = opts.fd_pass_min != 0;
+    h->opts = opts;
+    h->send_loan = NULL;
+    h->send_memfd = -1;
+    h->recv_loan = NULL;
+    h->multi = 0;
+    h->epfd = -1;
+    h->conns = NULL;
+    h->nconns = 0;
+    h->conn_cap = 0;
+    h->nevents = 0;
+    h->next_event = 0;
+    if (path && !(h->sock_path = strdup(path))) {
+        close_socket_unix(h);
+        return NULL;
+    }
+    if (h->nonblock && fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) == -1) {
+        close_socket_unix(h);
+        return NULL;
+    }
+    if ((config->flags & IPC_MULTI_CLIENT) && sock_multi_init(h) == -1) {
+        close_socket_unix(h);
         return NULL;
     }
     return (IPC_Handle)h;
 }
 
-int ipc_send_socket_unix(IPC_Handle handle, const void *data, size_t len) {
+static IPC_Handle init_socket_unix(const IPC_Config *config) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) return NULL;
+
+    struct sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, config->name, sizeof(addr.sun_path) - 1);
+    unlink(config->name);
+
+    if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(sock);
+        return NULL;
+    }
+    return sock_listen(sock, config, config->name);
+}
+
+// Accept the peer on first use, waiting for it until the deadline.
+// Multi-client servers have no single peer.
+static int sock_peer(SockHandle *h, uint64_t deadline) {
+    if (h->client_sock != -1) return h->client_sock;
+    if (h->multi) {
+        errno = EDESTADDRREQ;
+        return -1;
+    }
+    if (ipc_wait_fd_before(h->sock, POLLIN, h->nonblock, deadline) == -1) return -1;
+    for (;;) {
+        ipc_stat_syscall();
+        uint64_t t0 = ipc_stat_block_begin();
+        int fd = accept(h->sock, NULL, NULL);
+        ipc_stat_block_end(t0);
+        if (fd != -1) {
+            if (h->nonblock && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+                close(fd);
+                return -1;
+            }
+            sock_configure(h, fd);
+            h->client_sock = fd;
+            return fd;
+        }
+        if (ipc_wait_fd_again(h->sock, POLLIN, deadline) == -1) return -1;
+    }
+}
+
+// Wait for room before a zero-copy or memfd send, so a blocking socket does
+// not sleep in the kernel past the deadline before the first byte
+static int sock_wait_room(int fd, uint64_t deadline) {
+    return deadline == IPC_NO_DEADLINE ? 0 : ipc_wait_fd(fd, POLLOUT, deadline);
+}
+
+static int sock_frame_send(SockHandle *h, const IPC_Msg *msgs, size_t count, uint64_t deadline) {
+    if (ipc_wait_fd_before(h->client_sock, POLLOUT, h->nonblock, deadline) == -1) return -1;
+    return frame_send(h->client_sock, 1, msgs, count, deadline, &h->broken);
+}
+
+// Buffered frames are handed out without waiting on the socket
+static int sock_frame_recv(SockHandle *h, IPC_Msg *msgs, size_t count, uint64_t deadline) {
+    if (h->recv_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    for (;;) {
+        if (!frame_ready(&h->rx) &&
+            ipc_wait_fd_before(h->client_sock, POLLIN, h->nonblock, deadline) == -1) {
+            return -1;
+        }
+        int ret = frame_recv(h->client_sock, &h->rx, msgs, count);
+        if (ret != -1) return ret;
+        if (ipc_wait_fd_again(h->client_sock, POLLIN, deadline) == -1) return -1;
+    }
+}
+
+static int sock_send(SockHandle *h, const void *data, size_t len, uint64_t deadline) {
+    if (sock_check(h->broken) == -1 || sock_peer(h, deadline) == -1) return -1;
+    if (h->opts.zerocopy_min && len >= h->opts.zerocopy_min) {
+        if (sock_wait_room(h->client_sock, deadline) == -1) return -1;
+        return sock_send_zc(h, h->client_sock, data, len, deadline, &h->broken);
+    }
+    if (h->opts.fd_pass_min && len >= h->opts.fd_pass_min) {
+        if (sock_wait_room(h->client_sock, deadline) == -1) return -1;
+        return sock_send_fd_copy(h->client_sock, data, len, deadline, &h->broken);
+    }
+    if (h->framed) {
+        IPC_Msg msg = { (void *)data, len };
+        return sock_frame_send(h, &msg, 1, deadline) == 1 ? (int)len : -1;
+    }
+    for (;;) {
+        if (ipc_wait_fd_before(h->client_sock, POLLOUT, h->nonblock, deadline) == -1) return -1;
+        ipc_stat_syscall();
+        ssize_t n = send(h->client_sock, data, len, sock_dontwait(deadline));
+        if (n != -1) return (int)n;
+        if (ipc_wait_fd_again(h->client_sock, POLLOUT, deadline) == -1) return -1;
+    }
+}
+
+static int sock_recv(SockHandle *h, void *buf, size_t len, uint64_t deadline) {
+    if (sock_peer(h, deadline) == -1) return -1;
+    int ret;
+    if (h->framed) {
+        IPC_Msg msg = { buf, len };
+        ret = sock_frame_recv(h, &msg, 1, deadline);
+        if (ret == 1) ret = (int)msg.len;
+    } else {
+        for (;;) {
+            if (ipc_wait_fd_before(h->client_sock, POLLIN, h->nonblock, deadline) == -1) return -1;
+            ipc_stat_syscall();
+            ret = recv(h->client_sock, buf, len, 0);
+            if (ret != -1) break;
+            if (ipc_wait_fd_again(h->client_sock, POLLIN, deadline) == -1) return -1;
+        }
+    }
+    sock_quickack(h, h->client_sock);
+    return ret;
+}
+
+static int ipc_send_socket_unix(IPC_Handle handle, const void *data, size_t len) {
+    SockHandle *h = (SockHandle *)handle;
+    return sock_send(h, data, len, h->wait);
+}
+
+static int ipc_recv_socket_unix(IPC_Handle handle, void *buf, size_t len) {
+    SockHandle *h = (SockHandle *)handle;
+    return sock_recv(h, buf, len, h->wait);
+}
+
+static int ipc_send_timed_socket(IPC_Handle handle, const void *data, size_t len, int timeout_ms) {
+    return sock_send((SockHandle *)handle, data, len, ipc_deadline(timeout_ms));
+}
+
+static int ipc_recv_timed_socket(IPC_Handle handle, void *buf, size_t len, int timeout_ms) {
+    return sock_recv((SockHandle *)handle, buf, len, ipc_deadline(timeout_ms));
+}
+
+#ifdef __linux__
+// The batch goes out as one gathered write. sendmmsg would move on to the
+// next message after a short one whenever room appeared, leaving a later
+// message's bytes ahead of the rest of an earlier one on the stream; with
+// one write a short send cuts a single message, which is finished before
+// the batch stops.
+static int ipc_send_batch_socket_unix(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    SockHandle *h = (SockHandle *)handle;
+    if (sock_check(h->broken) == -1 || sock_peer(h, h->wait) == -1) return -1;
+    if (h->framed) return sock_frame_send(h, msgs, count, h->wait);
+    if (ipc_wait_fd_before(h->client_sock, POLLOUT, h->nonblock, h->wait) == -1) return -1;
+
+    struct iovec iov[SOCK_BATCH];
+    size_t sent = 0;
+    while (sent < count) {
+        size_t n = count - sent;
+        if (n > SOCK_BATCH) n = SOCK_BATCH;
+        for (size_t i = 0; i < n; i++) {
+            iov[i].iov_base = msgs[sent + i].data;
+            iov[i].iov_len = msgs[sent + i].len;
+        }
+        struct msghdr msg = { .msg_iov = iov, .msg_iovlen = n };
+        ipc_stat_syscall();
+        ssize_t ret = sendmsg(h->client_sock, &msg, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) continue;
+            if (sent == 0 && ipc_wait_fd_again(h->client_sock, POLLOUT, h->wait) == 0) continue;
+            return sent ? (int)sent : -1;
+        }
+        size_t left = (size_t)ret;
+        size_t whole = 0;
+        while (whole < n && left >= iov[whole].iov_len) left -= iov[whole++].iov_len;
+        sent += whole;
+        if (whole == n) continue;
+        // The send stopped inside message `whole`: finish it, then stop
+        if (left) {
+            if (sock_send_rest(h->client_sock, (const char *)iov[whole].iov_base + left,
+                               iov[whole].iov_len - left, 0, ipc_finish_deadline(h->wait),
+                               &h->broken) == -1) {
+                return -1;
+            }
+            sent++;
+        }
+        break;
+    }
+    return sent ? (int)sent : -1;
+}
+
+// Waits for the first message, then takes whatever else is already queued
+static int ipc_recv_batch_socket_unix(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    SockHandle *h = (SockHandle *)handle;
+    if (sock_peer(h, h->wait) == -1) return -1;
+    if (h->framed) return sock_frame_recv(h, msgs, count, h->wait);
+
+    struct mmsghdr hdrs[SOCK_BATCH];
+    struct iovec iov[SOCK_BATCH];
+    size_t n = count < SOCK_BATCH ? count : SOCK_BATCH;
+    memset(hdrs, 0, n * sizeof(hdrs[0]));
+    for (size_t i = 0; i < n; i++) {
+        iov[i].iov_base = msgs[i].data;
+        iov[i].iov_len = msgs[i].len;
+        hdrs[i].msg_hdr.msg_iov = &iov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int ret;
+    for (;;) {
+        if (ipc_wait_fd_before(h->client_sock, POLLIN, h->nonblock, h->wait) == -1) return -1;
+        ipc_stat_syscall();
+        ret = recvmmsg(h->client_sock, hdrs, n, MSG_WAITFORONE, NULL);
+        if (ret != -1) break;
+        if (ipc_wait_fd_again(h->client_sock, POLLIN, h->wait) == -1) return -1;
+    }
+    for (int i = 0; i < ret; i++) {
+        msgs[i].len = hdrs[i].msg_len;
+    }
+    return ret;
+}
+#else
+static int ipc_send_batch_socket_unix(IPC_Handle handle, const IPC_Msg *msgs, size_t count) {
+    SockHandle *h = (SockHandle *)handle;
+    if (sock_check(h->broken) == -1 || sock_peer(h, h->wait) == -1) return -1;
+    if (h->framed) return sock_frame_send(h, msgs, count, h->wait);
+    // Count only whole messages: a short send is finished before the next
+    size_t sent;
+    for (sent = 0; sent < count; sent++) {
+        int ret = sock_send(h, msgs[sent].data, msgs[sent].len, h->wait);
+        if (ret == -1) break;
+        if ((size_t)ret < msgs[sent].len &&
+            sock_send_rest(h->client_sock, (const char *)msgs[sent].data + ret,
+                           msgs[sent].len - ret, 0, ipc_finish_deadline(h->wait),
+                           &h->broken) == -1) {
+            return -1;
+        }
+    }
+    return sent ? (int)sent : -1;
+}
+
+static int ipc_recv_batch_socket_unix(IPC_Handle handle, IPC_Msg *msgs, size_t count) {
+    (void)count;
+    int ret = ipc_recv_socket_unix(handle, msgs[0].data, msgs[0].len);
+    if (ret == -1) return -1;
+    msgs[0].len = ret;
+    return 1;
+}
+#endif
+
+#ifdef __linux__
+// The listening socket is registered with id 0, connections with slot + 1
+static int sock_multi_init(SockHandle *h) {
+    h->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (h->epfd == -1) return -1;
+    if (fcntl(h->sock, F_SETFL, fcntl(h->sock, F_GETFL) | O_NONBLOCK) == -1) return -1;
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = 0 };
+    if (epoll_ctl(h->epfd, EPOLL_CTL_ADD, h->sock, &ev) == -1) return -1;
+    h->multi = 1;
+    return 0;
+}
+
+static uint32_t sock_conn_id(SockHandle *h, uint32_t slot) {
+    return ((uint32_t)h->conns[slot].gen << SOCK_SLOT_BITS) | slot;
+}
+
+static SockConn *sock_conn(SockHandle *h, uint32_t id) {
+    uint32_t slot = id & (SOCK_MAX_CONNS - 1);
+    if (slot >= h->nconns || h->conns[slot].fd == -1 ||
+        h->conns[slot].gen != (uint16_t)(id >> SOCK_SLOT_BITS)) {
+        errno = ENOTCONN;
+        return NULL;
+    }
+    return &h->conns[slot];
+}
+
+static int sock_conn_slot(SockHandle *h, uint32_t *slot_out) {
+    uint32_t slot;
+    for (slot = 0; slot < h->nconns; slot++) {
+        if (h->conns[slot].fd == -1) break;
+    }
+    if (slot == h->nconns) {
+        if (slot == SOCK_MAX_CONNS) {
+            errno = EMFILE;
+            return -1;
+        }
+        if (slot == h->conn_cap) {
+            uint32_t cap = h->conn_cap ? h->conn_cap * 2 : 16;
+            SockConn *conns = realloc(h->conns, cap * sizeof(SockConn));
+            if (!conns) {
+                errno = ENOMEM;
+                return -1;
+            }
+            h->conns = conns;
+            h->conn_cap = cap;
+        }
+        h->conns[slot].fd = -1;
+        h->conns[slot].gen = 0;
+        frame_buffer_init(&h->conns[slot].rx);
+        h->conns[slot].rx.pass_fds = h->opts.fd_pass_min != 0;
+        h->nconns++;
+    }
+    *slot_out = slot;
+    return 0;
+}
+
+// Accept every pending connection. Failures drop that connection only.
+static void sock_accept_all(SockHandle *h) {
+    for (;;) {
+        ipc_stat_syscall();
+        int fd = accept4(h->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) return;
+        uint32_t slot;
+        if (sock_conn_slot(h, &slot) == -1) {
+            close(fd);
+            continue;
+        }
+        struct epoll_event ev = { .events = EPOLLIN, .data.u64 = slot + 1 };
+        if (epoll_ctl(h->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            close(fd);
+            continue;
+        }
+        sock_configure(h, fd);
+        h->conns[slot].fd = fd;
+        h->conns[slot].broken = 0;
+    }
+}
+
+// Closing the fd also removes it from the epoll set
+static void sock_conn_drop(SockHandle *h, uint32_t slot) {
+    close(h->conns[slot].fd);
+    frame_buffer_free(&h->conns[slot].rx);
+    h->conns[slot].fd = -1;
+    h->conns[slot].gen++;
+}
+
+static int ipc_send_to_socket(IPC_Handle handle, uint32_t conn, const void *data, size_t len) {
+    SockHandle *h = (SockHandle *)handle;
+    if (!h->multi) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    SockConn *c = sock_conn(h, conn);
+    if (!c || sock_check(c->broken) == -1) return -1;
+    if (h->opts.zerocopy_min && len >= h->opts.zerocopy_min) {
+        if (sock_wait_room(c->fd, h->wait) == -1) return -1;
+        return sock_send_zc(h, c->fd, data, len, h->wait, &c->broken);
+    }
+    if (h->opts.fd_pass_min && len >= h->opts.fd_pass_min) {
+        if (sock_wait_room(c->fd, h->wait) == -1) return -1;
+        return sock_send_fd_copy(c->fd, data, len, h->wait, &c->broken);
+    }
+    if (h->framed) {
+        IPC_Msg msg = { (void *)data, len };
+        return frame_send(c->fd, 1, &msg, 1, h->wait, &c->broken) == 1 ? (int)len : -1;
+    }
+    // Connections are non-blocking; wait for room rather than split a message
+    return sock_send_all(c->fd, data, len, 0, h->wait, &c->broken) == -1 ? -1 : (int)len;
+}
+
+// Waits until any connection has data, accepting new peers on the way. A
+// closed or reset connection is reported once as a 0-byte receive; its id
+// is invalid afterwards.
+static int ipc_recv_from_socket(IPC_Handle handle, uint32_t *conn, void *buf, size_t len) {
+    SockHandle *h = (SockHandle *)handle;
+    if (!h->multi) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    for (;;) {
+        if (h->next_event == h->nevents) {
+            ipc_stat_syscall();
+            uint64_t t0 = ipc_stat_block_begin();
+            int n = epoll_wait(h->epfd, h->events, SOCK_EVENTS, h->wait == IPC_NO_WAIT ? 0 : -1);
+            ipc_stat_block_end(t0);
+            if (n == -1) return -1;
+            if (n == 0) return ipc_expired(h->wait);
+            h->nevents = n;
+            h->next_event = 0;
+        }
+        // An event is only consumed once its connection has nothing left
+        // to hand out, so frames read ahead are delivered before others
+        struct epoll_event *ev = &h->events[h->next_event];
+        if (ev->data.u64 == 0) {
+            h->next_event++;
+            sock_accept_all(h);
+            continue;
+        }
+        // Stale events can point at a slot that was dropped and reused
+        uint32_t slot = (uint32_t)(ev->data.u64 - 1);
+        SockConn *c = &h->conns[slot];
+        if (c->fd == -1) {
+            h->next_event++;
+            continue;
+        }
+        ssize_t ret;
+        if (h->framed) {
+            IPC_Msg msg = { buf, len };
+            ret = frame_recv(c->fd, &c->rx, &msg, 1);
+            if (ret == -1 && errno == EMSGSIZE) {
+                // The frame would stay at the head of the stream and fail
+                // every later receive, so the connection goes with it
+                *conn = sock_conn_id(h, slot);
+                sock_conn_drop(h, slot);
+                h->next_event++;
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (ret == 1) ret = msg.len;
+            if (!frame_ready(&c->rx)) h->next_event++;
+        } else {
+            ipc_stat_syscall();
+            ret = recv(c->fd, buf, len, MSG_DONTWAIT);
+            h->next_event++;
+        }
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        sock_quickack(h, c->fd);
+        *conn = sock_conn_id(h, slot);
+        if (ret <= 0) {
+            sock_conn_drop(h, slot);
+            return 0;
+        }
+        return (int)ret;
+    }
+}
+#else
+static int sock_multi_init(SockHandle *h) {
+    (void)h;
+    errno = ENOTSUP;
+    return -1;
+}
+
+static int ipc_send_to_socket(IPC_Handle handle, uint32_t conn, const void *data, size_t len) {
+    (void)handle; (void)conn; (void)data; (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+
+static int ipc_recv_from_socket(IPC_Handle handle, uint32_t *conn, void *buf, size_t len) {
+    (void)handle; (void)conn; (void)buf; (void)len;
+    errno = ENOTSUP;
+    return -1;
+}
+#endif
+
+static int ipc_send_reserve_socket(IPC_Handle handle, size_t len, void **ptr) {
+    SockHandle *h = (SockHandle *)handle;
+    if (!h->opts.fd_pass_min) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (h->send_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    int mfd = sock_memfd_create(len);
+    if (mfd == -1) return -1;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, mfd, 0);
+    if (p == MAP_FAILED) {
+        close(mfd);
+        return -1;
+    }
+    h->send_loan = p;
+    h->send_memfd = mfd;
+    h->send_len = len;
+    *ptr = p;
+    return 0;
+}
+
+static int ipc_send_commit_socket(IPC_Handle handle, void *ptr) {
     SockHandle *h = (SockHandle *)handle;
-    if (!h || !data || len == 0) {
+    if (!h->send_loan || ptr != h->send_loan) {
         errno = EINVAL;
         return -1;
     }
-    if (h->client_sock == -1) {
-        h->client_sock = accept(h->sock, NULL, NULL);
-        if (h->client_sock == -1) return -1;
+    // The write seal needs every writable mapping gone
+    munmap(h->send_loan, h->send_len);
+    h->send_loan = NULL;
+    int ret = -1;
+    if (sock_check(h->broken) != -1 && sock_peer(h, h->wait) != -1) {
+        ret = sock_send_memfd(h->client_sock, h->send_memfd, h->send_len, h->wait, &h->broken);
     }
-    return send(h->client_sock, data, len, 0);
+    close(h->send_memfd);
+    h->send_memfd = -1;
+    return ret;
 }
 
-int ipc_recv_socket_unix(IPC_Handle handle, void *buf, size_t len) {
+static int ipc_recv_acquire_socket(IPC_Handle handle, void **ptr, size_t *len) {
     SockHandle *h = (SockHandle *)handle;
-    if (!h || !buf || len == 0) {
+    if (!h->framed) {
+        errno = ENOTSUP;
+        return -1;
+    }
+    if (h->recv_loan) {
+        errno = EBUSY;
+        return -1;
+    }
+    if (sock_peer(h, h->wait) == -1) return -1;
+
+    void *p;
+    int mfd;
+    int ret;
+    for (;;) {
+        if (!frame_ready(&h->rx) &&
+            ipc_wait_fd_before(h->client_sock, POLLIN, h->nonblock, h->wait) == -1) {
+            return -1;
+        }
+        ret = frame_peek(h->client_sock, &h->rx, &p, len, &mfd, &h->recv_frame);
+        if (ret != -1 || ipc_wait_fd_again(h->client_sock, POLLIN, h->wait) == -1) break;
+    }
+    if (ret <= 0) {
+        if (ret == 0) errno = ECONNRESET;
+        return -1;
+    }
+    h->recv_map_len = 0;
+    if (mfd != -1) {
+        // A zero-length mapping is invalid; lend the receive buffer instead
+        if (*len == 0) {
+            p = h->rx.buf;
+        } else {
+            p = mmap(NULL, *len, PROT_READ, MAP_SHARED, mfd, 0);
+            if (p == MAP_FAILED) {
+                close(mfd);
+                return -1;
+            }
+            h->recv_map_len = *len;
+        }
+        close(mfd);
+    }
+    h->recv_loan = p;
+    *ptr = p;
+    return 0;
+}
+
+static int ipc_recv_release_socket(IPC_Handle handle, void *ptr) {
+    SockHandle *h = (SockHandle *)handle;
+    if (!h->recv_loan || ptr != h->recv_loan) {
         errno = EINVAL;
         return -1;
     }
-    if (h->client_sock == -1) {
-        h->client_sock = accept(h->sock, NULL, NULL);
-        if (h->client_sock == -1) return -1;
+    if (h->recv_map_len) {
+        munmap(h->recv_loan, h->recv_map_len);
+    } else {
+        frame_consume(&h->rx, h->recv_frame);
+    }
+    h->recv_loan = NULL;
+    return 0;
+}
+
+// Until the peer is accepted the listening socket signals its arrival. A
+// multi-client server is ready when its epoll set is, or when events from
+// the last wait are still pending. Read-ahead frames are ready as well.
+static int get_fd_socket(IPC_Handle handle) {
+    SockHandle *h = (SockHandle *)handle;
+    if (h->multi) return h->epfd;
+    return h->client_sock != -1 ? h->client_sock : h->sock;
+}
+
+// The peer is accepted here if need be, which blocks like a first receive
+static int io_fd_socket(IPC_Handle handle, int write, int *nonblock) {
+    SockHandle *h = (SockHandle *)handle;
+    (void)write;
+    if (h->framed) {
+        errno = ENOTSUP;
+        return -1;
     }
-    return recv(h->client_sock, buf, len, 0);
+    *nonblock = h->nonblock;
+    return sock_peer(h, h->wait);
+}
+
+static int poll_arm_socket(IPC_Handle handle) {
+    SockHandle *h = (SockHandle *)handle;
+    return h->next_event < h->nevents || frame_ready(&h->rx);
 }
 
-void close_socket_unix(IPC_Handle handle) {
+static void close_socket_unix(IPC_Handle handle) {
     SockHandle *h = (SockHandle *)handle;
     if (!h) return;
     if (h->client_sock != -1) close(h->client_sock);
+    if (h->send_loan) munmap(h->send_loan, h->send_len);
+    if (h->send_memfd != -1) close(h->send_memfd);
+    if (h->recv_loan && h->recv_map_len) munmap(h->recv_loan, h->recv_map_len);
+    for (uint32_t i = 0; i < h->nconns; i++) {
+        if (h->conns[i].fd != -1) close(h->conns[i].fd);
+        frame_buffer_free(&h->conns[i].rx);
+    }
+    free(h->conns);
+    frame_buffer_free(&h->rx);
+    if (h->epfd != -1) close(h->epfd);
     close(h->sock);
     if (h->sock_path) {
         unlink(h->sock_path);
@@ -86,10 +996,20 @@ void close_socket_unix(IPC_Handle handle) {
     free(h);
 }
 
-IPC_Handle init_socket_tcp(const IPC_Config *config) {
+static IPC_Handle init_socket_tcp(const IPC_Config *config) {
     int sock = socket(AF_INET, SOCK_STREAM, 0);
     if (sock == -1) return NULL;
 
+    // Lets several handles, one per acceptor thread or process, listen on
+    // the same port with the kernel spreading connections across them
+    if (config->flags & IPC_REUSEPORT) {
+        int one = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+            close(sock);
+            return NULL;
+        }
+    }
+
     struct sockaddr_in addr = {0};
     addr.sin_family = AF_INET;
     addr.sin_port = htons(config->port);
@@ -99,30 +1019,46 @@ IPC_Handle init_socket_tcp(const IPC_Config *config) {
         close(sock);
         return NULL;
     }
-    if (listen(sock, 5) == -1) {
-        close(sock);
-        return NULL;
-    }
-
-    SockHandle *h = malloc(sizeof(SockHandle));
-    if (!h) {
-        close(sock);
-        return NULL;
-    }
-    h->sock = sock;
-    h->client_sock = -1;
-    h->sock_path = NULL;
-    return (IPC_Handle)h;
-}
-
-int ipc_send_socket_tcp(IPC_Handle handle, const void *data, size_t len) {
-    return ipc_send_socket_unix(handle, data, len);
+    return sock_listen(sock, config, NULL);
 }
 
-int ipc_recv_socket_tcp(IPC_Handle handle, void *buf, size_t len) {
-    return ipc_recv_socket_unix(handle, buf, len);
-}
+const IPC_TransportOps ipc_socket_unix_ops = {
+    .init = init_socket_unix,
+    .send = ipc_send_socket_unix,
+    .recv = ipc_recv_socket_unix,
+    .close = close_socket_unix,
+    .send_batch = ipc_send_batch_socket_unix,
+    .recv_batch = ipc_recv_batch_socket_unix,
+    .get_fd = get_fd_socket,
+    .poll_arm = poll_arm_socket,
+    .send_to = ipc_send_to_socket,
+    .recv_from = ipc_recv_from_socket,
+    .send_reserve = ipc_send_reserve_socket,
+    .send_commit = ipc_send_commit_socket,
+    .recv_acquire = ipc_recv_acquire_socket,
+    .recv_release = ipc_recv_release_socket,
+    .io_fd = io_fd_socket,
+    .send_timed = ipc_send_timed_socket,
+    .recv_timed = ipc_recv_timed_socket,
+};
 
-void close_socket_tcp(IPC_Handle handle) {
-    close_socket_unix(handle);
-}
+// TCP sockets only differ in how they are created
+const IPC_TransportOps ipc_socket_tcp_ops = {
+    .init = init_socket_tcp,
+    .send = ipc_send_socket_unix,
+    .recv = ipc_recv_socket_unix,
+    .close = close_socket_unix,
+    .send_batch = ipc_send_batch_socket_unix,
+    .recv_batch = ipc_recv_batch_socket_unix,
+    .get_fd = get_fd_socket,
+    .poll_arm = poll_arm_socket,
+    .send_to = ipc_send_to_socket,
+    .recv_from = ipc_recv_from_socket,
+    .send_reserve = ipc_send_reserve_socket,
+    .send_commit = ipc_send_commit_socket,
+    .recv_acquire = ipc_recv_acquire_socket,
+    .recv_release = ipc_recv_release_socket,
+    .io_fd = io_fd_socket,
+    .send_timed = ipc_send_timed_socket,
+    .recv_timed = ipc_recv_timed_socket,
+};
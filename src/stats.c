@@ -0,0 +1,160 @@
+#include "ipc_internal.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+
+_Thread_local StatsBlock *ipc_stats_cur;
+
+// Counters have a single writer per direction, so a plain load and store
+// does instead of a locked add
+static inline void stat_add(atomic_uint_fast64_t *c, uint64_t n) {
+    atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+// Bucket v < 8 is v; above, the three bits below the leading one pick one of
+// eight buckets per power of two
+static unsigned stats_bucket(uint64_t v) {
+    if (v < 8) return (unsigned)v;
+    unsigned msb = 63 - (unsigned)__builtin_clzll(v);
+    return (msb - 2) * 8 + (unsigned)((v >> (msb - 3)) & 7);
+}
+
+static uint64_t stats_bucket_floor(unsigned b) {
+    if (b < 8) return b;
+    return (uint64_t)(8 + b % 8) << (b / 8 - 1);
+}
+
+StatsBlock *stats_open(const IPC_Config *config, ShmSegment *seg) {
+    seg->hdr = NULL;
+    if (!config->stats_name) {
+        StatsBlock *s = aligned_alloc(IPC_CACHELINE, sizeof(StatsBlock));
+        if (!s) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        memset(s, 0, sizeof(StatsBlock));
+        return s;
+    }
+    IPC_Config seg_config = { 0 };
+    seg_config.mech = SHM_KIND_STATS;
+    seg_config.name = config->stats_name;
+    // A zero-filled segment is an empty block, so there is nothing to init
+    if (shm_segment_open(seg, &seg_config, sizeof(StatsBlock), NULL, NULL) == -1) return NULL;
+    if (seg->size != sizeof(StatsBlock)) {
+        shm_segment_close(seg);
+        seg->hdr = NULL;
+        errno = EPROTO;
+        return NULL;
+    }
+    return (StatsBlock *)seg->mem;
+}
+
+void stats_close(StatsBlock *s, ShmSegment *seg) {
+    if (seg->hdr) {
+        shm_segment_close(seg);
+    } else {
+        free(s);
+    }
+}
+
+uint64_t stats_begin(StatsBlock *s) {
+    ipc_stats_cur = s;
+    return stats_now_ns();
+}
+
+void stats_end(StatsDir *dir, int ret, uint64_t msgs, uint64_t bytes, uint64_t t0) {
+    int err = errno;
+    uint64_t elapsed = stats_now_ns() - t0;
+    ipc_stats_cur = NULL;
+    if (ret == -1) {
+        stat_add(err == EAGAIN ? &dir->would_block : &dir->errors, 1);
+    } else {
+        stat_add(&dir->msgs, msgs);
+        stat_add(&dir->bytes, bytes);
+    }
+    stat_add(&dir->latency[stats_bucket(elapsed)], 1);
+    errno = err;
+}
+
+static void stats_copy_dir(const StatsDir *dir, IPC_StatsDir *out) {
+    out->msgs = atomic_load_explicit(&dir->msgs, memory_order_relaxed);
+    out->bytes = atomic_load_explicit(&dir->bytes, memory_order_relaxed);
+    out->would_block = atomic_load_explicit(&dir->would_block, memory_order_relaxed);
+    out->errors = atomic_load_explicit(&dir->errors, memory_order_relaxed);
+    for (unsigned i = 0; i < IPC_STATS_BUCKETS; i++) {
+        out->latency[i] = atomic_load_explicit(&dir->latency[i], memory_order_relaxed);
+    }
+}
+
+void stats_copy(const StatsBlock *s, IPC_Stats *out) {
+    stats_copy_dir(&s->send, &out->send);
+    stats_copy_dir(&s->recv, &out->recv);
+    out->syscalls = atomic_load_explicit(&s->syscalls, memory_order_relaxed);
+    out->blocked_ns = atomic_load_explicit(&s->blocked_ns, memory_order_relaxed);
+}
+
+// Map the export read-only: a monitor never writes to it, and a segment the
+// owner is still creating reads as not ready
+int ipc_stats_read(const char *stats_name, IPC_Stats *out) {
+    if (!stats_name || !out) {
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = shm_open(stats_name, O_RDONLY, 0);
+    if (fd == -1) return -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    size_t size = sizeof(ShmSegmentHeader) + sizeof(StatsBlock);
+    if ((size_t)st.st_size != size) {
+        close(fd);
+        errno = (size_t)st.st_size < size ? EAGAIN : EPROTO;
+        return -1;
+    }
+    void *mem = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return -1;
+
+    const ShmSegmentHeader *hdr = (const ShmSegmentHeader *)mem;
+    int ret = 0;
+    if (!atomic_load_explicit(&hdr->ready, memory_order_acquire)) {
+        errno = EAGAIN;
+        ret = -1;
+    } else if (hdr->magic != SHM_MAGIC || hdr->version != SHM_LAYOUT_VERSION ||
+               hdr->mech != SHM_KIND_STATS || hdr->size != sizeof(StatsBlock)) {
+        errno = EPROTO;
+        ret = -1;
+    } else {
+        stats_copy((const StatsBlock *)(hdr + 1), out);
+    }
+    munmap(mem, size);
+    return ret;
+}
+
+uint64_t ipc_stats_percentile(const uint64_t *latency, double pct) {
+    if (!latency) return 0;
+    uint64_t total = 0;
+    for (unsigned i = 0; i < IPC_STATS_BUCKETS; i++) total += latency[i];
+    if (total == 0) return 0;
+    if (pct < 0) pct = 0;
+    if (pct > 100) pct = 100;
+    double want = pct / 100 * (double)total;
+    uint64_t rank = (uint64_t)want;
+    if ((double)rank < want || rank == 0) rank++;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < IPC_STATS_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen >= rank) {
+            return i + 1 < IPC_STATS_BUCKETS ? stats_bucket_floor(i + 1) - 1 : UINT64_MAX;
+        }
+    }
+    return UINT64_MAX;
+}
@@ -0,0 +1,269 @@
+#include "ipc_internal.h"
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+
+// Each tracing thread owns a single-producer ring: the thread appends at
+// head, the flusher thread consumes from tail, and neither takes a lock.
+// Rings are never freed, because a thread may still be inside
+// trace_record when tracing stops. A thread that exits gives its ring back
+// and the next new thread takes it over.
+
+#define TRACE_RING_DEFAULT 65536u
+#define TRACE_FLUSH_MS 10
+#define TRACE_FILE_MIN (1u << 16)  // Events the file has room for at first
+
+typedef struct TraceRing {
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t head;  // Owner thread
+    atomic_uint_fast64_t dropped;
+    _Alignas(IPC_CACHELINE) atomic_uint_fast64_t tail;  // Flusher
+    atomic_int owned;
+    struct TraceRing *next;
+    uint64_t mask;
+    IPC_TraceEvent ev[];
+} TraceRing;
+
+atomic_int ipc_trace_on;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t trace_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static _Thread_local TraceRing *trace_ring;
+
+// Guarded by trace_lock
+static TraceRing *trace_rings;
+static unsigned trace_ring_events;
+static int trace_running;
+static int trace_stopping;
+static pthread_t trace_thread;
+
+// Owned by the flusher while tracing runs
+static int trace_fd = -1;
+static IPC_TraceHeader *trace_hdr;
+static uint64_t trace_cap;  // Events the mapping has room for
+
+uint64_t trace_channel(const IPC_Config *config) {
+    // FNV-1a
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (const unsigned char *p = (const unsigned char *)config->name; *p; p++) {
+        h = (h ^ *p) * 0x100000001b3ull;
+    }
+    return (h ^ (uint64_t)config->mech) * 0x100000001b3ull;
+}
+
+static void trace_release(void *arg) {
+    TraceRing *ring = (TraceRing *)arg;
+    atomic_store_explicit(&ring->owned, 0, memory_order_release);
+}
+
+static void trace_key_init(void) {
+    pthread_key_create(&trace_key, trace_release);
+}
+
+// Claim a ring for the calling thread, reusing one an exited thread left
+static TraceRing *trace_attach(void) {
+    pthread_mutex_lock(&trace_lock);
+    TraceRing *ring;
+    for (ring = trace_rings; ring; ring = ring->next) {
+        int free_ring = 0;
+        if (atomic_compare_exchange_strong(&ring->owned, &free_ring, 1)) break;
+    }
+    if (!ring) {
+        ring = calloc(1, sizeof(TraceRing) + (size_t)trace_ring_events * sizeof(IPC_TraceEvent));
+        if (ring) {
+            ring->mask = trace_ring_events - 1;
+            atomic_init(&ring->owned, 1);
+            ring->next = trace_rings;
+            trace_rings = ring;
+        }
+    }
+    pthread_mutex_unlock(&trace_lock);
+    if (ring) pthread_setspecific(trace_key, ring);
+    return ring;
+}
+
+void trace_record(uint64_t channel, int op, uint64_t *seq, int ret, uint64_t count,
+                  uint64_t bytes, uint64_t ticks0) {
+    int err = errno;
+    uint64_t now = trace_ticks();
+    TraceRing *ring = trace_ring;
+    if (!ring) ring = trace_ring = trace_attach();
+    if (ring) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - tail > ring->mask) {
+            atomic_store_explicit(&ring->dropped,
+                                  atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+                                  memory_order_relaxed);
+        } else {
+            IPC_TraceEvent *ev = &ring->ev[head & ring->mask];
+            ev->start = ticks0;
+            ev->ticks = now;
+            ev->channel = channel;
+            ev->seq = *seq;
+            ev->len = bytes > UINT32_MAX ? UINT32_MAX : (uint32_t)bytes;
+            ev->result = ret == -1 ? -err : ret;
+            ev->op = (uint16_t)op;
+            ev->count = count > UINT16_MAX ? UINT16_MAX : (uint16_t)count;
+            ev->reserved = 0;
+            atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+        }
+    }
+    if (ret != -1) *seq += count;
+    errno = err;
+}
+
+// Make room for `need` events in the file
+static int trace_reserve(uint64_t need) {
+    if (need <= trace_cap) return 0;
+    uint64_t cap = trace_cap * 2;
+    while (cap < need) cap *= 2;
+    size_t old_size = sizeof(IPC_TraceHeader) + trace_cap * sizeof(IPC_TraceEvent);
+    size_t size = sizeof(IPC_TraceHeader) + cap * sizeof(IPC_TraceEvent);
+    if (ftruncate(trace_fd, size) == -1) return -1;
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, trace_fd, 0);
+    if (mem == MAP_FAILED) return -1;
+    munmap(trace_hdr, old_size);
+    trace_hdr = (IPC_TraceHeader *)mem;
+    trace_cap = cap;
+    return 0;
+}
+
+// Copy every ring into the file, then publish the new event count
+static void trace_flush(void) {
+    uint64_t events = trace_hdr->events;
+    uint64_t dropped = 0;
+    pthread_mutex_lock(&trace_lock);
+    for (TraceRing *ring = trace_rings; ring; ring = ring->next) {
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (head == tail) continue;
+        if (trace_reserve(events + (head - tail)) == -1) {
+            // Out of disk: count what cannot be written as dropped
+            dropped += head - tail;
+        } else {
+            IPC_TraceEvent *out = (IPC_TraceEvent *)(trace_hdr + 1);
+            for (uint64_t i = tail; i != head; i++) out[events++] = ring->ev[i & ring->mask];
+        }
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    trace_hdr->dropped = dropped;
+    trace_hdr->ticks1 = trace_ticks();
+    trace_hdr->ns1 = stats_now_ns();
+    __atomic_store_n(&trace_hdr->events, events, __ATOMIC_RELEASE);
+}
+
+static void *trace_flusher(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&trace_lock);
+    while (!trace_stopping) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&trace_cond, &trace_lock, &ts);
+        pthread_mutex_unlock(&trace_lock);
+        trace_flush();
+        pthread_mutex_lock(&trace_lock);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return NULL;
+}
+
+int ipc_trace_start(const char *path, unsigned ring_events) {
+    if (!path || ring_events > (1u << 31)) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_once(&trace_once, trace_key_init);
+    pthread_mutex_lock(&trace_lock);
+    if (trace_running) {
+        pthread_mutex_unlock(&trace_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    // Existing rings keep their size; new ones use this one
+    unsigned events = 1;
+    while (events < (ring_events ? ring_events : TRACE_RING_DEFAULT)) events <<= 1;
+    trace_ring_events = events;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    size_t size = sizeof(IPC_TraceHeader) + TRACE_FILE_MIN * sizeof(IPC_TraceEvent);
+    void *mem = MAP_FAILED;
+    if (fd != -1 && ftruncate(fd, size) == 0) {
+        mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (mem == MAP_FAILED) {
+        int err = errno;
+        if (fd != -1) close(fd);
+        pthread_mutex_unlock(&trace_lock);
+        errno = err;
+        return -1;
+    }
+    trace_fd = fd;
+    trace_hdr = (IPC_TraceHeader *)mem;
+    trace_cap = TRACE_FILE_MIN;
+    trace_hdr->magic = IPC_TRACE_MAGIC;
+    trace_hdr->version = IPC_TRACE_VERSION;
+    trace_hdr->event_size = sizeof(IPC_TraceEvent);
+    trace_hdr->pid = (uint32_t)getpid();
+    trace_hdr->ticks0 = trace_hdr->ticks1 = trace_ticks();
+    trace_hdr->ns0 = trace_hdr->ns1 = stats_now_ns();
+
+    // Leftovers from an earlier session do not belong in this file
+    for (TraceRing *ring = trace_rings; ring; ring = ring->next) {
+        atomic_store(&ring->tail, atomic_load(&ring->head));
+        atomic_store(&ring->dropped, 0);
+    }
+    trace_stopping = 0;
+    int err = pthread_create(&trace_thread, NULL, trace_flusher, NULL);
+    if (err) {
+        munmap(trace_hdr, size);
+        close(fd);
+        trace_hdr = NULL;
+        trace_fd = -1;
+        pthread_mutex_unlock(&trace_lock);
+        errno = err;
+        return -1;
+    }
+    trace_running = 1;
+    atomic_store(&ipc_trace_on, 1);
+    pthread_mutex_unlock(&trace_lock);
+    return 0;
+}
+
+// Stop recording, write out what the rings still hold and trim the file
+void ipc_trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_running) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    atomic_store(&ipc_trace_on, 0);
+    trace_stopping = 1;
+    pthread_cond_signal(&trace_cond);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_join(trace_thread, NULL);
+
+    trace_flush();
+    size_t size = sizeof(IPC_TraceHeader) + trace_hdr->events * sizeof(IPC_TraceEvent);
+    munmap(trace_hdr, sizeof(IPC_TraceHeader) + trace_cap * sizeof(IPC_TraceEvent));
+    // A failed trim only leaves slack; readers go by the event count
+    int ret = ftruncate(trace_fd, size);
+    (void)ret;
+    close(trace_fd);
+    pthread_mutex_lock(&trace_lock);
+    trace_hdr = NULL;
+    trace_fd = -1;
+    trace_running = 0;
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,228 @@
+// Allocation check for the message path of every IPC_Mechanism.
+//
+// Replaces malloc, calloc, realloc and free with counting wrappers around
+// the glibc entry points, opens a loopback channel per mechanism, warms it
+// up and then runs send/recv and send_batch/recv_batch round trips. Any
+// allocator call during the counted rounds fails the check: the message
+// path must run entirely out of memory set up by ipc_init. Socket channels
+// are served by the library and echoed by a plain client socket in the
+// same process, so the client side does not touch the allocator either.
+
+#define _GNU_SOURCE
+#include "ipc.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define WARMUP_ROUNDS 4
+#define ROUNDS        1000
+#define MSG_MAX       256
+#define BATCH         4
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static int counting;
+static long alloc_calls;
+
+void *malloc(size_t size) {
+    if (counting) alloc_calls++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    if (counting) alloc_calls++;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (counting) alloc_calls++;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+    if (counting && ptr) alloc_calls++;
+    __libc_free(ptr);
+}
+
+typedef struct {
+    IPC_Mechanism mech;
+    const char *label;
+    uint32_t flags;
+    int batch;     // Whether the mechanism supports the batch calls
+} Mech;
+
+static const Mech mechs[] = {
+    { IPC_SHM_MUTEX,     "shm_mutex",        0,          0 },
+    { IPC_SHM_RING,      "shm_ring",         0,          1 },
+    { IPC_SHM_QUEUE,     "shm_queue",        0,          1 },
+    { IPC_SHM_BROADCAST, "shm_broadcast",    0,          0 },
+    { IPC_MQ_POSIX,      "mq_posix",         0,          1 },
+    { IPC_MQ_SYSV,       "mq_sysv",          0,          1 },
+    { IPC_PIPE_UNNAMED,  "pipe_unnamed",     0,          1 },
+    { IPC_PIPE_NAMED,    "pipe_named",       0,          1 },
+    { IPC_PIPE_NAMED,    "pipe_framed",      IPC_FRAMED, 1 },
+    { IPC_SOCKET_UNIX,   "socket_unix",      0,          1 },
+    { IPC_SOCKET_UNIX,   "socket_framed",    IPC_FRAMED, 1 },
+    { IPC_SOCKET_TCP,    "socket_tcp",       0,          1 },
+};
+
+static const IPC_Msg batch_out[BATCH] = {
+    { "aaaa", 4 }, { "bbbb", 4 }, { "cc", 2 }, { "d", 1 },
+};
+static const size_t batch_bytes = 11;
+
+// Bounces len bytes from the library's side of a socket straight back
+static int peer_echo(int fd, size_t len) {
+    char buf[MSG_MAX];
+    ssize_t n = recv(fd, buf, len, MSG_WAITALL);
+    if (n != (ssize_t)len) return -1;
+    return send(fd, buf, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
+static int peer_connect(const Mech *m, const char *path, uint16_t port) {
+    int fd;
+    if (m->mech == IPC_SOCKET_UNIX) {
+        struct sockaddr_un addr = { .sun_family = AF_UNIX };
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd == -1) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1) return -1;
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// One send/recv and one batch round trip; peer is -1 unless a socket client
+// has to echo the bytes back. An IPC_FRAMED stream puts a 4-byte length in
+// front of every message.
+static int round_trip(const Mech *m, IPC_Handle h, int peer) {
+    size_t hdr = (m->flags & IPC_FRAMED) ? 4 : 0;
+    char buf[MSG_MAX];
+    if (ipc_send(h, "hello", 5) == -1) return -1;
+    if (peer != -1 && peer_echo(peer, hdr + 5) == -1) return -1;
+    if (ipc_recv(h, buf, sizeof(buf)) == -1) return -1;
+    if (!m->batch) return 0;
+
+    if (ipc_send_batch(h, batch_out, BATCH) != BATCH) return -1;
+    if (peer != -1 && peer_echo(peer, BATCH * hdr + batch_bytes) == -1) return -1;
+    // A stream socket may hand the bytes back in other splits; count bytes
+    char bufs[BATCH][MSG_MAX];
+    IPC_Msg in[BATCH];
+    size_t got = 0;
+    while (got < batch_bytes) {
+        for (int i = 0; i < BATCH; i++) {
+            in[i].data = bufs[i];
+            in[i].len = MSG_MAX;
+        }
+        int n = ipc_recv_batch(h, in, BATCH);
+        if (n <= 0) return -1;
+        for (int i = 0; i < n; i++) got += in[i].len;
+    }
+    return got == batch_bytes ? 0 : -1;
+}
+
+static int check(const Mech *m, const char *dir) {
+    char name[128], key[128], sock_path[64];
+    IPC_Config cfg = { .mech = m->mech, .size = MSG_MAX, .flags = m->flags };
+    snprintf(name, sizeof(name), "/ipc_alloc_%d_%s", getpid(), m->label);
+    snprintf(key, sizeof(key), "%s/sysv", dir);
+    snprintf(sock_path, sizeof(sock_path), "%s/%s.sock", dir, m->label);
+
+    switch (m->mech) {
+        case IPC_MQ_SYSV:
+            // ftok() needs an existing path
+            close(open(key, O_CREAT | O_RDWR, 0600));
+            cfg.name = key;
+            break;
+        case IPC_PIPE_NAMED:
+            snprintf(name, sizeof(name), "%s/%s", dir, m->label);
+            cfg.name = name;
+            break;
+        case IPC_SOCKET_UNIX:
+            cfg.name = sock_path;
+            break;
+        case IPC_SOCKET_TCP:
+            cfg.name = "tcp";
+            cfg.port = 20000 + getpid() % 20000;
+            break;
+        default:
+            cfg.name = name;
+            break;
+    }
+
+    IPC_Handle h = ipc_init(&cfg);
+    if (!h) {
+        fprintf(stderr, "%-14s ipc_init: %s\n", m->label, strerror(errno));
+        return -1;
+    }
+    int peer = -1;
+    if (m->mech == IPC_SOCKET_UNIX || m->mech == IPC_SOCKET_TCP) {
+        peer = peer_connect(m, sock_path, cfg.port);
+        if (peer == -1) {
+            fprintf(stderr, "%-14s connect: %s\n", m->label, strerror(errno));
+            ipc_close(h);
+            return -1;
+        }
+    }
+
+    int ret = 0;
+    for (int i = 0; i < WARMUP_ROUNDS && ret == 0; i++) ret = round_trip(m, h, peer);
+
+    alloc_calls = 0;
+    counting = 1;
+    for (int i = 0; i < ROUNDS && ret == 0; i++) ret = round_trip(m, h, peer);
+    counting = 0;
+
+    if (ret == -1) {
+        fprintf(stderr, "%-14s round trip: %s\n", m->label, strerror(errno));
+    } else {
+        printf("%-14s %ld allocator calls\n", m->label, alloc_calls);
+        if (alloc_calls) ret = -1;
+    }
+    if (peer != -1) close(peer);
+    ipc_close(h);
+    if (m->mech == IPC_MQ_SYSV) unlink(key);
+    if (m->mech == IPC_PIPE_NAMED) unlink(name);
+    if (m->mech == IPC_SOCKET_UNIX) unlink(sock_path);
+    return ret;
+}
+
+int main(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    char dir[] = "/tmp/ipc_alloc_XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror("mkdtemp");
+        return 1;
+    }
+    int failed = 0;
+    for (size_t i = 0; i < sizeof(mechs) / sizeof(mechs[0]); i++) {
+        if (check(&mechs[i], dir) == -1) failed++;
+    }
+    rmdir(dir);
+    if (failed) {
+        printf("%d mechanism(s) failed\n", failed);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Queues a full batch of asynchronous receives and sends on a FIFO, whose
+// fds are non-blocking so every operation also posts an internal poll
+// completion, and checks that each one is reaped with its full length and
+// that one operation more fails with EAGAIN. An alarm turns a hang into a
+// failure. Skipped where io_uring is unavailable.
+
+#define _GNU_SOURCE
+#include "ipc.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HANG_SECONDS 10
+#define ENTRIES      8
+#define OPS          (2 * ENTRIES)  // The documented in-flight bound
+#define MSG_LEN      64
+
+static char bufs[OPS][MSG_LEN];
+
+static int run(IPC_Async *aq, IPC_Handle h) {
+    // Receives first, so their polls are still pending when the sends land
+    for (unsigned i = 0; i < OPS; i++) {
+        int ret = i < OPS / 2 ? ipc_recv_async(aq, h, bufs[i], MSG_LEN, i)
+                              : ipc_send_async(aq, h, bufs[i], MSG_LEN, i);
+        if (ret == -1) {
+            fprintf(stderr, "queue %u: %s\n", i, strerror(errno));
+            return -1;
+        }
+    }
+    if (ipc_send_async(aq, h, bufs[0], MSG_LEN, OPS) != -1 || errno != EAGAIN) {
+        fprintf(stderr, "operation past the bound: %s, expected %s\n", strerror(errno),
+                strerror(EAGAIN));
+        return -1;
+    }
+    if (ipc_async_submit(aq) == -1) {
+        fprintf(stderr, "submit: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int seen[OPS] = {0};
+    long bytes = 0;
+    for (unsigned got = 0; got < OPS;) {
+        IPC_Completion c[OPS];
+        int n = ipc_async_complete(aq, c, OPS - got, 1);
+        if (n == -1) {
+            fprintf(stderr, "complete after %u: %s\n", got, strerror(errno));
+            return -1;
+        }
+        for (int i = 0; i < n; i++) {
+            if (c[i].user_data >= OPS || seen[c[i].user_data]++) {
+                fprintf(stderr, "unexpected completion %llu\n",
+                        (unsigned long long)c[i].user_data);
+                return -1;
+            }
+            if (c[i].result < 0) {
+                fprintf(stderr, "operation %llu: %s\n", (unsigned long long)c[i].user_data,
+                        strerror(-c[i].result));
+                return -1;
+            }
+            bytes += c[i].result;
+        }
+        got += (unsigned)n;
+    }
+    if (bytes != 2L * (OPS / 2) * MSG_LEN) {
+        fprintf(stderr, "moved %ld bytes, expected %ld\n", bytes, 2L * (OPS / 2) * MSG_LEN);
+        return -1;
+    }
+    printf("fifo batch         %d operations reaped, %ld bytes\n", OPS, bytes);
+    return 0;
+}
+
+int main(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    alarm(HANG_SECONDS);
+    for (unsigned i = 0; i < OPS; i++) memset(bufs[i], (int)i, MSG_LEN);
+
+    IPC_Async *aq = ipc_async_create(ENTRIES);
+    if (!aq) {
+        printf("fifo batch         skipped: %s\n", strerror(errno));
+        return 0;
+    }
+    char fifo[64];
+    snprintf(fifo, sizeof(fifo), "/tmp/ipc_async_%d", getpid());
+    IPC_Config cfg = { .mech = IPC_PIPE_NAMED, .name = fifo, .size = MSG_LEN };
+    IPC_Handle h = ipc_init(&cfg);
+    if (!h) {
+        fprintf(stderr, "ipc_init: %s\n", strerror(errno));
+        ipc_async_destroy(aq);
+        return 1;
+    }
+    int failed = run(aq, h) == -1;
+    ipc_close(h);
+    unlink(fifo);
+    ipc_async_destroy(aq);
+    return failed;
+}
@@ -0,0 +1,68 @@
+// Fills IPC_PIPE_GIFT pipes and checks that sends past the capacity fail
+// instead of sleeping in vmsplice: EAGAIN under IPC_NONBLOCK, ETIMEDOUT
+// from ipc_send_timed. An alarm turns a hang into a failure.
+
+#define _GNU_SOURCE
+#include "ipc.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HANG_SECONDS 10
+#define MAX_SENDS    100000  // Far more pages than any pipe holds
+
+// Send pages until the pipe is full; returns how many went in, or -1 if
+// the failure was not the expected errno
+static long fill(IPC_Handle h, const char *page, size_t len, int timeout_ms, int expect) {
+    for (long n = 0; n < MAX_SENDS; n++) {
+        int ret = timeout_ms < 0 ? ipc_send(h, page, len) : ipc_send_timed(h, page, len, timeout_ms);
+        if (ret != -1) continue;
+        if (errno == expect) return n;
+        fprintf(stderr, "send %ld: %s, expected %s\n", n, strerror(errno), strerror(expect));
+        return -1;
+    }
+    fprintf(stderr, "pipe never filled\n");
+    return -1;
+}
+
+static int check(const char *label, IPC_Mechanism mech, const char *name, uint32_t flags,
+                 int timeout_ms, int expect, const char *page, size_t len) {
+    IPC_Config cfg = { .mech = mech, .name = name, .size = len, .flags = IPC_PIPE_GIFT | flags };
+    IPC_Handle h = ipc_init(&cfg);
+    if (!h) {
+        fprintf(stderr, "%-18s ipc_init: %s\n", label, strerror(errno));
+        return -1;
+    }
+    long n = fill(h, page, len, timeout_ms, expect);
+    if (n != -1) printf("%-18s full after %ld pages: %s\n", label, n, strerror(expect));
+    ipc_close(h);
+    if (mech == IPC_PIPE_NAMED) unlink(name);
+    return n == -1 ? -1 : 0;
+}
+
+int main(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    alarm(HANG_SECONDS);
+    size_t len = (size_t)sysconf(_SC_PAGESIZE);
+    char *page;
+    if (posix_memalign((void **)&page, len, len) != 0) {
+        perror("posix_memalign");
+        return 1;
+    }
+    memset(page, 0x5a, len);
+
+    char fifo[64];
+    snprintf(fifo, sizeof(fifo), "/tmp/ipc_gift_%d", getpid());
+    int failed = 0;
+    if (check("named nonblock", IPC_PIPE_NAMED, fifo, IPC_NONBLOCK, -1, EAGAIN, page, len) == -1 ||
+        check("named timed", IPC_PIPE_NAMED, fifo, 0, 20, ETIMEDOUT, page, len) == -1 ||
+        check("unnamed nonblock", IPC_PIPE_UNNAMED, "gift", IPC_NONBLOCK, -1, EAGAIN, page,
+              len) == -1 ||
+        check("unnamed timed", IPC_PIPE_UNNAMED, "gift", 0, 20, ETIMEDOUT, page, len) == -1) {
+        failed = 1;
+    }
+    free(page);
+    return failed;
+}
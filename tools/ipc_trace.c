@@ -0,0 +1,219 @@
+// Offline analysis of ipc_trace_start() files.
+//
+// Reads the traces of a producer and a consumer (or any number of
+// processes), pairs the n-th message sent on each channel with the n-th
+// received, and reports the latency distribution per channel together with
+// the slowest messages. Each one is broken down into time inside the send
+// call, time between the two calls, and time inside the receive call, which
+// tells a stalled sender from a slow consumer from a late-waking receiver.
+//
+//   ipc_trace [-n slowest] trace-file...
+
+#include "ipc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define DEFAULT_SLOWEST 10
+
+typedef struct {
+    uint64_t channel;
+    uint64_t seq;    // First message of the call
+    uint64_t count;
+    uint64_t start;  // Ticks when the call was entered
+    uint64_t end;
+} Call;
+
+typedef struct {
+    uint64_t channel;
+    uint64_t seq;
+    double total_ns;  // Send call entered to receive call returned
+    double send_ns;
+    double gap_ns;    // Send returned to receive entered; negative when the
+                      // receiver was already waiting
+    double recv_ns;
+} Sample;
+
+typedef struct {
+    Call *v;
+    size_t n, cap;
+} CallVec;
+
+static void push_call(CallVec *vec, const IPC_TraceEvent *ev) {
+    if (vec->n == vec->cap) {
+        vec->cap = vec->cap ? vec->cap * 2 : 4096;
+        vec->v = realloc(vec->v, vec->cap * sizeof(Call));
+        if (!vec->v) {
+            perror("realloc");
+            exit(1);
+        }
+    }
+    Call *c = &vec->v[vec->n++];
+    c->channel = ev->channel;
+    c->seq = ev->seq;
+    c->count = ev->count;
+    c->start = ev->start;
+    c->end = ev->ticks;
+}
+
+static int cmp_call(const void *a, const void *b) {
+    const Call *x = a, *y = b;
+    if (x->channel != y->channel) return x->channel < y->channel ? -1 : 1;
+    if (x->seq != y->seq) return x->seq < y->seq ? -1 : 1;
+    return 0;
+}
+
+static int cmp_sample(const void *a, const void *b) {
+    const Sample *x = a, *y = b;
+    if (x->channel != y->channel) return x->channel < y->channel ? -1 : 1;
+    if (x->total_ns != y->total_ns) return x->total_ns < y->total_ns ? -1 : 1;
+    return 0;
+}
+
+// Send call on channel that carried message seq, or NULL
+static const Call *find_send(const CallVec *sends, uint64_t channel, uint64_t seq) {
+    size_t lo = 0, hi = sends->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const Call *c = &sends->v[mid];
+        if (c->channel < channel || (c->channel == channel && c->seq + c->count <= seq)) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == sends->n) return NULL;
+    const Call *c = &sends->v[lo];
+    return c->channel == channel && c->seq <= seq ? c : NULL;
+}
+
+// Returns the number of events, or -1. Updates the widest calibration span.
+static long load_trace(const char *path, CallVec *sends, CallVec *recvs, uint64_t *span_ticks,
+                       uint64_t *span_ns) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    IPC_TraceHeader hdr;
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != IPC_TRACE_MAGIC ||
+        hdr.version != IPC_TRACE_VERSION || hdr.event_size != sizeof(IPC_TraceEvent)) {
+        fprintf(stderr, "%s: not a version %u trace\n", path, IPC_TRACE_VERSION);
+        fclose(f);
+        return -1;
+    }
+    long n = 0;
+    IPC_TraceEvent ev;
+    while ((uint64_t)n < hdr.events && fread(&ev, sizeof(ev), 1, f) == 1) {
+        n++;
+        if (ev.result < 0 || ev.count == 0) continue;
+        if (ev.op == IPC_TRACE_SEND) push_call(sends, &ev);
+        else if (ev.op == IPC_TRACE_RECV) push_call(recvs, &ev);
+    }
+    fclose(f);
+    if (hdr.ticks1 - hdr.ticks0 > *span_ticks && hdr.ns1 > hdr.ns0) {
+        *span_ticks = hdr.ticks1 - hdr.ticks0;
+        *span_ns = hdr.ns1 - hdr.ns0;
+    }
+    printf("%s: pid %u, %ld events", path, hdr.pid, n);
+    if (hdr.dropped) printf(", %llu dropped", (unsigned long long)hdr.dropped);
+    printf("\n");
+    return n;
+}
+
+static double pct(const Sample *s, size_t n, double p) {
+    size_t i = (size_t)(p / 100 * (double)n);
+    return s[i < n ? i : n - 1].total_ns;
+}
+
+static void report(Sample *s, size_t n, uint64_t unmatched, unsigned slowest) {
+    printf("\nchannel %016llx: %zu messages", (unsigned long long)s[0].channel, n);
+    if (unmatched) printf(", %llu received without a traced send", (unsigned long long)unmatched);
+    printf("\n  ns: min %.0f  p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f  p99.99 %.0f  max %.0f\n",
+           s[0].total_ns, pct(s, n, 50), pct(s, n, 90), pct(s, n, 99), pct(s, n, 99.9),
+           pct(s, n, 99.99), s[n - 1].total_ns);
+    if (slowest == 0) return;
+    printf("  slowest:        seq      total_ns       send_ns        gap_ns       recv_ns\n");
+    for (size_t i = 0; i < slowest && i < n; i++) {
+        const Sample *x = &s[n - 1 - i];
+        printf("  %19llu %13.0f %13.0f %13.0f %13.0f\n", (unsigned long long)x->seq,
+               x->total_ns, x->send_ns, x->gap_ns, x->recv_ns);
+    }
+}
+
+int main(int argc, char **argv) {
+    unsigned slowest = DEFAULT_SLOWEST;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:h")) != -1) {
+        if (opt == 'n') {
+            slowest = (unsigned)strtoul(optarg, NULL, 10);
+        } else {
+            fprintf(stderr, "usage: %s [-n slowest] trace-file...\n", argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-n slowest] trace-file...\n", argv[0]);
+        return 2;
+    }
+
+    CallVec sends = { 0 }, recvs = { 0 };
+    uint64_t span_ticks = 0, span_ns = 0;
+    for (int i = optind; i < argc; i++) {
+        if (load_trace(argv[i], &sends, &recvs, &span_ticks, &span_ns) == -1) return 1;
+    }
+    // Every process reads the same counter, so one calibration serves all
+    double ns_per_tick = span_ticks ? (double)span_ns / (double)span_ticks : 1.0;
+
+    qsort(sends.v, sends.n, sizeof(Call), cmp_call);
+    size_t total = 0;
+    for (size_t i = 0; i < recvs.n; i++) total += recvs.v[i].count;
+    Sample *samples = malloc((total ? total : 1) * sizeof(Sample));
+    uint64_t *unmatched = calloc(recvs.n ? recvs.n : 1, sizeof(uint64_t));
+    if (!samples || !unmatched) {
+        perror("malloc");
+        return 1;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < recvs.n; i++) {
+        const Call *r = &recvs.v[i];
+        for (uint64_t k = 0; k < r->count; k++) {
+            const Call *snd = find_send(&sends, r->channel, r->seq + k);
+            if (!snd) {
+                unmatched[i]++;
+                continue;
+            }
+            Sample *x = &samples[n++];
+            x->channel = r->channel;
+            x->seq = r->seq + k;
+            x->total_ns = (double)(int64_t)(r->end - snd->start) * ns_per_tick;
+            x->send_ns = (double)(snd->end - snd->start) * ns_per_tick;
+            x->gap_ns = (double)(int64_t)(r->start - snd->end) * ns_per_tick;
+            x->recv_ns = (double)(r->end - r->start) * ns_per_tick;
+        }
+    }
+    if (n == 0) {
+        printf("\nno message was both sent and received in these traces\n");
+        return 0;
+    }
+    qsort(samples, n, sizeof(Sample), cmp_sample);
+
+    for (size_t lo = 0; lo < n;) {
+        size_t hi = lo;
+        while (hi < n && samples[hi].channel == samples[lo].channel) hi++;
+        uint64_t missing = 0;
+        for (size_t i = 0; i < recvs.n; i++) {
+            if (recvs.v[i].channel == samples[lo].channel) missing += unmatched[i];
+        }
+        report(&samples[lo], hi - lo, missing, slowest);
+        lo = hi;
+    }
+    free(samples);
+    free(unmatched);
+    free(sends.v);
+    free(recvs.v);
+    return 0;
+}